@@ -69,7 +69,11 @@ readLine(int fd, void *buffer, size_t sz)
 	return totRead;
 }
 
-/* Ref: http://www.paulgriffiths.net/program/c/srcs/echoservsrc.html */
+/*
+ * Write all of `n' bytes; -1 on the first error but EINTR (EAGAIN
+ * included: a non-blocking socket is the caller's to wait on)
+ * Ref: http://www.paulgriffiths.net/program/c/srcs/echoservsrc.html
+ */
 ssize_t
 writeLine(int sockd, const void *vptr, size_t n) {
 	size_t nleft;
@@ -80,9 +84,11 @@ writeLine(int sockd, const void *vptr, size_t n) {
 	nleft  = n;
 
 	while (nleft > 0) {
-		if ((nwritten = write(sockd, buffer, nleft)) <= 0)
+		if ((nwritten = write(sockd, buffer, nleft)) == -1) {
 			if (errno == EINTR)
-				nwritten = 0;
+				continue;
+			return -1;
+		}
 		nleft  -= nwritten;
 		buffer += nwritten;
 	}
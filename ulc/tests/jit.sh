@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# Run every test program with and without the JIT, which compiles
+# each function as soon as it is called (or loops), and compare what
+# they write; then compare it with what the same program writes built
+# unoptimized (ulcc -n), as stack code (ulcc -s), and both.  Then
+# divide LONG_MIN by -1, and run two programs on one machine.  Run from
+# the ulc directory, after make.
+#
+
+ULCC=${ULCC:-./ulcc}
+ULCI=${ULCI:-./ulci}
+INPUT="8 2 7 5 3"
+failed=0
+
+for src in tests/*.ul tests/progs/*.ul; do
+	ulb=${src%.ul}.ulb
+	# some are meant not to compile
+	$ULCC "$src" >/dev/null 2>&1 || continue
+
+	want=$(echo $INPUT | $ULCI "$ulb" 2>&1; echo "exit $?")
+	got=$(echo $INPUT | $ULCI -c 1 "$ulb" 2>&1; echo "exit $?")
+	if [ "$want" != "$got" ]; then
+		echo "FAIL $src"
+		echo "interpreted:"; echo "$want"
+		echo "compiled:"; echo "$got"
+		failed=1
+	fi
+
+	for flags in "-n" "-s" "-n -s"; do
+		if ! $ULCC $flags "$src" >/dev/null 2>&1; then
+			echo "FAIL $src: ulcc $flags does not compile it"
+			failed=1
+			continue
+		fi
+		got=$(echo $INPUT | $ULCI "$ulb" 2>&1; echo "exit $?")
+		if [ "$want" != "$got" ]; then
+			echo "FAIL $src"
+			echo "ulcc:"; echo "$want"
+			echo "ulcc $flags:"; echo "$got"
+			failed=1
+		fi
+	done
+done
+
+# the one division which does not fit: LONG_MIN / -1 wraps around,
+# interpreted or not, rather than trapping
+min=-9223372036854775808
+want=$(for i in 1 2 3; do echo $min; echo 0; echo $min; echo 0; done;
+    echo "exit 0")
+for flags in "" "-n" "-s"; do
+	$ULCC $flags tests/test_div.ul >/dev/null 2>&1 || continue
+	for run in "$ULCI" "$ULCI -c 1"; do
+		got=$(echo $min -1 | $run tests/test_div.ulb 2>&1; echo "exit $?")
+		if [ "$want" != "$got" ]; then
+			echo "FAIL tests/test_div.ul, ulcc $flags, $run:"; echo "$got"
+			failed=1
+		fi
+	done
+done
+
+# two programs on one machine, as uws runs its pages: nothing the
+# first one reads may show in the second one's locals
+for flags in "" "-s"; do
+	$ULCC $flags tests/reuse/secret.ul >/dev/null 2>&1 &&
+	    $ULCC $flags tests/reuse/peek.ul >/dev/null 2>&1 || {
+		echo "FAIL tests/reuse: ulcc $flags does not compile it"
+		failed=1
+		continue
+	}
+	for run in "$ULCI" "$ULCI -c 1"; do
+		got=$(echo 31337 | $run tests/reuse/secret.ulb \
+		    tests/reuse/peek.ulb 2>&1)
+		if [ "$got" != "$(printf '0\n0')" ]; then
+			echo "FAIL tests/reuse, ulcc $flags, $run:"; echo "$got"
+			failed=1
+		fi
+	done
+done
+
+[ $failed = 0 ] && echo "jit: all passed"
+exit $failed
@@ -1,4 +1,9 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "ulc_codegen.h"
 #include "ulc_vm.h"
@@ -14,12 +19,144 @@ static int code_offset = 0;
 /* keep track of the entrypoint's offset */
 static int main_offset = 0;
 
+/* the functions, and where each one starts, for the symbols */
+static struct function {
+	char *name;
+	int at;  // -1 once its code is gone
+} functions[SEC_CODE_SZ];
+static int nfunctions = 0;
+
+/* write the stack code as is, rather than register code? */
+static bool stack_target = false;
+/* improve the stack code before it is translated or written? */
+static bool optimize_code = true;
+static bool optimized = false;
+
+/*
+ * For the optimizer: the instructions it takes out (until the code
+ * is compacted), those jumps go to, and the LODIs pushing a CALL's
+ * return address, whose value is a code address too
+ */
+static bool dropped[SEC_CODE_SZ];
+static bool target[SEC_CODE_SZ + 1];
+static bool ret_addr[SEC_CODE_SZ];
+
+/* the jump for a comparison followed by JMPZ: taken when it is false */
+static const OpCode fused_jmpz[END] = {
+	[LT] = JGE, [LE] = JGT, [GT] = JLE, [GE] = JLT, [EQ] = JNE,
+	[NEQ] = JEQ,
+};
+
+/*
+ * Register code, translated from the stack code once it is all
+ * there.  Each stack slot of a function gets a register of its own
+ * (a temporary), after those of its parameters and locals; but a
+ * value pushed only to be used by the next operation is not moved
+ * there when it can be read from where it already is: a local's
+ * register, a global, or the instruction itself if it is a constant
+ */
+typedef enum {
+	V_TEMP,   // in the slot's temporary already
+	V_LOCAL,  // in a local's register
+	V_GLOBAL, // in a global
+	V_IMM     // a constant
+} ValueKind;
+
+typedef struct value {
+	ValueKind kind;
+	long val;  // the register, global or constant
+} Value;
+
+static RegInstruction reg_code[SEC_CODE_SZ];
+static int reg_offset = 0;
+static bool translated = false;
+
+/* where each stack instruction went, and which ones are jumped to */
+static int reg_of[SEC_CODE_SZ + 1];
+static bool jumped_to[SEC_CODE_SZ + 1];
+
+/* the stack of the function being translated */
+static Value stack[SEC_DATA_SZ];
+static int depth;
+static int nlocals;    // registers of its parameters and locals
+static int frame;      // ... and temporaries: what its ENTER asks for
+static int enter_at;   // where that ENTER is
+static int last_temp;  // the temporary the last instruction wrote, or -1
+
+/* register ops for stack ops, and for the same with a constant second */
+static const RegOpCode reg_ops[END] = {
+	[LT] = RLT, [LE] = RLE, [GT] = RGT, [GE] = RGE, [EQ] = REQ,
+	[NEQ] = RNEQ, [ADD] = RADD, [SUB] = RSUB, [MUL] = RMUL, [DIV] = RDIV,
+	[MOD] = RMOD, [POW] = RPOW, [AND] = RAND, [OR] = ROR,
+	[JLT] = RJLT, [JLE] = RJLE, [JGT] = RJGT, [JGE] = RJGE, [JEQ] = RJEQ,
+	[JNE] = RJNE,
+};
+static const RegOpCode imm_ops[END] = {
+	[LT] = RLTI, [LE] = RLEI, [GT] = RGTI, [GE] = RGEI, [EQ] = REQI,
+	[NEQ] = RNEQI, [ADD] = RADDI, [SUB] = RSUBI, [MUL] = RMULI,
+	[DIV] = RDIVI, [MOD] = RMODI, [JLT] = RJLTI, [JLE] = RJLEI,
+	[JGT] = RJGTI, [JGE] = RJGEI, [JEQ] = RJEQI, [JNE] = RJNEI,
+};
+/* the same, operands swapped, for a constant first */
+static const OpCode swapped[END] = {
+	[LT] = GT, [LE] = GE, [GT] = LT, [GE] = LE, [EQ] = EQ, [NEQ] = NEQ,
+	[ADD] = ADD, [MUL] = MUL, [JLT] = JGT, [JLE] = JGE, [JGT] = JLT,
+	[JGE] = JLE, [JEQ] = JEQ, [JNE] = JNE,
+};
+
+static ImageInsn pack(int op, int a, long b, long c, int64_t *pool,
+    uint32_t *npool);
+static size_t section_entry(SectionKind kind);
+static uint64_t padded(uint64_t size);
+static void write_padded(FILE *fd, const void *p, size_t size);
+static void optimize();
+static void find_targets();
+static void find_return_addresses();
+static bool fold();
+static bool fold_binary(OpCode op, long x, long y, long *v);
+static bool fuse();
+static bool thread_jumps();
+static bool drop_unreachable();
+static void compact();
+static int  live(int i);
+static bool is_jump(OpCode op);
+static void translate();
+static void fuse_registers();
+static bool is_reg_jump(RegOpCode op);
+static void begin_function(int locals);
+static void end_function();
+static void binary(OpCode op);
+static void branch(OpCode op, long target);
+static void store_local(int r, int d);
+static void store_global(long g, int d);
+static void call(int nargs, long target);
+static void unalias(ValueKind kind, long val);
+static void flush();
+static int  operand(int d);
+static int  push(ValueKind kind, long val);
+static int  pop();
+static int  temp(int d);
+static int  emit(RegOpCode op, int a, long b, long c);
+
 int
 alloc_data()
 {
 	return data_offset++;
 }
 
+/*
+ * Room in the globals for an array of `len' elements, after the slot
+ * for its length; the address of that slot
+ */
+int
+alloc_array(long len)
+{
+	int at = data_offset;
+
+	data_offset += len + 1;
+	return at;
+}
+
 int
 alloc_code()
 {
@@ -57,6 +194,8 @@ void
 prnt_code()
 {
 	int i;
+
+	optimize();
 	printf("CODE:\n");
 	printf("%-8s%-10s%-5s%-5s\n", "Opcode", "Name", "Arg1", "Arg2");
 	for(i = 0; i < code_offset; i++)
@@ -65,25 +204,168 @@ prnt_code()
 	printf("\nREGS:\n");
 	printf("data offset = %d\ncode offset = %d\nmain offset = %d\n",
 			data_offset, code_offset, main_offset);
+
+	if (stack_target)
+		return;
+
+	translate();
+	printf("\nREGISTER CODE:\n");
+	printf("%-8s%-10s%-5s%-6s%-5s\n", "Opcode", "Name", "A", "B", "C");
+	for(i = 0; i < reg_offset; i++)
+		printf("%-8d%-10s%-5d%-5ld %-5ld\n", i, reg_op_names[reg_code[i].op],
+			reg_code[i].a, reg_code[i].b, reg_code[i].c);
+	printf("\nentry = %d\n", reg_of[main_offset]);
 }
 
+/*
+ * Write the program out, as ulc_vm.h has it: the header, the section
+ * table, the code, the constants too wide for it, and the functions'
+ * names and where they start
+ */
 void
 save_code(const char *fname)
 {
+	ImageHeader head = {IMG_MAGIC, IMG_VERSION, 0, 0, 0};
+	ImageSection sect[5];
+	ImageInsn *code;
+	ImageSym *syms;
+	int64_t *pool;
+	char *names;
+	uint32_t npool = 0, nsyms = 0, nnames = 0;
+	size_t len = 0;
+	uint64_t at;
 	FILE *fd = NULL;
+	int i, n;
+
 	if (!(fd = fopen(fname, "w")))
 		fatal("Could not open bytecodes file\n");
 
-	section_code[code_offset].op = END;
-	section_code[code_offset].arg1 = 0;
-	section_code[code_offset++].arg2 = data_offset;
+	optimize();
+	if (!stack_target)
+		translate();
+
+	n = stack_target ? code_offset : reg_offset;
+	code = calloc(n, sizeof(*code));
+	pool = calloc(2 * n, sizeof(*pool));
+	for (i = 0; i < nfunctions; i++)
+		len += strlen(functions[i].name) + 1;
+	syms = calloc(nfunctions + 1, sizeof(*syms));
+	names = calloc(len + 1, 1);
+	if (!code || !pool || !syms || !names)
+		fatal("%s: could not allocate memory\n", getprogname());
+
+	for (i = 0; i < n; i++)
+		code[i] = stack_target ?
+		    pack(section_code[i].op, 0, section_code[i].arg1,
+		    section_code[i].arg2, pool, &npool) :
+		    pack(reg_code[i].op, reg_code[i].a, reg_code[i].b,
+		    reg_code[i].c, pool, &npool);
+
+	for (i = 0; i < nfunctions; i++) {
+		if (functions[i].at < 0)
+			continue;
+		syms[nsyms].at = stack_target ? functions[i].at :
+		    reg_of[functions[i].at];
+		syms[nsyms++].name = nnames;
+		len = strlen(functions[i].name) + 1;
+		memcpy(names + nnames, functions[i].name, len);
+		nnames += len;
+	}
+
+	head.ndata = data_offset;
+	head.entry = stack_target ? main_offset : reg_of[main_offset];
+	sect[0] = (ImageSection) {stack_target ? SECT_STACK : SECT_REGS, n, 0};
+	sect[1] = (ImageSection) {SECT_CONST, npool, 0};
+	sect[2] = (ImageSection) {SECT_SYMS, nsyms, 0};
+	sect[3] = (ImageSection) {SECT_NAMES, nnames, 0};
+	head.nsections = 4;
 
-	section_code[code_offset].op = END;
-	section_code[code_offset].arg1 = 0;
-	section_code[code_offset].arg2 = main_offset;
+	// each section right after the one before, at a multiple of 8
+	at = sizeof(head) + head.nsections * sizeof(*sect);
+	for (i = 0; i < head.nsections; i++) {
+		sect[i].offset = at;
+		at += padded(sect[i].count * section_entry(sect[i].kind));
+	}
 
-	fwrite(section_code, sizeof(Instruction), code_offset + 1, fd);
+	fwrite(&head, sizeof(head), 1, fd);
+	fwrite(sect, sizeof(*sect), head.nsections, fd);
+	write_padded(fd, code, n * sizeof(*code));
+	write_padded(fd, pool, npool * sizeof(*pool));
+	write_padded(fd, syms, nsyms * sizeof(*syms));
+	write_padded(fd, names, nnames);
 	fclose(fd);
+
+	free(code);
+	free(pool);
+	free(syms);
+	free(names);
+}
+
+/*
+ * An instruction for the file; operands which do not fit in it go to
+ * the constant pool
+ */
+static ImageInsn
+pack(int op, int a, long b, long c, int64_t *pool, uint32_t *npool)
+{
+	ImageInsn ii = {(uint32_t) op | (uint32_t) a << 8, b, c};
+
+	if (b != (int32_t) b) {
+		ii.op |= IMG_BIG_B;
+		ii.b = *npool;
+		pool[(*npool)++] = b;
+	}
+	if (c != (int32_t) c) {
+		ii.op |= IMG_BIG_C;
+		ii.c = *npool;
+		pool[(*npool)++] = c;
+	}
+	return ii;
+}
+
+/* the size of an entry of a section */
+static size_t
+section_entry(SectionKind kind)
+{
+	switch (kind) {
+	case SECT_STACK:
+	case SECT_REGS:
+		return sizeof(ImageInsn);
+	case SECT_CONST:
+		return sizeof(int64_t);
+	case SECT_SYMS:
+		return sizeof(ImageSym);
+	default:
+		return 1;
+	}
+}
+
+static uint64_t
+padded(uint64_t size)
+{
+	return (size + 7) & ~(uint64_t) 7;
+}
+
+static void
+write_padded(FILE *fd, const void *p, size_t size)
+{
+	static const char zeros[8];
+
+	fwrite(p, 1, size, fd);
+	fwrite(zeros, 1, padded(size) - size, fd);
+}
+
+/*
+ * The code from here on is the function `name''s
+ */
+void
+name_code(const char *name)
+{
+	if (nfunctions == SEC_CODE_SZ)
+		return;
+	if (!(functions[nfunctions].name = strdup(name)))
+		fatal("%s: could not allocate memory\n", getprogname());
+	functions[nfunctions++].at = code_offset;
 }
 
 void
@@ -91,3 +373,814 @@ set_main_offset(int offset)
 {
 	main_offset = offset;
 }
+
+void
+set_stack_target(bool stack)
+{
+	stack_target = stack;
+}
+
+void
+set_optimize(bool optimize)
+{
+	optimize_code = optimize;
+}
+
+/*
+ * Improve the stack code: fold constant expressions, fuse comparisons
+ * with the JMPZ after them, send jumps to jumps straight to where
+ * they end up, and take out code which can never run.  Rounds of
+ * that, each followed by compacting the code, until nothing changes
+ */
+static void
+optimize()
+{
+	bool changed;
+
+	if (optimized || !optimize_code)
+		return;
+	optimized = true;
+
+	find_return_addresses();
+	do {
+		find_targets();
+		changed = fold();
+		changed |= fuse();
+		changed |= thread_jumps();
+		changed |= drop_unreachable();
+		compact();
+	} while (changed);
+}
+
+static void
+find_targets()
+{
+	int i;
+
+	memset(target, 0, sizeof(target));
+	for (i = 0; i < code_offset; i++)
+		if (is_jump(section_code[i].op) && section_code[i].arg2 >= 0 &&
+		    section_code[i].arg2 <= code_offset)
+			target[section_code[i].arg2] = true;
+}
+
+/*
+ * Follow the stack as translate() does, to tell which slot each CALL
+ * finds its return address in, and so which LODI pushed it
+ */
+static void
+find_return_addresses()
+{
+	static int pushed_by[SEC_DATA_SZ];
+	Instruction *ins;
+	int i, sp = 0, base;
+
+	for (i = 0; i < code_offset; i++) {
+		ins = &section_code[i];
+		switch (ins->op) {
+		case ENTER:
+			sp = 0;
+			break;
+		case LODI:
+		case LODV:
+		case LODL:
+		case LODA:
+			if (sp < SEC_DATA_SZ)
+				pushed_by[sp++] = i;
+			break;
+		case IN:
+			if (ins->arg1 == -1 && sp < SEC_DATA_SZ)
+				pushed_by[sp++] = i;
+			break;
+		case STO:
+		case STOL:
+		case OUT:
+		case JMPZ:
+		case RET:
+			sp -= sp > 0;
+			break;
+		case FILL:
+		case COPY:
+			sp -= sp > 1 ? 2 : sp;
+			break;
+		case STOX:
+			sp -= sp > 2 ? 3 : sp;
+			break;
+		case CALL:
+			if ((base = sp - ins->arg1 - 1) < 0)
+				break;
+			if (section_code[pushed_by[base]].op == LODI)
+				ret_addr[pushed_by[base]] = true;
+			pushed_by[base] = i;
+			sp = base + 1;
+			break;
+		case NEG:
+		case NOT:
+			if (sp > 0)
+				pushed_by[sp - 1] = i;
+			break;
+		case HLT:
+		case JMP:
+		case INL:
+		case END:
+			break;
+		default:
+			// binary operators, and the jumps fused with them
+			sp -= sp > 0;
+			if (is_jump(ins->op))
+				sp -= sp > 0;
+			else if (sp > 0)
+				pushed_by[sp - 1] = i;
+			break;
+		}
+	}
+}
+
+/*
+ * Constant operands: LODI x, LODI y, ADD is LODI x+y; LODI x, NEG is
+ * LODI -x; LODI x, JMPZ is either a JMP or nothing at all
+ */
+static bool
+fold()
+{
+	Instruction *ins = section_code;
+	bool changed = false;
+	int i, j, k;
+	long v;
+
+	for (i = live(0); i < code_offset; ) {
+		j = live(i + 1);
+		if (ins[i].op != LODI || ret_addr[i] || j >= code_offset ||
+		    target[j]) {
+			i = j;
+			continue;
+		}
+
+		k = live(j + 1);
+		switch (ins[j].op) {
+		case NEG:
+			ins[i].arg2 = -(unsigned long) ins[i].arg2;
+			break;
+		case NOT:
+			ins[i].arg2 = !ins[i].arg2;
+			break;
+		case JMPZ:
+			if (ins[i].arg2 == 0) {
+				ins[i].op = JMP;
+				ins[i].arg2 = ins[j].arg2;
+			} else {
+				dropped[i] = true;
+			}
+			break;
+		case LODI:
+			if (!ret_addr[j] && k < code_offset && !target[k] &&
+			    fold_binary(ins[k].op, ins[i].arg2, ins[j].arg2, &v)) {
+				ins[i].arg2 = v;
+				dropped[k] = true;
+				break;
+			}
+			// fall through
+		default:
+			i = j;
+			continue;
+		}
+
+		// and see if the result folds again
+		dropped[j] = true;
+		changed = true;
+		i = live(i);
+	}
+
+	return changed;
+}
+
+/*
+ * What `x op y' gives when the program runs; false if it has to run
+ * to tell (a division by zero)
+ */
+static bool
+fold_binary(OpCode op, long x, long y, long *v)
+{
+	switch (op) {
+	case LT:  *v = x <  y; break;
+	case LE:  *v = x <= y; break;
+	case GT:  *v = x >  y; break;
+	case GE:  *v = x >= y; break;
+	case EQ:  *v = x == y; break;
+	case NEQ: *v = x != y; break;
+	case AND: *v = x && y; break;
+	case OR:  *v = x || y; break;
+	// wrapping around, as the machine does
+	case ADD: *v = (unsigned long) x + y; break;
+	case SUB: *v = (unsigned long) x - y; break;
+	case MUL: *v = (unsigned long) x * y; break;
+	case DIV:
+	case MOD:
+		if (y == 0 || (x == LONG_MIN && y == -1))
+			return false;
+		*v = op == DIV ? x / y : x % y;
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * A comparison and the JMPZ after it become a single jump
+ */
+static bool
+fuse()
+{
+	Instruction *ins = section_code;
+	bool changed = false;
+	int i, j;
+
+	for (i = live(0); i < code_offset; i = j) {
+		j = live(i + 1);
+		if (ins[i].op < 0 || ins[i].op >= END || !fused_jmpz[ins[i].op] ||
+		    j >= code_offset || ins[j].op != JMPZ || target[j])
+			continue;
+		ins[i].op = fused_jmpz[ins[i].op];
+		ins[i].arg2 = ins[j].arg2;
+		dropped[j] = true;
+		changed = true;
+		j = live(j + 1);
+	}
+
+	return changed;
+}
+
+/*
+ * Jumps to a JMP go where it goes; a JMP to the next instruction is
+ * no jump at all
+ */
+static bool
+thread_jumps()
+{
+	Instruction *ins = section_code;
+	bool changed = false;
+	int i, t, hops;
+
+	for (i = live(0); i < code_offset; i = live(i + 1)) {
+		if (!is_jump(ins[i].op) || ins[i].arg2 < 0 ||
+		    ins[i].arg2 > code_offset)
+			continue;
+
+		// a loop of JMPs is left alone
+		t = live(ins[i].arg2);
+		for (hops = 0; t < code_offset && ins[t].op == JMP &&
+		    hops < code_offset; hops++)
+			t = live(ins[t].arg2);
+		if (hops < code_offset && t != ins[i].arg2) {
+			ins[i].arg2 = t;
+			changed = true;
+		}
+
+		if (ins[i].op == JMP && live(ins[i].arg2) == live(i + 1)) {
+			dropped[i] = true;
+			changed = true;
+		}
+	}
+
+	return changed;
+}
+
+/*
+ * Take out what no path from the entry point gets to
+ */
+static bool
+drop_unreachable()
+{
+	static int work[SEC_CODE_SZ];
+	static bool seen[SEC_CODE_SZ];
+	Instruction *ins = section_code;
+	bool changed = false;
+	int n = 0, i, next[2], k;
+
+	memset(seen, 0, sizeof(seen));
+	if ((i = live(main_offset)) < code_offset) {
+		seen[i] = true;
+		work[n++] = i;
+	}
+
+	while (n > 0) {
+		i = work[--n];
+		next[0] = next[1] = code_offset;
+		if (ins[i].op != JMP && ins[i].op != RET && ins[i].op != HLT)
+			next[0] = live(i + 1);
+		if ((is_jump(ins[i].op) || ins[i].op == CALL) &&
+		    ins[i].arg2 >= 0 && ins[i].arg2 <= code_offset)
+			next[1] = live(ins[i].arg2);
+		for (k = 0; k < 2; k++)
+			if (next[k] < code_offset && !seen[next[k]]) {
+				seen[next[k]] = true;
+				work[n++] = next[k];
+			}
+	}
+
+	for (i = 0; i < code_offset; i++)
+		if (!dropped[i] && !seen[i]) {
+			dropped[i] = true;
+			changed = true;
+		}
+
+	return changed;
+}
+
+/*
+ * Squeeze out the dropped instructions, and move every code address
+ * along: jump and call targets, return addresses and the entry point
+ */
+static void
+compact()
+{
+	static int new_of[SEC_CODE_SZ + 1];
+	Instruction ins;
+	int i, n = 0;
+
+	for (i = 0; i < code_offset; i++) {
+		new_of[i] = n;
+		n += !dropped[i];
+	}
+	new_of[code_offset] = n;
+
+	for (i = 0; i < code_offset; i++) {
+		if (dropped[i])
+			continue;
+		ins = section_code[i];
+		if (ins.arg2 >= 0 && ins.arg2 <= code_offset &&
+		    (is_jump(ins.op) || ins.op == CALL))
+			ins.arg2 = new_of[ins.arg2];
+		else if (ret_addr[i] && ins.arg2 > 0 && ins.arg2 <= code_offset)
+			ins.arg2 = new_of[ins.arg2 - 1] + 1; // right after the CALL
+		section_code[new_of[i]] = ins;
+		ret_addr[new_of[i]] = ret_addr[i];
+	}
+
+	for (i = 0; i < nfunctions; i++)
+		if (functions[i].at >= 0)
+			functions[i].at = dropped[functions[i].at] ? -1 :
+			    new_of[functions[i].at];
+
+	for (i = n; i < code_offset; i++)
+		ret_addr[i] = false;
+	memset(dropped, 0, sizeof(dropped));
+	main_offset = new_of[main_offset];
+	code_offset = n;
+}
+
+/*
+ * The first instruction from `i' on which is still there
+ */
+static int
+live(int i)
+{
+	while (i < code_offset && dropped[i])
+		i++;
+	return i;
+}
+
+static bool
+is_jump(OpCode op)
+{
+	return op == JMP || op == JMPZ || (op >= JLT && op <= JNE);
+}
+
+/*
+ * Turn the stack code into register code, a function at a time,
+ * keeping track of what each stack slot holds.  Where control flow
+ * meets (at jumps and their targets) every slot is in its temporary
+ */
+static void
+translate()
+{
+	Instruction *ins;
+	int i, d, r;
+
+	if (translated)
+		return;
+	translated = true;
+
+	for (i = 0; i < code_offset; i++)
+		if (is_jump(section_code[i].op) &&
+		    section_code[i].arg2 >= 0 && section_code[i].arg2 <= code_offset)
+			jumped_to[section_code[i].arg2] = true;
+
+	// the code before the first function (globals' initialization)
+	// runs in a frame of its own, when there is any
+	if (code_offset == 0 || section_code[0].op != ENTER)
+		begin_function(0);
+
+	for (i = 0; i < code_offset; i++) {
+		ins = &section_code[i];
+		if (jumped_to[i])
+			flush();
+		reg_of[i] = reg_offset;
+
+		switch (ins->op) {
+		case HLT:
+			emit(RHLT, 0, 0, 0);
+			break;
+		case ENTER:
+			if (i > 0)
+				end_function();
+			begin_function(ins->arg2);
+			break;
+		case LODI:
+			push(V_IMM, ins->arg2);
+			break;
+		case LODV:
+			push(V_GLOBAL, ins->arg1 + ins->arg2);
+			break;
+		case LODL:
+			push(V_LOCAL, ins->arg2 - 1);
+			break;
+		case STO:
+			store_global(ins->arg1 + ins->arg2, pop());
+			break;
+		case STOL:
+			store_local(ins->arg2 - 1, pop());
+			break;
+		case IN:
+			if (ins->arg1 == -1) {
+				emit(RIN, temp(d = push(V_TEMP, 0)), 0, 0);
+				last_temp = temp(d);
+			} else {
+				unalias(V_GLOBAL, ins->arg1 + ins->arg2);
+				d = push(V_TEMP, 0);
+				emit(RIN, temp(d), 0, 0);
+				store_global(ins->arg1 + ins->arg2, pop());
+			}
+			break;
+		case INL:
+			unalias(V_LOCAL, ins->arg2 - 1);
+			emit(RIN, ins->arg2 - 1, 0, 0);
+			break;
+		case OUT:
+			emit(ROUT, operand(pop()), 0, 0);
+			break;
+		case NEG:
+		case NOT:
+			r = operand(d = pop());
+			emit(ins->op == NEG ? RNEG : RNOT, temp(d), r, 0);
+			push(V_TEMP, 0);
+			last_temp = temp(d);
+			break;
+		case JMP:
+			flush();
+			emit(RJMP, 0, ins->arg2, 0);
+			break;
+		case JMPZ:
+			d = operand(pop());
+			flush();
+			emit(RJMPZ, d, ins->arg2, 0);
+			break;
+		case JLT:
+		case JLE:
+		case JGT:
+		case JGE:
+		case JEQ:
+		case JNE:
+			branch(ins->op, ins->arg2);
+			break;
+		case CALL:
+			call(ins->arg1, ins->arg2);
+			break;
+		case LODA:
+			emit(RLEA, temp(d = push(V_TEMP, 0)), ins->arg2 - 1, 0);
+			last_temp = temp(d);
+			break;
+		case LODX:
+			r = operand(pop());
+			d = pop();
+			emit(RLDX, temp(d), operand(d), r);
+			push(V_TEMP, 0);
+			last_temp = temp(d);
+			break;
+		case STOX:
+			r = operand(pop());
+			d = operand(pop());
+			emit(RSTX, r, operand(pop()), d);
+			break;
+		case FILL:
+			r = operand(pop());
+			emit(RFILL, r, operand(pop()), 0);
+			break;
+		case COPY:
+			r = operand(pop());
+			emit(RCOPY, r, operand(pop()), 0);
+			break;
+		case RET:
+			emit(RRET, operand(pop()), 0, 0);
+			break;
+		default:
+			binary(ins->op);
+			break;
+		}
+	}
+	reg_of[code_offset] = reg_offset;
+	reg_of[0] = 0; // along with the ENTER before it
+	end_function();
+
+	// jumps were made to stack code addresses
+	for (i = 0; i < reg_offset; i++)
+		if (is_reg_jump(reg_code[i].op) &&
+		    reg_code[i].b >= 0 && reg_code[i].b <= code_offset)
+			reg_code[i].b = reg_of[reg_code[i].b];
+
+	if (optimize_code)
+		fuse_registers();
+}
+
+/*
+ * Superinstructions for the pairs register code runs most (ulci -g
+ * counts them): a CALL and the ENTER it goes to, and a loop's step
+ * and its JMP back
+ */
+static void
+fuse_registers()
+{
+	static bool is_target[SEC_CODE_SZ + 1];
+	static int new_of[SEC_CODE_SZ + 1];
+	RegInstruction *rc = reg_code;
+	int i, n = 0;
+
+	for (i = 0; i < reg_offset; i++) {
+		if (is_reg_jump(rc[i].op) && rc[i].b >= 0 && rc[i].b <= reg_offset)
+			is_target[rc[i].b] = true;
+		if (rc[i].op == RCALL && rc[i].b >= 0 && rc[i].b < reg_offset &&
+		    rc[rc[i].b].op == RENTER) {
+			rc[i].op = RCALLF;
+			rc[i].c = rc[rc[i].b].a;
+		}
+	}
+
+	// R[a] = R[a] + c (or - c), then JMP, unless it is jumped to
+	for (i = 0; i < reg_offset; i++) {
+		new_of[i] = n;
+		rc[n++] = rc[i];
+		if ((rc[i].op == RADDI ||
+		    (rc[i].op == RSUBI && rc[i].c != LONG_MIN)) &&
+		    rc[i].a == rc[i].b && i + 1 < reg_offset &&
+		    rc[i + 1].op == RJMP && !is_target[i + 1]) {
+			rc[n - 1].c = rc[i].op == RADDI ? rc[i].c : -rc[i].c;
+			rc[n - 1].op = RADDJ;
+			rc[n - 1].b = rc[i + 1].b;
+			new_of[++i] = n;
+		}
+	}
+	new_of[reg_offset] = n;
+
+	for (i = 0; i < n; i++)
+		if (is_reg_jump(rc[i].op) && rc[i].b >= 0 && rc[i].b <= reg_offset)
+			rc[i].b = new_of[rc[i].b];
+	for (i = 0; i <= code_offset; i++)
+		reg_of[i] = new_of[reg_of[i]];
+	reg_offset = n;
+}
+
+static bool
+is_reg_jump(RegOpCode op)
+{
+	return op == RJMP || op == RJMPZ || op == RCALL ||
+	    (op >= RJLT && op <= RADDJ);
+}
+
+static void
+begin_function(int locals)
+{
+	nlocals = frame = locals;
+	depth = 0;
+	enter_at = emit(RENTER, 0, 0, 0);
+}
+
+static void
+end_function()
+{
+	reg_code[enter_at].a = frame;
+}
+
+static void
+binary(OpCode op)
+{
+	int y = pop(), x = pop(), t, rx, ry;
+	int dst = temp(x); // the result goes where the first operand was
+
+	if (op < 0 || op >= END || !reg_ops[op])
+		fatal("%s: cannot translate %s\n", getprogname(), op_names[op]);
+
+	// a constant first, where the operands can go the other way round
+	if (stack[x].kind == V_IMM && stack[y].kind != V_IMM && swapped[op]) {
+		t = x; x = y; y = t;
+		op = swapped[op];
+	}
+
+	rx = operand(x);
+	if (stack[y].kind == V_IMM && imm_ops[op]) {
+		emit(imm_ops[op], dst, rx, stack[y].val);
+	} else {
+		ry = operand(y);
+		emit(reg_ops[op], dst, rx, ry);
+	}
+
+	push(V_TEMP, 0);
+	last_temp = dst;
+}
+
+/*
+ * A comparison fused with the jump after it: as binary(), but what
+ * it tells is where to go
+ */
+static void
+branch(OpCode op, long target)
+{
+	int y = pop(), x = pop(), t, rx, ry;
+
+	if (stack[x].kind == V_IMM && stack[y].kind != V_IMM) {
+		t = x; x = y; y = t;
+		op = swapped[op];
+	}
+
+	rx = operand(x);
+	if (stack[y].kind == V_IMM) {
+		flush();
+		emit(imm_ops[op], rx, target, stack[y].val);
+	} else {
+		ry = operand(y);
+		flush();
+		emit(reg_ops[op], rx, target, ry);
+	}
+}
+
+/*
+ * Whatever an instruction just computed goes straight to the local,
+ * rather than through a temporary, unless the stack still holds the
+ * local's old value to be read later
+ */
+static void
+store_local(int r, int d)
+{
+	int i, aliased = 0;
+
+	for (i = 0; i < depth; i++)
+		aliased |= stack[i].kind == V_LOCAL && stack[i].val == r;
+
+	if (!aliased && stack[d].kind == V_TEMP && last_temp == temp(d) &&
+	    reg_offset > 0 && reg_code[reg_offset - 1].a == temp(d)) {
+		reg_code[reg_offset - 1].a = r;
+		return;
+	}
+
+	unalias(V_LOCAL, r);
+	switch (stack[d].kind) {
+	case V_IMM:
+		emit(RLDI, r, stack[d].val, 0);
+		break;
+	case V_GLOBAL:
+		emit(RGETG, r, stack[d].val, 0);
+		break;
+	default:
+		emit(RMOV, r, operand(d), 0);
+		break;
+	}
+}
+
+static void
+store_global(long g, int d)
+{
+	int r = operand(d);
+
+	unalias(V_GLOBAL, g);
+	emit(RSETG, r, g, 0);
+}
+
+/*
+ * The return address the stack code pushed before the arguments
+ * marks the register the result goes to; the arguments go in the
+ * registers right after it, where the callee's parameters are
+ */
+static void
+call(int nargs, long target)
+{
+	int base = depth - nargs - 1, d, r;
+
+	if (base < 0)
+		fatal("%s: cannot translate a call\n", getprogname());
+
+	for (d = base + 1; d < depth; d++)
+		if ((r = operand(d)) != temp(d))
+			emit(RMOV, temp(d), r, 0);
+
+	// the callee may change any global
+	for (d = 0; d < base; d++)
+		if (stack[d].kind == V_GLOBAL)
+			operand(d);
+
+	emit(RCALL, temp(base), target, 0);
+	depth = base;
+	push(V_TEMP, 0);
+}
+
+/*
+ * Before a local or a global changes, load the old value wherever
+ * the stack still has it to be read later
+ */
+static void
+unalias(ValueKind kind, long val)
+{
+	int d;
+
+	for (d = 0; d < depth; d++)
+		if (stack[d].kind == kind && stack[d].val == val) {
+			if (kind == V_LOCAL)
+				emit(RMOV, temp(d), val, 0);
+			else
+				operand(d);
+			stack[d].kind = V_TEMP;
+		}
+}
+
+/*
+ * Put every slot in its temporary
+ */
+static void
+flush()
+{
+	int d, r;
+
+	for (d = 0; d < depth; d++)
+		if ((r = operand(d)) != temp(d)) {
+			emit(RMOV, temp(d), r, 0);
+			stack[d].kind = V_TEMP;
+		}
+	last_temp = -1;
+}
+
+/*
+ * The register to read a slot from, loading it into the slot's
+ * temporary if it is not in a register yet
+ */
+static int
+operand(int d)
+{
+	switch (stack[d].kind) {
+	case V_LOCAL:
+		return stack[d].val;
+	case V_IMM:
+		emit(RLDI, temp(d), stack[d].val, 0);
+		break;
+	case V_GLOBAL:
+		emit(RGETG, temp(d), stack[d].val, 0);
+		break;
+	case V_TEMP:
+		break;
+	}
+	stack[d].kind = V_TEMP;
+	return temp(d);
+}
+
+static int
+push(ValueKind kind, long val)
+{
+	if (depth >= SEC_DATA_SZ)
+		fatal("%s: expression too deep\n", getprogname());
+	stack[depth].kind = kind;
+	stack[depth].val = val;
+	if (temp(depth) >= frame)
+		frame = temp(depth) + 1;
+	return depth++;
+}
+
+/*
+ * Take the top slot off the stack; it stays readable until the
+ * next push
+ */
+static int
+pop()
+{
+	// what was left by the undefined, read as 0
+	if (depth == 0)
+		push(V_IMM, 0);
+	return --depth;
+}
+
+static int
+temp(int d)
+{
+	return nlocals + d;
+}
+
+static int
+emit(RegOpCode op, int a, long b, long c)
+{
+	if (reg_offset >= SEC_CODE_SZ)
+		fatal("%s: program too large\n", getprogname());
+	reg_code[reg_offset].op = op;
+	reg_code[reg_offset].a = a;
+	reg_code[reg_offset].b = b;
+	reg_code[reg_offset].c = c;
+	last_temp = -1;
+	return reg_offset++;
+}
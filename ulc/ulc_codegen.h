@@ -1,9 +1,12 @@
 #ifndef ulc_codegen_h
 #define ulc_codegen_h
 
+#include <stdbool.h>
+
 #include "ulc_vm.h"
 
 int alloc_data();
+int alloc_array(long);
 int alloc_code();
 int label_data();
 int label_code();
@@ -12,6 +15,9 @@ void gen_code(OpCode, long, long);
 void back_patch(int, OpCode, long);
 void prnt_code();
 void save_code(const char*);
+void name_code(const char*);
 void set_main_offset(int);
+void set_stack_target(bool);
+void set_optimize(bool);
 
 #endif
@@ -21,11 +21,17 @@ int main(int argc, char *argv[]) {
 
 	setprogname(argv[0]);
 
-	while ((opt = getopt(argc, argv, "d")) != -1) {
+	while ((opt = getopt(argc, argv, "dns")) != -1) {
 		switch(opt) {
 			case 'd':
 				stdoutFlag = true;
 				break;
+			case 'n':
+				set_optimize(false);
+				break;
+			case 's':
+				set_stack_target(true);
+				break;
 			case '?':
 				show_help();
 				break;
@@ -48,6 +54,7 @@ static int
 compile(const char* source) {
 	extern FILE* yyin;
 	extern int yyparse();
+	extern int errors;
 	char *fout = NULL;
 	size_t fsz;
 
@@ -56,7 +63,8 @@ compile(const char* source) {
 		fatal("Could not open %s\n", source);
 
 	/* Call the parser; currently a bison-generated parser */
-	yyparse();
+	if (yyparse() || errors)
+		exit(EXIT_FAILURE);
 
 	if (stdoutFlag)
 		prnt_code();
@@ -80,7 +88,9 @@ compile(const char* source) {
 static void
 show_help()
 {
-	fprintf(stderr, "%s:  [-d] source file\n", getprogname());
+	fprintf(stderr, "%s:  [-dns] source file\n", getprogname());
 	fprintf(stderr, "\t-d: show debugging info\n");
+	fprintf(stderr, "\t-n: do not optimize the code\n");
+	fprintf(stderr, "\t-s: write stack code instead of register code\n");
 	exit(EXIT_FAILURE);
 }
@@ -26,6 +26,7 @@ struct symbol {
 	} u;
 	int addr;
 	Symkind kind;
+	long len; // an array's length, -1 for an array parameter; else 0
 };
 
 typedef struct scope Scope;
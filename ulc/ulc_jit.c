@@ -0,0 +1,771 @@
+/*
+ * A template JIT for register code, on x86-64.  Each instruction of
+ * a hot function becomes a fixed sequence of machine code, with its
+ * operands patched in: registers stay where the interpreter keeps
+ * them, in the frame, so native code and the interpreter can hand a
+ * running function over to each other at any instruction.
+ *
+ * Native code keeps the frame (R) in rbx, the globals in r12 and the
+ * JitContext in r13; rax, rcx and rdx are scratch.  Functions are
+ * entered through a stub which sets those up, and call each other
+ * directly, or through native_call() when the callee is not compiled
+ * (yet).  They return a RunStatus in eax.
+ *
+ * Functions are compiled whole, after JIT_HOT calls, or iterations
+ * of one of their loops.  Those which cannot be (one jumping out of
+ * itself, an opcode the JIT does not know) are left to the
+ * interpreter.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "ulc_jit.h"
+
+/* the most bytes an instruction compiles to */
+#define MAX_INSN_SZ 96
+
+typedef RunStatus (*entry_stub)(long *R, long *data, JitContext *ctx,
+    void *at);
+
+long jit_threshold;
+
+struct jit {
+	const RegInstruction *code;
+	size_t code_len;
+
+	/* native code for each instruction, once its function is compiled */
+	void **native;
+	int *hits;
+
+	uint8_t *buf;  // JIT_CODE_SZ bytes, mmapped
+	size_t buf_len;
+
+	/* jumps to patch once the whole function is there */
+	struct fixup {
+		size_t at;  // of the rel32
+		int pc;     // the target
+	} *fixups;
+	int nfixups;
+
+	/* where in buf each instruction of the function being compiled goes */
+	size_t *offsets;
+
+	/* instructions the tables above have room for */
+	size_t room;
+};
+
+/* the one the emitters below write to, while compile() runs */
+static _Thread_local Jit *J;
+
+static bool compile(int start);
+static bool emit_insn(const RegInstruction *ri, int pc, int start, int end,
+    size_t *at);
+static RunStatus native_call(long *R, long *data, JitContext *ctx, int pc);
+static void native_in(JitContext *ctx, long *r);
+static void native_out(JitContext *ctx, long v);
+static long native_pow(long b, long e);
+static void native_zero(JitContext *ctx, int pc);
+static void native_bounds(JitContext *ctx, int pc);
+static void native_full(JitContext *ctx, int pc);
+static RunStatus native_fill(long *data, long at, long v, int pc);
+static RunStatus native_copy(long *data, long to, long from, int pc);
+
+/*
+ * A JIT for one machine, with nothing compiled; NULL if out of memory
+ */
+Jit *
+jit_create(void)
+{
+	return calloc(1, sizeof(Jit));
+}
+
+void
+jit_destroy(Jit *jit)
+{
+	if (!jit)
+		return;
+	if (jit->buf)
+		munmap(jit->buf, JIT_CODE_SZ);
+	free(jit->native);
+	free(jit->hits);
+	free(jit->fixups);
+	free(jit->offsets);
+	free(jit);
+}
+
+/*
+ * Get ready to compile `rc', `n' instructions of checked register
+ * code: forget what was compiled for the last program.  False if
+ * there is no room for native code
+ */
+bool
+jit_load(Jit *jit, const RegInstruction *rc, size_t n)
+{
+	static const uint8_t stub[] = {
+		0x53,                   // push rbx
+		0x41, 0x54,             // push r12
+		0x41, 0x55,             // push r13
+		0x48, 0x83, 0xec, 0x08, // sub rsp, 8
+		0x48, 0x89, 0xfb,       // mov rbx, rdi
+		0x49, 0x89, 0xf4,       // mov r12, rsi
+		0x49, 0x89, 0xd5,       // mov r13, rdx
+		0xff, 0xd1,             // call rcx
+		0x48, 0x83, 0xc4, 0x08, // add rsp, 8
+		0x41, 0x5d,             // pop r13
+		0x41, 0x5c,             // pop r12
+		0x5b,                   // pop rbx
+		0xc3,                   // ret
+	};
+
+	jit->code = NULL;
+	if (!jit->buf) {
+		jit->buf = mmap(NULL, JIT_CODE_SZ, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (jit->buf == MAP_FAILED) {
+			jit->buf = NULL;
+			return false;
+		}
+	} else if (mprotect(jit->buf, JIT_CODE_SZ,
+	    PROT_READ | PROT_WRITE) == -1) {
+		return false;
+	}
+
+	memcpy(jit->buf, stub, sizeof(stub));
+	jit->buf_len = sizeof(stub);
+	if (mprotect(jit->buf, JIT_CODE_SZ, PROT_READ | PROT_EXEC) == -1)
+		return false;
+
+	if (n > jit->room) {
+		free(jit->native);
+		free(jit->hits);
+		free(jit->fixups);
+		free(jit->offsets);
+		jit->native = calloc(n, sizeof(*jit->native));
+		jit->hits = calloc(n, sizeof(*jit->hits));
+		jit->fixups = calloc(n, sizeof(*jit->fixups));
+		jit->offsets = calloc(n, sizeof(*jit->offsets));
+		jit->room = jit->native && jit->hits && jit->fixups &&
+		    jit->offsets ? n : 0;
+		if (!jit->room)
+			return false;
+	}
+
+	memset(jit->native, 0, n * sizeof(*jit->native));
+	memset(jit->hits, 0, n * sizeof(*jit->hits));
+	jit->code = rc;
+	jit->code_len = n;
+	return true;
+}
+
+/*
+ * Count a call to, or a jump back to, `pc'; compile its function if
+ * that makes it hot.  The native code to carry on from pc there, or
+ * NULL to carry on interpreting
+ */
+void *
+jit_hot(Jit *jit, int pc)
+{
+	int start = pc;
+
+	if (jit->native[pc])
+		return jit->native[pc];
+	if (!jit->code || jit_threshold <= 0 ||
+	    jit->hits[pc] >= jit_threshold || ++jit->hits[pc] < jit_threshold)
+		return NULL;
+
+	// just once: a function which cannot be compiled stays interpreted
+	while (start > 0 && jit->code[start].op != RENTER)
+		start--;
+	J = jit;
+	return compile(start) ? jit->native[pc] : NULL;
+}
+
+/*
+ * Run native code from `at', with the frame at `R'
+ */
+RunStatus
+jit_enter(Jit *jit, void *at, long *R, long *data, JitContext *ctx)
+{
+	return ((entry_stub) (void *) jit->buf)(R, data, ctx, at);
+}
+
+/*
+ * The emitters: bytes, then the few operand forms the templates use
+ */
+#define B(...) emit((const uint8_t[]) { __VA_ARGS__ }, \
+    sizeof((const uint8_t[]) { __VA_ARGS__ }))
+
+static void
+emit(const uint8_t *bytes, size_t n)
+{
+	memcpy(J->buf + J->buf_len, bytes, n);
+	J->buf_len += n;
+}
+
+static void
+emit32(int32_t v)
+{
+	emit((const uint8_t *) &v, 4);
+}
+
+static void
+emit64(int64_t v)
+{
+	emit((const uint8_t *) &v, 8);
+}
+
+/* rax (or rcx) = R[r] */
+static void
+load(int reg, long r)
+{
+	B(0x48, 0x8b, reg ? 0x8b : 0x83);
+	emit32(r * 8);
+}
+
+/* R[r] = rax */
+static void
+store(long r)
+{
+	B(0x48, 0x89, 0x83);
+	emit32(r * 8);
+}
+
+/* rax (or rcx) = v */
+static void
+load_imm(int reg, long v)
+{
+	if (v == (int32_t) v) {
+		B(0x48, 0xc7, reg ? 0xc1 : 0xc0);
+		emit32(v);
+	} else {
+		B(0x48, reg ? 0xb9 : 0xb8);
+		emit64(v);
+	}
+}
+
+/* call a C function; its arguments are in place */
+static void
+call_c(const void *f)
+{
+	B(0x48, 0xb8);                  // mov rax, f
+	emit64((intptr_t) f);
+	B(0xff, 0xd0);                  // call rax
+}
+
+/* return `status' */
+static void
+leave(RunStatus status)
+{
+	B(0xb8);                        // mov eax, status
+	emit32(status);
+	B(0xc3);                        // ret
+}
+
+/* pass on anything but RUN_RET from the call just made */
+static void
+check_call(void)
+{
+	B(0x85, 0xc0,                   // test eax, eax
+	  0x74, 0x01,                   // jz +1
+	  0xc3);                        // ret
+}
+
+/* as the interpreter: if (left && --left == 0) stop */
+static void
+spend(void)
+{
+	B(0x49, 0x8b, 0x45, 0x00,       // mov rax, [r13]
+	  0x48, 0x85, 0xc0,             // test rax, rax
+	  0x74, 0x0f,                   // jz +15
+	  0x48, 0xff, 0xc8,             // dec rax
+	  0x49, 0x89, 0x45, 0x00,       // mov [r13], rax
+	  0x75, 0x06);                  // jnz +6
+	leave(RUN_STOP);
+}
+
+/* report a division by zero at `pc' and stop */
+static void
+zero(int pc)
+{
+	B(0x4c, 0x89, 0xef,             // mov rdi, r13
+	  0xbe);                        // mov esi, pc
+	emit32(pc);
+	call_c(native_zero);
+	leave(RUN_STOP);
+}
+
+/* report an array index out of bounds at `pc' and stop */
+static void
+bounds(int pc)
+{
+	B(0x4c, 0x89, 0xef,             // mov rdi, r13
+	  0xbe);                        // mov esi, pc
+	emit32(pc);
+	call_c(native_bounds);
+	leave(RUN_STOP);
+}
+
+/* report running out of room for the stack at `pc' and stop */
+static void
+full(int pc)
+{
+	B(0x4c, 0x89, 0xef,             // mov rdi, r13
+	  0xbe);                        // mov esi, pc
+	emit32(pc);
+	call_c(native_full);
+	leave(RUN_STOP);
+}
+
+/* a short jump forward (jcc rel8, or jmp), to land() later */
+static size_t
+skip(uint8_t op)
+{
+	B(op, 0x00);
+	return J->buf_len - 1;
+}
+
+static void
+land(size_t from)
+{
+	J->buf[from] = J->buf_len - (from + 1);
+}
+
+/*
+ * rax = where element R[c] of the array at R[b] is, in slots from r12,
+ * checked as array_at() in ulc_vm.c does
+ */
+static void
+element(long b, long c, int pc)
+{
+	size_t out[3], over;
+	int i;
+
+	load(0, b);
+	B(0x48, 0x3d);                  // cmp rax, VM_DATA_SZ
+	emit32(VM_DATA_SZ);
+	out[0] = skip(0x73);            // jae out
+	load(1, c);
+	B(0x49, 0x3b, 0x0c, 0xc4);      // cmp rcx, [r12 + 8*rax]
+	out[1] = skip(0x73);            // jae out
+	B(0xba);                        // mov edx, VM_DATA_SZ - 1
+	emit32(VM_DATA_SZ - 1);
+	B(0x48, 0x29, 0xc2,             // sub rdx, rax
+	  0x48, 0x39, 0xd1);            // cmp rcx, rdx
+	out[2] = skip(0x73);            // jae out
+	B(0x48, 0x8d, 0x44, 0x08, 0x01);// lea rax, [rax + rcx + 1]
+	over = skip(0xeb);              // jmp over
+	for (i = 0; i < 3; i++)
+		land(out[i]);
+	bounds(pc);
+	land(over);
+}
+
+/* a jump to `pc', to be patched */
+static void
+jump_to(int pc)
+{
+	J->fixups[J->nfixups].at = J->buf_len;
+	J->fixups[J->nfixups++].pc = pc;
+	emit32(0);
+}
+
+/*
+ * Compile the function at `start' (its ENTER) up to the next one.
+ * The code is only made visible to native[] once it is complete
+ */
+static bool
+compile(int start)
+{
+	size_t *at = J->offsets;
+	size_t begin = J->buf_len;
+	int32_t rel;
+	int end, i;
+
+	for (end = start + 1;
+	    end < (int) J->code_len && J->code[end].op != RENTER; end++)
+		;
+	// native code falling through into the next function's would not
+	// find it after its own
+	switch (J->code[end - 1].op) {
+	case RHLT:
+	case RJMP:
+	case RRET:
+	case RADDJ:
+		break;
+	default:
+		return false;
+	}
+	if (J->buf_len + (end - start) * MAX_INSN_SZ > JIT_CODE_SZ)
+		return false;
+	if (mprotect(J->buf, JIT_CODE_SZ, PROT_READ | PROT_WRITE) == -1)
+		return false;
+
+	J->nfixups = 0;
+	for (i = start; i < end; i++) {
+		at[i] = J->buf_len;
+		if (!emit_insn(&J->code[i], i, start, end, at)) {
+			J->buf_len = begin;
+			break;
+		}
+	}
+	if (i == end) {
+		for (i = 0; i < J->nfixups; i++) {
+			rel = at[J->fixups[i].pc] - (J->fixups[i].at + 4);
+			memcpy(J->buf + J->fixups[i].at, &rel, 4);
+		}
+	}
+
+	if (mprotect(J->buf, JIT_CODE_SZ, PROT_READ | PROT_EXEC) == -1 ||
+	    J->buf_len == begin)
+		return false;
+	for (i = start; i < end; i++)
+		J->native[i] = J->buf + at[i];
+	return true;
+}
+
+/*
+ * The templates.  False for what the JIT cannot do: the function is
+ * then left to the interpreter
+ */
+static bool
+emit_insn(const RegInstruction *ri, int pc, int start, int end, size_t *at)
+{
+	// setcc for LT, LE, GT, GE, EQ, NEQ
+	static const uint8_t setcc[] = { 0x9c, 0x9e, 0x9f, 0x9d, 0x94, 0x95 };
+	// jcc rel32, the same
+	static const uint8_t jcc[] = { 0x8c, 0x8e, 0x8f, 0x8d, 0x84, 0x85 };
+	RegOpCode op = ri->op;
+	size_t out, over;
+	int32_t rel;
+
+	// compare and branch, against a register or a constant
+	if (op >= RJLT && op <= RJNEI) {
+		if (ri->b < start || ri->b >= end)
+			return false;
+		load(0, ri->a);
+		if (op >= RJLTI)
+			load_imm(1, ri->c);
+		else
+			load(1, ri->c);
+		B(0x48, 0x39, 0xc8,             // cmp rax, rcx
+		  0x0f, jcc[(op - RJLT) % 6]);  // jcc rel32
+		jump_to(ri->b);
+		return true;
+	}
+
+	// the immediate forms are the others, with rcx loaded from c
+	if (op >= RLTI && op <= RMODI) {
+		if ((op == RDIVI || op == RMODI) && ri->c == 0) {
+			zero(pc);
+			return true;
+		}
+		op = op - RLTI + RLT;
+		load(0, ri->b);
+		load_imm(1, ri->c);
+	} else if (op >= RLT && op <= ROR) {
+		load(0, ri->b);
+		load(1, ri->c);
+	}
+
+	switch (op) {
+	case RHLT:
+		leave(RUN_HALT);
+		break;
+	case RMOV:
+		load(0, ri->b);
+		store(ri->a);
+		break;
+	case RLDI:
+		load_imm(0, ri->b);
+		store(ri->a);
+		break;
+	case RGETG:
+		B(0x49, 0x8b, 0x84, 0x24);      // mov rax, [r12 + 8*b]
+		emit32(ri->b * 8);
+		store(ri->a);
+		break;
+	case RSETG:
+		load(0, ri->a);
+		B(0x49, 0x89, 0x84, 0x24);      // mov [r12 + 8*b], rax
+		emit32(ri->b * 8);
+		break;
+	case RJMP:
+	case RJMPZ:
+		if (ri->b < start || ri->b >= end)
+			return false;
+		if (op == RJMP) {
+			spend();
+			B(0xe9);                // jmp rel32
+		} else {
+			load(0, ri->a);
+			B(0x48, 0x85, 0xc0,     // test rax, rax
+			  0x0f, 0x84);          // jz rel32
+		}
+		jump_to(ri->b);
+		break;
+	case RCALL:
+	case RCALLF:
+		// CALLF's ENTER is left to the callee, which has it anyway
+		spend();
+		if (ri->b == start || J->native[ri->b]) {
+			// straight into native code, with rbx moved to its frame
+			B(0x53,                 // push rbx
+			  0x48, 0x8d, 0x9b);    // lea rbx, [rbx + 8*(a+1)]
+			emit32((ri->a + 1) * 8);
+			B(0xe8);                // call rel32
+			rel = (ri->b == start ? J->buf + at[start] :
+			    (uint8_t *) J->native[ri->b]) -
+			    (J->buf + J->buf_len + 4);
+			emit32(rel);
+			B(0x5b);                // pop rbx
+		} else {
+			B(0x48, 0x8d, 0xbb);    // lea rdi, [rbx + 8*(a+1)]
+			emit32((ri->a + 1) * 8);
+			B(0x4c, 0x89, 0xe6,     // mov rsi, r12
+			  0x4c, 0x89, 0xea,     // mov rdx, r13
+			  0xb9);                // mov ecx, b
+			emit32(ri->b);
+			call_c(native_call);
+		}
+		check_call();
+		break;
+	case RADDJ:
+		if (ri->b < start || ri->b >= end)
+			return false;
+		load(0, ri->a);
+		load_imm(1, ri->c);
+		B(0x48, 0x01, 0xc8);            // add rax, rcx
+		store(ri->a);
+		spend();
+		B(0xe9);                        // jmp rel32
+		jump_to(ri->b);
+		break;
+	case RLEA:
+		B(0x48, 0x89, 0xd8,             // mov rax, rbx
+		  0x4c, 0x29, 0xe0,             // sub rax, r12
+		  0x48, 0xc1, 0xf8, 0x03,       // sar rax, 3
+		  0x48, 0x05);                  // add rax, b
+		emit32(ri->b);
+		store(ri->a);
+		break;
+	case RLDX:
+		element(ri->b, ri->c, pc);
+		B(0x49, 0x8b, 0x04, 0xc4);      // mov rax, [r12 + 8*rax]
+		store(ri->a);
+		break;
+	case RSTX:
+		element(ri->b, ri->c, pc);
+		load(1, ri->a);
+		B(0x49, 0x89, 0x0c, 0xc4);      // mov [r12 + 8*rax], rcx
+		break;
+	case RFILL:
+	case RCOPY:
+		B(0x4c, 0x89, 0xe7,             // mov rdi, r12
+		  0x48, 0x8b, 0xb3);            // mov rsi, [rbx + 8*a]
+		emit32(ri->a * 8);
+		B(0x48, 0x8b, 0x93);            // mov rdx, [rbx + 8*b]
+		emit32(ri->b * 8);
+		B(0xb9);                        // mov ecx, pc
+		emit32(pc);
+		call_c(op == RFILL ? (const void *) native_fill :
+		    (const void *) native_copy);
+		check_call();
+		break;
+	case RRET:
+		load(0, ri->a);
+		B(0x48, 0x89, 0x43, 0xf8,       // mov [rbx - 8], rax
+		  0x31, 0xc0,                   // xor eax, eax
+		  0xc3);                        // ret
+		break;
+	case RENTER:
+		// deep recursion: stop before the frame runs out of room, or
+		// the machine stack does
+		B(0x48, 0x8d, 0x83);            // lea rax, [rbx + 8*a]
+		emit32(ri->a * 8);
+		B(0x49, 0x3b, 0x45,             // cmp rax, [r13 + data_end]
+		  offsetof(JitContext, data_end));
+		out = skip(0x77);               // ja out
+		B(0x49, 0x3b, 0x65,             // cmp rsp, [r13 + stack_end]
+		  offsetof(JitContext, stack_end));
+		over = skip(0x73);              // jae over
+		land(out);
+		full(pc);
+		land(over);
+		break;
+	case RIN:
+		B(0x4c, 0x89, 0xef,             // mov rdi, r13
+		  0x48, 0x8d, 0xb3);            // lea rsi, [rbx + 8*a]
+		emit32(ri->a * 8);
+		call_c(native_in);
+		break;
+	case ROUT:
+		B(0x4c, 0x89, 0xef,             // mov rdi, r13
+		  0x48, 0x8b, 0xb3);            // mov rsi, [rbx + 8*a]
+		emit32(ri->a * 8);
+		call_c(native_out);
+		break;
+	case RNEG:
+		load(0, ri->b);
+		B(0x48, 0xf7, 0xd8);            // neg rax
+		store(ri->a);
+		break;
+	case RNOT:
+		load(0, ri->b);
+		B(0x48, 0x85, 0xc0,             // test rax, rax
+		  0x0f, 0x94, 0xc0,             // sete al
+		  0x0f, 0xb6, 0xc0);            // movzx eax, al
+		store(ri->a);
+		break;
+	case RLT:
+	case RLE:
+	case RGT:
+	case RGE:
+	case REQ:
+	case RNEQ:
+		B(0x48, 0x39, 0xc8,             // cmp rax, rcx
+		  0x0f, setcc[op - RLT], 0xc0,  // setcc al
+		  0x0f, 0xb6, 0xc0);            // movzx eax, al
+		store(ri->a);
+		break;
+	case RADD:
+		B(0x48, 0x01, 0xc8);            // add rax, rcx
+		store(ri->a);
+		break;
+	case RSUB:
+		B(0x48, 0x29, 0xc8);            // sub rax, rcx
+		store(ri->a);
+		break;
+	case RMUL:
+		B(0x48, 0x0f, 0xaf, 0xc1);      // imul rax, rcx
+		store(ri->a);
+		break;
+	case RDIV:
+	case RMOD:
+		// as quotient() and remainder_of() in ulc_vm.c: idiv traps
+		// on LONG_MIN / -1, so -1 wraps around on a path of its own
+		B(0x48, 0x85, 0xc9);            // test rcx, rcx
+		out = skip(0x75);               // jnz out
+		zero(pc);
+		land(out);
+		B(0x48, 0x83, 0xf9, 0xff);      // cmp rcx, -1
+		out = skip(0x75);               // jne out
+		if (op == RDIV)
+			B(0x48, 0xf7, 0xd8);    // neg rax
+		else
+			B(0x31, 0xc0);          // xor eax, eax
+		over = skip(0xeb);              // jmp over
+		land(out);
+		B(0x48, 0x99,                   // cqo
+		  0x48, 0xf7, 0xf9);            // idiv rcx
+		if (op == RMOD)
+			B(0x48, 0x89, 0xd0);    // mov rax, rdx
+		land(over);
+		store(ri->a);
+		break;
+	case RPOW:
+		B(0x48, 0x89, 0xc7,             // mov rdi, rax
+		  0x48, 0x89, 0xce);            // mov rsi, rcx
+		call_c(native_pow);
+		store(ri->a);
+		break;
+	case RAND:
+		B(0x48, 0x85, 0xc0,             // test rax, rax
+		  0x0f, 0x95, 0xc0,             // setne al
+		  0x48, 0x85, 0xc9,             // test rcx, rcx
+		  0x0f, 0x95, 0xc1,             // setne cl
+		  0x20, 0xc8,                   // and al, cl
+		  0x0f, 0xb6, 0xc0);            // movzx eax, al
+		store(ri->a);
+		break;
+	case ROR:
+		B(0x48, 0x09, 0xc8,             // or rax, rcx
+		  0x0f, 0x95, 0xc0,             // setne al
+		  0x0f, 0xb6, 0xc0);            // movzx eax, al
+		store(ri->a);
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+#undef B
+
+/*
+ * What native code calls for the work it leaves to C
+ */
+static RunStatus
+native_call(long *R, long *data, JitContext *ctx, int pc)
+{
+	void *at = jit_hot(ctx->jit, pc);
+
+	if (at)
+		return jit_enter(ctx->jit, at, R, data, ctx);
+	return vm_call(pc, R, ctx);
+}
+
+static void
+native_in(JitContext *ctx, long *r)
+{
+	// past the end of the input, read zeroes
+	if (fscanf(ctx->in, "%ld", r) != 1)
+		*r = 0;
+}
+
+static void
+native_out(JitContext *ctx, long v)
+{
+	fprintf(ctx->out, "%ld\n", v);
+}
+
+static long
+native_pow(long b, long e)
+{
+	return pow(b, e);
+}
+
+static void
+native_zero(JitContext *ctx, int pc)
+{
+	(void) ctx;
+	fprintf(stderr, "division by zero at %d\n", pc);
+}
+
+static void
+native_bounds(JitContext *ctx, int pc)
+{
+	(void) ctx;
+	fprintf(stderr, "array index out of bounds at %d\n", pc);
+}
+
+static void
+native_full(JitContext *ctx, int pc)
+{
+	(void) ctx;
+	fprintf(stderr, "out of room for the stack at %d\n", pc);
+}
+
+static RunStatus
+native_fill(long *data, long at, long v, int pc)
+{
+	if (vm_fill(data, at, v))
+		return RUN_RET;
+	native_bounds(NULL, pc);
+	return RUN_STOP;
+}
+
+static RunStatus
+native_copy(long *data, long to, long from, int pc)
+{
+	if (vm_copy(data, to, from))
+		return RUN_RET;
+	native_bounds(NULL, pc);
+	return RUN_STOP;
+}
@@ -0,0 +1,56 @@
+#ifndef ulc_jit_h
+#define ulc_jit_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "ulc_vm.h"
+
+/* calls (or loop iterations) before a function is compiled */
+#define JIT_HOT 100
+/* room for native code, per machine */
+#define JIT_CODE_SZ (256 * 1024)
+/* machine stack native code may take, calling itself: half the usual */
+#define JIT_STACK_SZ (4 * 1024 * 1024)
+
+/*
+ * How a run of native code, or of the interpreter, ends: returning
+ * from the function it was called for, at a HLT, or stopped short
+ */
+typedef enum {
+	RUN_RET,
+	RUN_HALT,
+	RUN_STOP
+} RunStatus;
+
+/* a machine's native code, and the tables to make more (ulc_jit.c) */
+typedef struct jit Jit;
+
+/* what native code gets to see of the machine */
+typedef struct jitcontext {
+	long left;  // jumps and calls left, as in vm_run(); first, always
+	long *data_end;   // where the frames must stop
+	void *stack_end;  // and the machine stack
+	FILE *in;
+	FILE *out;
+	ulc_vm_t *vm;  // the machine it runs on, for vm_call()
+	Jit *jit;      // and its native code
+} JitContext;
+
+/* compile functions after this many calls; 0 turns the JIT off */
+extern long jit_threshold;
+
+Jit *jit_create(void);
+void jit_destroy(Jit *jit);
+bool jit_load(Jit *jit, const RegInstruction *rc, size_t n);
+void *jit_hot(Jit *jit, int pc);
+RunStatus jit_enter(Jit *jit, void *at, long *R, long *data,
+    JitContext *ctx);
+
+/* the way back, into the interpreter (ulc_vm.c) */
+RunStatus vm_call(int pc, long *R, JitContext *ctx);
+bool vm_fill(long *data, long at, long v);
+bool vm_copy(long *data, long to, long from);
+
+#endif
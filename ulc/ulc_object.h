@@ -1,12 +1,16 @@
 #ifndef ulc_object_h
 #define ulc_object_h
 
+#include <stdbool.h>
+
 #include "ulc_environ.h"
 
 typedef struct function {
 	char* id;
 	long  ret;
 	int nl; // number of locals
+	int np; // of which parameters
+	bool *arrays; // which parameters are arrays
 } TFunction;
 
 typedef struct jmplabel {
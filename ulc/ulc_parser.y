@@ -16,6 +16,40 @@ extern int yylineno;
 
 // Some scratch area
 static char* name_aux;
+// where the code jumping over the functions to main is
+static int main_jump;
+// are we in main?
+static int in_main;
+// where the last whole array was loaded: see gen_assign()
+static int array_at = -1;
+// whether each argument of the calls being parsed is a whole array,
+// the innermost call's last
+static bool *arg_arrays;
+static long nargs, args_room;
+
+// errors reported so far: with any, ulcc writes no bytecodes
+int errors;
+
+inline static void
+error(const char *what, const char *name)
+{
+        fprintf(stderr, "%s: %s\n", what, name);
+        errors++;
+}
+
+/*
+ * Load the address of an array (see ulc_vm.h): a global's is known,
+ * a local's is in the frame, and an array parameter holds one
+ */
+inline static void
+gen_array_ref(Symbol *s)
+{
+        array_at = label_code();
+        if (s->kind == Sym_Global)
+            gen_code(LODI, 0, s->addr);
+        else
+            gen_code(s->len < 0 ? LODL : LODA, 0, s->addr);
+}
 
 //TODO error reporting
 inline static void
@@ -23,8 +57,14 @@ check_gen_code(OpCode opcode, const char *name)
 {
         Symbol *s = NULL;
         if(!(s = get_symbol(name, true)))
-            fprintf(stderr, "Undefined symbol: %s\n", name);
-        else {
+            error("Undefined symbol", name);
+        else if (s->len) {
+            // a whole array is only ever passed on, or assigned
+            if (opcode == LODV)
+                gen_array_ref(s);
+            else
+                error("Not a number", name);
+        } else {
             switch(s->kind) {
                 case Sym_Func:
                     gen_code(opcode, label_data(), s->addr);
@@ -33,12 +73,174 @@ check_gen_code(OpCode opcode, const char *name)
                     gen_code(opcode, 0, s->addr);
                     break;
                 case Sym_Local:
-                    gen_code(opcode, label_data(), s->addr);
+                    // locals live in the frame
+                    if (opcode == LODV)
+                        opcode = LODL;
+                    else if (opcode == STO)
+                        opcode = STOL;
+                    else if (opcode == IN)
+                        opcode = INL;
+                    gen_code(opcode, 0, s->addr);
                     break;
             }
         }
 }
 
+/*
+ * The address of an element of `name', before its index
+ */
+inline static void
+gen_element(const char *name)
+{
+        Symbol *s = NULL;
+        if (!(s = get_symbol(name, true)))
+            error("Undefined symbol", name);
+        else if (!s->len)
+            error("Not an array", name);
+        else
+            gen_array_ref(s);
+}
+
+/*
+ * Store the top of the stack (or, for IN, what is read) into `name',
+ * or with no name, into the element whose address is under it
+ */
+inline static void
+gen_store(OpCode opcode, const char *name)
+{
+        if (name) {
+            check_gen_code(opcode, name);
+            return;
+        }
+        if (opcode == IN)
+            gen_code(IN, -1, 0);
+        gen_code(STOX, 0, 0);
+}
+
+/*
+ * Assign what the code from `from' on computed.  A whole array gets
+ * every element set to it, or, when that code only loaded another
+ * array, a copy of that one
+ */
+inline static void
+gen_assign(const char *name, int from)
+{
+        Symbol *s = name ? get_symbol(name, true) : NULL;
+        bool copy = array_at == from && label_code() == from + 1;
+
+        if (!s || !s->len) {
+            gen_store(STO, name);
+            return;
+        }
+        gen_array_ref(s);
+        gen_code(copy ? COPY : FILL, 0, 0);
+}
+
+/*
+ * Note whether the argument the code from `from' on computed is a
+ * whole array, as the call's parameter will be checked against
+ */
+inline static void
+add_arg(int from)
+{
+        if (nargs == args_room) {
+            args_room = args_room ? 2 * args_room : 16;
+            if (!(arg_arrays = realloc(arg_arrays,
+                args_room * sizeof(*arg_arrays))))
+                fatal("%s: could not allocate memory\n", getprogname());
+        }
+        arg_arrays[nargs++] = array_at == from && label_code() == from + 1;
+}
+
+/*
+ * Call `name' with the last `n' arguments; an array parameter takes
+ * nothing but a whole array, as nothing checks what else it gets
+ * until it is indexed, and stack code not even then
+ */
+inline static void
+gen_call(const char *name, long n)
+{
+        Symbol *s = NULL;
+        long i;
+
+        nargs -= n;
+        if(!(s = get_symbol(name, true)) || s->kind != Sym_Func) {
+            error("Undefined function", name);
+            return;
+        }
+        for (i = 0; i < n && i < s->u.func.np; i++)
+            if (s->u.func.arrays[i] && !arg_arrays[nargs + i])
+                error("Not an array, for an array parameter", name);
+        gen_code(CALL, n, s->addr);
+}
+
+/*
+ * Leave the function; main has nowhere to return to, so it halts
+ */
+inline static void
+gen_return()
+{
+        Symbol *s = get_symbol(name_aux, true);
+        if (in_main)
+            gen_code(HLT, 0, 0);
+        else
+            gen_code(RET, 0, s->u.func.np + 1);
+}
+
+/*
+ * Declare an array of `len' elements, or with `len' -1, an array
+ * parameter.  Its length goes in the slot before the elements; those
+ * of a local array are zeroed each time the declaration runs, and
+ * globals start out zeroed anyway
+ */
+inline static void
+add_array(const char *name, Symkind kind, long len)
+{
+        Symbol *f = kind == Sym_Local ? get_symbol(name_aux, true) : NULL;
+        Symbol *s;
+
+        if (len == 0 || len >= VM_DATA_SZ -
+            (kind == Sym_Global ? label_data() : f->u.func.nl)) {
+            error("Bad array length", name);
+            return;
+        }
+        if (kind == Sym_Global) {
+            s = add_symbol(name, kind, alloc_array(len));
+            gen_code(LODI, 0, len);
+            gen_code(STO, 0, s->addr);
+        } else {
+            s = add_symbol(name, kind, ++f->u.func.nl);
+            if (len > 0) {
+                f->u.func.nl += len;
+                gen_code(LODI, 0, len);
+                gen_code(STOL, 0, s->addr);
+                gen_code(LODI, 0, 0);
+                gen_code(LODA, 0, s->addr);
+                gen_code(FILL, 0, 0);
+            }
+        }
+        s->len = len;
+}
+
+/*
+ * Declare the next parameter of the function being declared
+ */
+inline static void
+add_param(const char *name, bool array)
+{
+        Symbol *f = get_symbol(name_aux, true);
+
+        if (array)
+            add_array(name, Sym_Local, -1);
+        else
+            add_symbol(name, Sym_Local, ++f->u.func.nl);
+        // one for each parameter so far
+        if (!(f->u.func.arrays = realloc(f->u.func.arrays,
+            f->u.func.nl * sizeof(*f->u.func.arrays))))
+            fatal("%s: could not allocate memory\n", getprogname());
+        f->u.func.arrays[f->u.func.nl - 1] = array;
+}
+
 %}
 
 %union{
@@ -72,15 +274,17 @@ check_gen_code(OpCode opcode, const char *name)
 /* flag token to signal unterminated comments from the scanner */
 %token COMMENT_ERROR;
 
+%type <litnum> exprlist
+
 /* start symbol */
 %start prog
 
 %%
 
 prog: /* a program is made of...*/
-      {push_scope(label_data());}
+      {push_scope(label_data()); set_main_offset(label_code());}
       /* data and function declarations followed by */
-      datadecl funcdecl
+      datadecl {main_jump = alloc_code(); /* over the functions */} funcdecl
       /* a program main declaration */
       progdecl
       {gen_code(HLT, 0, 0); pop_scope(); YYACCEPT;}
@@ -95,8 +299,9 @@ datadecl: /* empty or */
             add_symbol($2, Sym_Global, alloc_data());
             check_gen_code(STO, $2);
           } datadeclcont TK_SCOLON datadecl
-          /* TODO */
-        | TK_DATA TK_NAME TK_LBRACK TK_LIT_NUM TK_RBRACK datadeclcont TK_SCOLON datadecl
+        | TK_DATA TK_NAME TK_LBRACK TK_LIT_NUM TK_RBRACK {
+            add_array($2, Sym_Global, $4);
+          } datadeclcont TK_SCOLON datadecl
 ;
 
 datadeclcont: /* empty or */
@@ -107,16 +312,29 @@ datadeclcont: /* empty or */
                 add_symbol($2, Sym_Global, alloc_data());
                 check_gen_code(STO, $2);
               } datadeclcont
-              /* TODO */
-            | TK_COMMA TK_NAME TK_LBRACK TK_LIT_NUM TK_RBRACK datadeclcont
+            | TK_COMMA TK_NAME TK_LBRACK TK_LIT_NUM TK_RBRACK {
+                add_array($2, Sym_Global, $4);
+              } datadeclcont
 ;
 
 /* functions */
 funcdecl: /* empty or */
         | TK_NAME {name_aux = $1;} TK_LPAREN {
             add_symbol($1, Sym_Func, label_code());
+            name_code($1);
             push_scope(label_data()); // enter new scope before parameters decl
-          } paramlist TK_RPAREN block {pop_scope();} funcdecl
+          } paramlist TK_RPAREN {
+            Symbol* s = get_symbol(name_aux, true);
+            s->u.func.np = s->u.func.nl;
+            ++s->u.func.nl; // the caller's frame pointer goes after them
+            $<litnum>$ = alloc_code(); // ENTER, once we know the locals
+          } block {
+            Symbol* s = get_symbol(name_aux, true);
+            gen_code(LODI, 0, 0); // falling off the end returns 0
+            gen_return();
+            back_patch($<litnum>7, ENTER, s->u.func.nl);
+            pop_scope();
+          } funcdecl
 
 
 paramlist: /* empty or */
@@ -124,26 +342,28 @@ paramlist: /* empty or */
 ;
 
 paramlistcont:
-               TK_DATA TK_NAME {
-                  Symbol* s = get_symbol(name_aux, true);
-                  add_symbol($2, Sym_Local, ++s->u.func.nl);
-               }
-             | TK_DATA TK_NAME TK_COMMA {
-                  Symbol* s = get_symbol(name_aux, true);
-                  add_symbol($2, Sym_Local, ++s->u.func.nl);
+               TK_DATA TK_NAME {add_param($2, false);}
+             | TK_DATA TK_NAME TK_COMMA {add_param($2, false);} paramlistcont
+             | TK_DATA TK_NAME TK_LBRACK TK_RBRACK {add_param($2, true);}
+             | TK_DATA TK_NAME TK_LBRACK TK_RBRACK TK_COMMA {
+                  add_param($2, true);
                } paramlistcont
-               /* TODO */
-             | TK_DATA TK_NAME TK_LBRACK TK_RBRACK
-             | TK_DATA TK_NAME TK_LBRACK TK_RBRACK TK_COMMA paramlistcont
 ;
 
 progdecl:
           TK_MAIN {
             name_aux = $1;
+            in_main = 1;
+            back_patch(main_jump, JMP, label_code());
             add_symbol($1, Sym_Func, label_code());
+            name_code($1);
             push_scope(label_data());
-            set_main_offset(label_code());
-          } block {pop_scope();}
+            $<litnum>$ = alloc_code(); // ENTER, once we know the locals
+          } block {
+            Symbol* s = get_symbol(name_aux, true);
+            back_patch($<litnum>2, ENTER, s->u.func.nl);
+            pop_scope();
+          }
 ;
 
 block:
@@ -162,8 +382,9 @@ localdata: /* empty or */
                 add_symbol($2, Sym_Local, ++s->u.func.nl);
                 check_gen_code(STO, $2);
              } localdatacont TK_SCOLON localdata
-             /* TODO */
-           | TK_DATA TK_NAME TK_LBRACK TK_LIT_NUM TK_RBRACK localdatacont TK_SCOLON localdata
+           | TK_DATA TK_NAME TK_LBRACK TK_LIT_NUM TK_RBRACK {
+                add_array($2, Sym_Local, $4);
+             } localdatacont TK_SCOLON localdata
 ;
 
 localdatacont: /* empty or */
@@ -176,8 +397,9 @@ localdatacont: /* empty or */
                 add_symbol($2, Sym_Local, ++s->u.func.nl);
                 check_gen_code(STO, $2);
               } localdatacont
-              /* TODO */
-            | TK_COMMA TK_NAME TK_LBRACK TK_LIT_NUM TK_RBRACK localdatacont
+            | TK_COMMA TK_NAME TK_LBRACK TK_LIT_NUM TK_RBRACK {
+                add_array($2, Sym_Local, $4);
+              } localdatacont
 ;
 
 commlist:
@@ -188,8 +410,8 @@ commlist:
 comm:
        TK_SCOLON
      | expr TK_SCOLON
-     | TK_RETURN expr TK_SCOLON {gen_code(RET, 0, 0);}
-     | TK_READ lvalexpr {check_gen_code(IN, $<id>2);} readvars TK_SCOLON
+     | TK_RETURN expr TK_SCOLON {gen_return();}
+     | TK_READ lvalexpr {gen_store(IN, $<id>2);} readvars TK_SCOLON
      | TK_WRITE expr TK_SCOLON {gen_code(OUT, 0, 0);}
      | ifstmt
      | ifstmt TK_ELSE comm {back_patch($<lbls>$.addr_goto, JMP, label_code());}
@@ -198,7 +420,7 @@ comm:
 ;
 
 readvars: /* empty or */
-        | TK_COMMA lvalexpr readvars {check_gen_code(IN, $<id>2);}
+        | TK_COMMA lvalexpr readvars {gen_store(IN, $<id>2);}
 ;
 
 ifstmt:
@@ -211,7 +433,9 @@ expr:
 ;
 
 assignexpr: orexpr
-          | lvalexpr TK_ASSIGN assignexpr {check_gen_code(STO, $<id>1);}
+          | lvalexpr TK_ASSIGN {$<litnum>$ = label_code();} assignexpr {
+              gen_assign($<id>1, $<litnum>3);
+            }
 ;
 
 orexpr:
@@ -259,7 +483,12 @@ unexpr:
 
 lvalexpr:
           TK_NAME {$<id>$ = strdup($1);}
-        | TK_NAME TK_LBRACK expr TK_RBRACK
+          /* the element's address is left on the stack */
+        | element {$<id>$ = NULL;}
+;
+
+element:
+         TK_NAME TK_LBRACK {gen_element($1);} expr TK_RBRACK
 ;
 
 primexpr:
@@ -269,11 +498,10 @@ primexpr:
             $<func>2.id = strdup($1); // save name
             $<func>2.ret = alloc_code(); // mark return adderss
           } exprlist TK_RPAREN {
-            check_gen_code(CALL, $<func>2.id); // call function
+            gen_call($<func>2.id, $4); // call function
             back_patch($<func>2.ret, LODI, label_code()); // LODI ret addr
           }
-          /* TODO */
-        | TK_NAME TK_LBRACK expr TK_RBRACK
+        | element {gen_code(LODX, 0, 0);}
         | TK_LPAREN expr TK_RPAREN
         | TK_LIT_NUM {gen_code(LODI, 0, $1);}
           /* TODO */
@@ -281,9 +509,13 @@ primexpr:
 ;
 
 exprlist:
-          assignexpr
-        | exprlist TK_COMMA assignexpr
-        |
+          arg {$$ = 1;}
+        | exprlist TK_COMMA arg {$$ = $1 + 1;}
+        | {$$ = 0;}
+;
+
+arg:
+     {$<litnum>$ = label_code();} assignexpr {add_arg($<litnum>1);}
 ;
 
 %%
@@ -291,6 +523,7 @@ exprlist:
 void
 yyerror(const char *s) 
 {
+    errors++;
     switch(yychar) {
         case COMMENT_ERROR:
             fprintf(stderr, "%s:" KRED " error" KNRM " at line %d: unterminated comment\n",
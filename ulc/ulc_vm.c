@@ -1,17 +1,40 @@
 /*
  * This VM was taken shamelessly taken from (some bits were modified)
  * http://research.microsoft.com/en-us/um/people/rgal/ar_language/external/compiler.pdf
+ *
+ * It runs two kinds of code: the stack code it started with, and
+ * register code (see ulc_vm.h), where `a = b + c' is one instruction
+ * instead of four
  */
 
+#include <limits.h>
 #include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
-#ifdef VM
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef VM
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #endif
 
+#include "ulc_jit.h"
 #include "ulc_vm.h"
 #include "util.h"
 
+/* dispatch through computed gotos, where there are any */
+#if defined(__GNUC__) && !defined(VM_SWITCH)
+#define THREADED
+#endif
+
+/* stack slots an expression may take between two calls */
+#define STACK_SLACK 64
+
 /*
  * Opcode names array
  */
@@ -42,185 +65,2010 @@ const char* const op_names[] = {
 	"NOT",
 	"AND",
 	"OR",
+	"LODL",
+	"STOL",
+	"INL",
+	"ENTER",
+	"JLT",
+	"JLE",
+	"JGT",
+	"JGE",
+	"JEQ",
+	"JNE",
+	"LODA",
+	"LODX",
+	"STOX",
+	"FILL",
+	"COPY",
+};
+
+const char* const reg_op_names[] = {
+	"HLT",
+	"MOV",
+	"LDI",
+	"GETG",
+	"SETG",
+	"JMP",
+	"JMPZ",
+	"CALL",
+	"RET",
+	"ENTER",
+	"IN",
+	"OUT",
+	"NEG",
+	"NOT",
+	"LT",
+	"LE",
+	"GT",
+	"GE",
+	"EQ",
+	"NEQ",
+	"ADD",
+	"SUB",
+	"MUL",
+	"DIV",
+	"MOD",
+	"POW",
+	"AND",
+	"OR",
+	"LTI",
+	"LEI",
+	"GTI",
+	"GEI",
+	"EQI",
+	"NEQI",
+	"ADDI",
+	"SUBI",
+	"MULI",
+	"DIVI",
+	"MODI",
+	"JLT",
+	"JLE",
+	"JGT",
+	"JGE",
+	"JEQ",
+	"JNE",
+	"JLTI",
+	"JLEI",
+	"JGTI",
+	"JGEI",
+	"JEQI",
+	"JNEI",
+	"CALLF",
+	"ADDJ",
+	"LEA",
+	"LDX",
+	"STX",
+	"FILL",
+	"COPY",
+};
+
+#ifdef THREADED
+/* the code as run by the threaded loops: handlers instead of opcodes */
+typedef struct threaded {
+	const void *handler;
+	long arg1;
+	long arg2;
+} Threaded;
+
+typedef struct regthreaded {
+	const void *handler;
+	long a;
+	long b;
+	long c;
+} RegThreaded;
+
+#else
+/* the code as run while watched: every opcode turned into END (REND) */
+typedef Instruction Threaded;
+typedef RegInstruction RegThreaded;
+#endif
+
+/* room for an instruction of either kind, unpacked, and as run */
+typedef union {
+	Instruction stack;
+	RegInstruction regs;
+} Unpacked;
+
+typedef union {
+	Threaded stack;
+	RegThreaded regs;
+} Translated;
+
+/*
+ * The machine.  Everything a program changes as it runs is in here,
+ * so machines share nothing, and as many of them can run at once as
+ * there are threads to run them
+ */
+struct ulc_vm {
+	/* the store */
+	long *data;       // VM_DATA_SZ slots, mmapped, and the guard page
+	size_t data_size; // in bytes, guard page included
+	const Instruction *code;
+	const RegInstruction *reg_code; // when running those
+	size_t code_len;
+	int *frames;      // the frame of each instruction's function
+
+	/* special purpose registers, while no program runs */
+	int pc;   // the program counter
+	int sp;   // the top of the stack
+	int fp;
+
+	/* the code unpacked from the file, and as the dispatch loops run it */
+	void *unpacked;   // room for `room' instructions, of either kind
+	void *text;
+	size_t room;
+	const void *text_from;
+
+	/*
+	 * Called before every instruction, when set.  The dispatch loops
+	 * only do that with the code translated for it, so it costs
+	 * nothing otherwise
+	 */
+	vm_watcher watcher;
+	void *watch_arg;
+
+	/* where IN reads from and OUT writes to; NULL for stdin and stdout */
+	FILE *in;
+	FILE *out;
+
+	/* jumps and calls left before the program is stopped; 0 for no limit */
+	long budget;
+	bool faulted;
+	bool ran;         // since the data was last cleared
+#ifdef JIT
+	/* how far down native code may take the machine stack */
+	void *stack_end;
+	/* its own native code, if the JIT had room for the program */
+	Jit *jit;
+	bool jitted;
+#endif
 };
 
-/* the store */
-static long section_data[SEC_DATA_SZ];
-static Instruction section_code[SEC_CODE_SZ];
+static const ImageSection *sections(const void *image, size_t size);
+static bool make_room(ulc_vm_t *vm, size_t n);
+static bool unpack(const ImageInsn *ii, const int64_t *pool, size_t npool,
+    long *b, long *c);
+static bool load_stack(ulc_vm_t *vm, const ImageHeader *head,
+    const ImageInsn *ii, size_t n, const int64_t *pool, size_t npool);
+static bool load_registers(ulc_vm_t *vm, const ImageHeader *head,
+    const ImageInsn *ii, size_t n, const int64_t *pool, size_t npool);
+static bool check_stack(const Instruction *sc, size_t n, int entry,
+    int *frames);
+static bool check_registers(const RegInstruction *rc, size_t n, int ndata,
+    int entry, int *frames);
+static void fetch_exec_cycle(ulc_vm_t *vm);
+static RunStatus reg_exec_cycle(ulc_vm_t *vm);
 
-/* special purpose registers */
-static int pc;      // the program counter
-static int sp;      // the top of the stack
-static int fp;
-static Instruction ir;
+/*
+ * A machine with no program yet; NULL if there is no memory for one
+ */
+ulc_vm_t *
+vm_create(void)
+{
+	ulc_vm_t *vm;
+	void *data;
+	size_t size = VM_DATA_SZ * sizeof(long) + sysconf(_SC_PAGESIZE);
 
-/* general purpose registers */
-static int r0;
-static int r1;
+	if (!(vm = calloc(1, sizeof(ulc_vm_t))))
+		return NULL;
+
+	// all of it out of bounds first, then all but the guard page in
+	data = mmap(NULL, size, PROT_NONE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (data == MAP_FAILED) {
+		free(vm);
+		return NULL;
+	}
+	if (mprotect(data, VM_DATA_SZ * sizeof(long),
+	    PROT_READ | PROT_WRITE) == -1) {
+		munmap(data, size);
+		free(vm);
+		return NULL;
+	}
+
+	vm->data = data;
+	vm->data_size = size;
+	return vm;
+}
 
 void
-fetch_exec_cycle()
-{
-	do {
-		ir = section_code[pc++]; // grab our current instruction
-		                         // and increment our program counter
-		// what instruction is that?
-		switch (ir.op) {
-			case HLT:
-				break;
-			case STO:
-				section_data[ir.arg1 + ir.arg2] = section_data[sp--];
-				break;
-			case JMP:
-				pc = ir.arg2;
-				break;
-			case JMPZ:
-				if (section_data[sp--] == 0)
-					pc = ir.arg2;
-				break;
-			case CALL:
-				section_data[++sp] = fp;
-				fp = ir.arg1;
-				pc = ir.arg2;
+vm_destroy(ulc_vm_t *vm)
+{
+	if (!vm)
+		return;
+	munmap(vm->data, vm->data_size);
+	free(vm->unpacked);
+	free(vm->text);
+	free(vm->frames);
+#ifdef JIT
+	jit_destroy(vm->jit);
+#endif
+	free(vm);
+}
+
+/*
+ * Set up a program to run from `image', `size' bytes of a file as
+ * written by ulcc (see ulc_vm.h), at an address which is a multiple
+ * of 8.  The code is unpacked into the machine: `image' can go as
+ * soon as this returns.  The data starts out zeroed, whatever ran on
+ * the machine before
+ */
+bool
+vm_load(ulc_vm_t *vm, const void *image, size_t size)
+{
+	const ImageHeader *head = image;
+	const ImageSection *sect;
+	const ImageInsn *code = NULL;
+	const int64_t *pool = NULL;
+	size_t ncode = 0, npool = 0, i;
+	bool regs = false;
+
+	vm->code = NULL;
+	vm->reg_code = NULL;
+	vm->text_from = NULL;
+
+	// nothing one program leaves in the data shows in the next: the
+	// pages it took are swapped for zeroed ones, as they were at first
+	if (vm->ran) {
+		if (mmap(vm->data, VM_DATA_SZ * sizeof(long),
+		    PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+		    -1, 0) == MAP_FAILED)
+			return false;
+		vm->ran = false;
+	}
+
+	if (!(sect = sections(image, size)))
+		return false;
+	for (i = 0; i < head->nsections; i++) {
+		switch (sect[i].kind) {
+		case SECT_STACK:
+		case SECT_REGS:
+			// one program to a file
+			if (code)
+				return false;
+			code = (const void *) ((const char *) image + sect[i].offset);
+			ncode = sect[i].count;
+			regs = sect[i].kind == SECT_REGS;
+			break;
+		case SECT_CONST:
+			pool = (const void *) ((const char *) image + sect[i].offset);
+			npool = sect[i].count;
+			break;
+		default:
+			// symbols are for the tools
+			break;
+		}
+	}
+
+	if (!code || ncode == 0 || ncode > INT_MAX || !make_room(vm, ncode))
+		return false;
+	if (regs)
+		return load_registers(vm, head, code, ncode, pool, npool);
+	return load_stack(vm, head, code, ncode, pool, npool);
+}
+
+/*
+ * The section table of the file at `image', once the header checks
+ * out and every section it knows is seen to be inside the file
+ */
+static const ImageSection *
+sections(const void *image, size_t size)
+{
+	const ImageHeader *head = image;
+	const ImageSection *sect = (const ImageSection *) (head + 1);
+	size_t each, i;
+
+	if ((uintptr_t) image % 8 != 0 || size < sizeof(*head) ||
+	    head->magic != IMG_MAGIC || head->version != IMG_VERSION ||
+	    head->nsections > (size - sizeof(*head)) / sizeof(*sect))
+		return NULL;
+
+	for (i = 0; i < head->nsections; i++) {
+		switch (sect[i].kind) {
+		case SECT_STACK:
+		case SECT_REGS:
+			each = sizeof(ImageInsn);
+			break;
+		case SECT_CONST:
+			each = sizeof(int64_t);
+			break;
+		case SECT_SYMS:
+			each = sizeof(ImageSym);
+			break;
+		case SECT_NAMES:
+			each = 1;
+			break;
+		default:
+			continue;
+		}
+		if (sect[i].offset % 8 != 0 || sect[i].offset > size ||
+		    sect[i].count > (size - sect[i].offset) / each)
+			return NULL;
+	}
+
+	return sect;
+}
+
+/*
+ * Room for `n' instructions, unpacked and as run, kept for the next
+ * program
+ */
+static bool
+make_room(ulc_vm_t *vm, size_t n)
+{
+	if (n <= vm->room)
+		return true;
+
+	free(vm->unpacked);
+	free(vm->text);
+	free(vm->frames);
+	vm->unpacked = malloc(n * sizeof(Unpacked));
+	vm->text = malloc(n * sizeof(Translated));
+	vm->frames = malloc(n * sizeof(*vm->frames));
+	vm->room = vm->unpacked && vm->text && vm->frames ? n : 0;
+	return vm->room != 0;
+}
+
+/*
+ * The operands of an instruction, from the pool where they are too
+ * wide for it
+ */
+static bool
+unpack(const ImageInsn *ii, const int64_t *pool, size_t npool, long *b,
+    long *c)
+{
+	*b = ii->b;
+	*c = ii->c;
+	if (ii->op & IMG_BIG_B) {
+		if (ii->b < 0 || (size_t) ii->b >= npool)
+			return false;
+		*b = pool[ii->b];
+	}
+	if (ii->op & IMG_BIG_C) {
+		if (ii->c < 0 || (size_t) ii->c >= npool)
+			return false;
+		*c = pool[ii->c];
+	}
+	return true;
+}
+
+static bool
+load_stack(ulc_vm_t *vm, const ImageHeader *head, const ImageInsn *ii,
+    size_t n, const int64_t *pool, size_t npool)
+{
+	Instruction *sc = vm->unpacked;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		sc[i].op = ii[i].op & 0xff;
+		if (!unpack(&ii[i], pool, npool, &sc[i].arg1, &sc[i].arg2))
+			return false;
+	}
+	if (head->ndata >= VM_DATA_SZ - STACK_SLACK || head->entry >= n ||
+	    !check_stack(sc, n, head->entry, vm->frames))
+		return false;
+
+	// globals start out zeroed, as vm_load() left them, and the stack
+	// right above them; main's frame has its locals right there too, as
+	// if called from the slot just past the globals, so that no FP is
+	// below 0
+	vm->code = sc;
+	vm->code_len = n;
+	vm->sp = (int) head->ndata;
+	vm->fp = (int) head->ndata;
+	vm->pc = head->entry;
+	return true;
+}
+
+static bool
+load_registers(ulc_vm_t *vm, const ImageHeader *head, const ImageInsn *ii,
+    size_t n, const int64_t *pool, size_t npool)
+{
+	RegInstruction *rc = vm->unpacked;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		rc[i].op = ii[i].op & 0xff;
+		rc[i].a = ii[i].op >> 8 & IMG_A_MAX;
+		if (!unpack(&ii[i], pool, npool, &rc[i].b, &rc[i].c))
+			return false;
+	}
+	if (head->ndata + 1 >= VM_DATA_SZ || head->entry >= n ||
+	    !check_registers(rc, n, head->ndata, head->entry, vm->frames))
+		return false;
+
+	// main's registers start above the globals, and the slot it would
+	// have been called from
+	vm->reg_code = rc;
+	vm->code_len = n;
+	vm->fp = head->ndata + 1;
+	vm->pc = head->entry;
+#ifdef JIT
+	// each machine compiles the program it runs; with no room for
+	// native code, it just interprets
+	if (jit_threshold > 0 && !vm->jit)
+		vm->jit = jit_create();
+	vm->jitted = vm->jit && jit_load(vm->jit, rc, vm->code_len);
+#endif
+	return true;
+}
+
+/*
+ * Nor are the addresses stack code loads from and stores to: those of
+ * globals must be inside the data, and those of locals inside the
+ * frame their function's ENTER asks for, which `frames' gets for each
+ * instruction.  Every opcode must exist.  Calls must land on an ENTER,
+ * and jumps (and the entry point) on one or where no more room is
+ * needed than the ENTER before them made sure of; nor may the code run
+ * off its end.  How deep the stack gets is still up to the code
+ */
+static bool
+check_stack(const Instruction *sc, size_t n, int entry, int *frames)
+{
+	long frame = 0;
+	OpCode op;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		op = sc[i].op;
+		if (op < 0 || op >= END)
+			return false;
+		if (op == ENTER) {
+			frame = sc[i].arg2;
+			if (frame < 0 || frame >= VM_DATA_SZ)
+				return false;
+		}
+		frames[i] = frame;
+	}
+	if (sc[entry].op != ENTER && frames[entry] != 0)
+		return false;
+
+	for (i = 0; i < n; i++) {
+		op = sc[i].op;
+		frame = frames[i];
+
+		switch (op) {
+		case CALL:
+			if (sc[i].arg1 < 0 || sc[i].arg2 < 0 ||
+			    sc[i].arg2 >= (long) n || sc[sc[i].arg2].op != ENTER)
+				return false;
+			break;
+		case JMP:
+		case JMPZ:
+		case JLT:
+		case JLE:
+		case JGT:
+		case JGE:
+		case JEQ:
+		case JNE:
+			if (sc[i].arg2 < 0 || sc[i].arg2 >= (long) n ||
+			    (sc[sc[i].arg2].op != ENTER &&
+			    frames[sc[i].arg2] > frame))
+				return false;
+			break;
+		case IN:
+			if (sc[i].arg1 == -1) // onto the stack
 				break;
-			case RET:
-				r0 = section_data[sp--]; // save return value
-				r1 = section_data[sp--]; // save old frame pointer
+			// fall through
+		case STO:
+		case LODV:
+			if (sc[i].arg1 < 0 || sc[i].arg2 < 0 ||
+			    sc[i].arg1 + sc[i].arg2 >= VM_DATA_SZ)
+				return false;
+			break;
+		case LODL:
+		case STOL:
+		case INL:
+		case LODA:
+		case RET:
+			if (sc[i].arg2 < 0 || sc[i].arg2 > frame)
+				return false;
+			break;
+		default:
+			break;
+		}
+	}
+
+	op = sc[n - 1].op;
+	return op == HLT || op == JMP || op == RET;
+}
+
+/*
+ * Register numbers are not checked as the code runs, so check them
+ * before: every one must be inside the frame its function's ENTER
+ * asks for, kept in `frames' for each instruction, and every global
+ * must exist.  Calls and jumps are held to what stack code is
+ */
+static bool
+check_registers(const RegInstruction *rc, size_t n, int ndata, int entry,
+    int *frames)
+{
+	long frame = 0, to;
+	RegOpCode op;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		op = rc[i].op;
+		if (op < 0 || op >= REND || rc[i].a < 0)
+			return false;
+		if (op == RENTER)
+			frame = rc[i].a;
+		frames[i] = frame;
+	}
+	if (rc[entry].op != RENTER && frames[entry] != 0)
+		return false;
+
+	for (i = 0; i < n; i++) {
+		op = rc[i].op;
+		frame = frames[i];
+		if (op == RENTER)
+			continue;
+
+		if (op == RJMP || op == RJMPZ || op == RCALL || op == RCALLF ||
+		    (op >= RJLT && op <= RADDJ)) {
+			to = rc[i].b;
+			if (to < 0 || to >= (long) n)
+				return false;
+			if (rc[to].op != RENTER &&
+			    (op == RCALL || op == RCALLF || frames[to] > frame))
+				return false;
+		}
+		// the frame CALLF makes room for is the one its callee takes
+		if (op == RCALLF && rc[rc[i].b].a != rc[i].c)
+			return false;
+		if (op == RHLT || op == RJMP)
+			continue;
+
+		if (rc[i].a >= frame)
+			return false;
+		if ((op == RGETG || op == RSETG) &&
+		    (rc[i].b < 0 || rc[i].b >= ndata))
+			return false;
+		if ((op == RMOV || op == RNEG || op == RNOT ||
+		    (op >= RLT && op <= RMODI) || op >= RLEA) &&
+		    (rc[i].b < 0 || rc[i].b >= frame))
+			return false;
+		if (((op >= RLT && op <= ROR) || (op >= RJLT && op <= RJNE) ||
+		    op == RLDX || op == RSTX) &&
+		    (rc[i].c < 0 || rc[i].c >= frame))
+			return false;
+	}
+
+	op = rc[n - 1].op;
+	return op == RHLT || op == RJMP || op == RRET || op == RADDJ;
+}
+
+/*
+ * Where IN and OUT go for the programs the machine runs
+ */
+void
+vm_io(ulc_vm_t *vm, FILE *in, FILE *out)
+{
+	vm->in = in;
+	vm->out = out;
+}
+
+/*
+ * Have `watcher' called, with `arg', before every instruction the
+ * machine runs from now on, with where it is and its opcode; NULL
+ * for none.  Unwatched, the machine runs no slower for having it
+ */
+void
+vm_watch(ulc_vm_t *vm, vm_watcher watcher, void *arg)
+{
+	vm->watcher = watcher;
+	vm->watch_arg = arg;
+	// translated again, for the dispatch loops to call it or not
+	vm->text_from = NULL;
+}
+
+/*
+ * Run the loaded program to its HLT, or until it has taken `limit'
+ * jumps and calls (0 for no limit).  False if it was stopped short
+ */
+bool
+vm_run(ulc_vm_t *vm, long limit)
+{
+	vm->budget = limit;
+	vm->faulted = false;
+	vm->ran = true;
+#ifdef JIT
+	// native code calls itself on the machine stack, which is not as
+	// deep as the data: it stops a while below here
+	vm->stack_end = (void *) ((uintptr_t) &limit - JIT_STACK_SZ);
+#endif
+	if (vm->reg_code)
+		reg_exec_cycle(vm);
+	else if (vm->code)
+		fetch_exec_cycle(vm);
+	else
+		vm->faulted = true;
+	vm->budget = 0;
+	return !vm->faulted;
+}
+
+/*
+ * Arrays, as programs index, fill and copy them.  Their addresses come
+ * off the stack, or out of registers, as any other number does, so
+ * each one is checked as it is used: the array must be inside the
+ * data, and the element inside the array.  The length of the array at
+ * `at', or -1 if it is not one
+ */
+static inline long
+array_len(const long *data, long at)
+{
+	if ((unsigned long) at >= VM_DATA_SZ ||
+	    (unsigned long) data[at] > (unsigned long) (VM_DATA_SZ - 1 - at))
+		return -1;
+	return data[at];
+}
+
+/* element `i' of the array at `at', or NULL if there is none */
+static inline long *
+array_at(long *data, long at, long i)
+{
+	if ((unsigned long) at >= VM_DATA_SZ ||
+	    (unsigned long) i >= (unsigned long) data[at] ||
+	    (unsigned long) i >= (unsigned long) (VM_DATA_SZ - 1 - at))
+		return NULL;
+	return data + at + 1 + i;
+}
+
+/*
+ * Every element of the array at `at' set to `v', in one instruction:
+ * memset() or doubling memcpy()s, which the C library runs with vector
+ * instructions, whatever this file was built with
+ */
+static bool
+array_fill(long *data, long at, long v)
+{
+	long n = array_len(data, at), k;
+	long *p;
+
+	if (n < 0)
+		return false;
+	p = data + at + 1;
+	if (v == 0) {
+		memset(p, 0, n * sizeof(*p));
+		return true;
+	}
+	if (n > 0)
+		p[0] = v;
+	for (k = 1; k < n; k *= 2)
+		memcpy(p + k, p, (k < n - k ? k : n - k) * sizeof(*p));
+	return true;
+}
+
+/* the array at `to' takes the elements of the one at `from', as long */
+static bool
+array_copy(long *data, long to, long from)
+{
+	long n = array_len(data, to);
+
+	if (n < 0 || array_len(data, from) != n)
+		return false;
+	memmove(data + to + 1, data + from + 1, n * sizeof(*data));
+	return true;
+}
+
+/*
+ * x / y and x % y, for y other than 0.  LONG_MIN / -1 does not fit,
+ * and traps rather than wrapping around as the other arithmetic does:
+ * -1 is taken apart, so it wraps too, and programs dividing what they
+ * read cannot take their host down with them
+ */
+static inline long
+quotient(long x, long y)
+{
+	return y == -1 ? (long) -(unsigned long) x : x / y;
+}
+
+static inline long
+remainder_of(long x, long y)
+{
+	return y == -1 ? 0 : x % y;
+}
+
+/*
+ * Array stores can reach any slot, the callers' PCs and FPs below the
+ * frames too: a return only goes back into the code, and to a frame
+ * with room in the data for the registers of the function there
+ */
+static inline bool
+returnable(const ulc_vm_t *vm, long link)
+{
+	unsigned long pc = link & 0xffffffff;
+	long fp = link >> 32;
+
+	return pc < vm->code_len && fp >= 1 &&
+	    fp <= VM_DATA_SZ - vm->frames[pc];
+}
+
+/* the same for stack code, whose PC and FP are kept apart */
+static inline bool
+stack_returnable(const ulc_vm_t *vm, long pc, long fp)
+{
+	return (unsigned long) pc < vm->code_len && fp >= 0 &&
+	    fp < VM_DATA_SZ - STACK_SLACK - vm->frames[pc];
+}
+
+/*
+ * The dispatch loops.  With GCC's computed gotos (unless built with
+ * -DVM_SWITCH) the code is first translated, once per program and
+ * machine, into a copy where each opcode is replaced by the address of
+ * its handler, and every handler jumps straight to the next one's:
+ * there is no central branch and no bounds check left to run; bad
+ * opcodes, jump targets and addresses were turned down by vm_load().
+ * Otherwise, a plain switch does the job.  The handlers are the same
+ * for both
+ */
+#ifdef THREADED
+#define OP(o)      op_##o
+#define NEXT       do { ip = &text[pc++]; goto *ip->handler; } while (0)
+#define DISPATCH() NEXT;
+#else
+#define OP(o)      case o
+#define NEXT       continue
+#define DISPATCH() ip = &text[pc++]; op = ip->op; redispatch: switch (op)
+#endif
+
+static void
+fetch_exec_cycle(ulc_vm_t *vm)
+{
+	FILE *in = vm->in ? vm->in : stdin;
+	FILE *out = vm->out ? vm->out : stdout;
+	// the registers live in locals while the program runs
+	const Instruction *code = vm->code;
+	long *data = vm->data;
+	long left = vm->budget;
+	int pc = vm->pc, sp = vm->sp, fp = vm->fp;
+	long r0, r1, *p;
+#ifdef THREADED
+	static const void *const handlers[] = {
+		&&op_HLT, &&op_STO, &&op_JMP, &&op_JMPZ, &&op_CALL, &&op_RET,
+		&&op_LODI, &&op_LODV, &&op_IN, &&op_OUT, &&op_LT, &&op_LE,
+		&&op_GT, &&op_GE, &&op_EQ, &&op_NEQ, &&op_NEG, &&op_ADD,
+		&&op_SUB, &&op_MUL, &&op_DIV, &&op_MOD, &&op_POW, &&op_NOT,
+		&&op_AND, &&op_OR, &&op_LODL, &&op_STOL, &&op_INL, &&op_ENTER,
+		&&op_JLT, &&op_JLE, &&op_JGT, &&op_JGE, &&op_JEQ, &&op_JNE,
+		&&op_LODA, &&op_LODX, &&op_STOX, &&op_FILL, &&op_COPY,
+	};
+	Threaded *text = vm->text;
+	const Threaded *ip;
+	size_t i;
+
+	// vm_load() checked the code already
+	if (vm->text_from != code) {
+		for (i = 0; i < vm->code_len; i++) {
+			text[i].handler = vm->watcher ? &&watched :
+			    handlers[code[i].op];
+			text[i].arg1 = code[i].arg1;
+			text[i].arg2 = code[i].arg2;
+		}
+		vm->text_from = code;
+	}
+#else
+	const Instruction *text = code;
+	const Instruction *ip;
+	OpCode op;
+	size_t i;
+
+	Threaded *copy = vm->text;
+
+	if (vm->watcher) {
+		if (vm->text_from != code) {
+			for (i = 0; i < vm->code_len; i++) {
+				copy[i] = code[i];
+				copy[i].op = END;
+			}
+			vm->text_from = code;
+		}
+		text = copy;
+	}
+#endif
+
+	for (;;) {
+		DISPATCH() {
+			OP(HLT):
+				goto halt;
+			OP(STO):
+				data[ip->arg1 + ip->arg2] = data[sp--];
+				NEXT;
+			OP(JMP):
+				if (left && --left == 0)
+					goto stop;
+				pc = ip->arg2;
+				NEXT;
+			OP(JMPZ):
+				if (data[sp--] == 0)
+					pc = ip->arg2;
+				NEXT;
+			OP(JLT):
+				if (data[sp - 1] < data[sp])
+					pc = ip->arg2;
+				sp -= 2;
+				NEXT;
+			OP(JLE):
+				if (data[sp - 1] <= data[sp])
+					pc = ip->arg2;
+				sp -= 2;
+				NEXT;
+			OP(JGT):
+				if (data[sp - 1] > data[sp])
+					pc = ip->arg2;
+				sp -= 2;
+				NEXT;
+			OP(JGE):
+				if (data[sp - 1] >= data[sp])
+					pc = ip->arg2;
+				sp -= 2;
+				NEXT;
+			OP(JEQ):
+				if (data[sp - 1] == data[sp])
+					pc = ip->arg2;
+				sp -= 2;
+				NEXT;
+			OP(JNE):
+				if (data[sp - 1] != data[sp])
+					pc = ip->arg2;
+				sp -= 2;
+				NEXT;
+			OP(CALL):
+				if (left && --left == 0)
+					goto stop;
+				// runaway recursion: stop before the stack runs out
+				if (sp >= VM_DATA_SZ - STACK_SLACK)
+					goto full;
+				r0 = sp - ip->arg1; // the return address, before the arguments
+				data[++sp] = fp;
+				fp = r0;
+				pc = ip->arg2;
+				NEXT;
+			OP(RET):
+				r0 = data[sp]; // save return value
+				r1 = data[fp + ip->arg2]; // save old frame pointer
+				if (!stack_returnable(vm, data[fp], r1))
+					goto stop;
 				sp = fp; // rewind the stack
-				pc = section_data[sp]; // restore pc
-				section_data[sp] = r0; // leave the return value
+				pc = data[sp]; // restore pc
+				data[sp] = r0; // leave the return value
 				fp = r1; // restore old frame pointer
-				break;
-			case LODI:
-				section_data[++sp] = ir.arg2;
-				break;
-			case LODV:
-				section_data[++sp] = section_data[ir.arg1 + ir.arg2];
-				break;
-			case IN:
-				if (ir.arg1 == -1)
-					scanf("%ld", section_data + ++sp);
-				else
-					scanf("%ld", section_data + ir.arg1 + ir.arg2);
-				break;
-			case OUT:
-				printf("%ld\n", section_data[sp--]);
-				break;
-			case LT:
-				if (section_data[sp - 1] < section_data[sp])
-					section_data[--sp] = 1;
-				else
-					section_data[--sp] = 0;
-				break;
-			case LE:
-				if (section_data[sp - 1] <= section_data[sp])
-					section_data[--sp] = 1;
-				else
-					section_data[--sp] = 0;
-				break;
-			case GT:
-				if (section_data[sp - 1] > section_data[sp])
-					section_data[--sp] = 1;
-				else
-					section_data[--sp] = 0;
-				break;
-			case GE:
-				if (section_data[sp - 1] >= section_data[sp])
-					section_data[--sp] = 1;
-				else
-					section_data[--sp] = 0;
-				break;
-			case EQ:
-				if (section_data[sp - 1] == section_data[sp])
-					section_data[--sp] = 1;
-				else
-					section_data[--sp] = 0;
-				break;
-			case NEQ:
-				if (section_data[sp - 1] != section_data[sp])
-					section_data[--sp] = 1;
-				else
-					section_data[--sp] = 0;
-				break;
-			case NEG:
-				section_data[sp] = -section_data[sp];
-				break;
-			case ADD:
-				section_data[sp - 1] = section_data[sp - 1] + section_data[sp];
+				NEXT;
+			OP(ENTER):
+				if (fp + ip->arg2 >= VM_DATA_SZ - STACK_SLACK)
+					goto full;
+				sp = fp + ip->arg2;
+				NEXT;
+			OP(LODI):
+				data[++sp] = ip->arg2;
+				NEXT;
+			OP(LODV):
+				data[++sp] = data[ip->arg1 + ip->arg2];
+				NEXT;
+			OP(LODL):
+				data[++sp] = data[fp + ip->arg2];
+				NEXT;
+			OP(STOL):
+				data[fp + ip->arg2] = data[sp--];
+				NEXT;
+			OP(IN):
+				// past the end of the input, read zeroes
+				r0 = ip->arg1 == -1 ? ++sp : ip->arg1 + ip->arg2;
+				if (fscanf(in, "%ld", data + r0) != 1)
+					data[r0] = 0;
+				NEXT;
+			OP(INL):
+				if (fscanf(in, "%ld", data + fp + ip->arg2) != 1)
+					data[fp + ip->arg2] = 0;
+				NEXT;
+			OP(OUT):
+				fprintf(out, "%ld\n", data[sp--]);
+				NEXT;
+			OP(LT):
+				data[sp - 1] = data[sp - 1] < data[sp];
 				sp--;
-				break;
-			case SUB:
-				section_data[sp - 1] = section_data[sp - 1] - section_data[sp];
+				NEXT;
+			OP(LE):
+				data[sp - 1] = data[sp - 1] <= data[sp];
 				sp--;
-				break;
-			case MUL:
-				section_data[sp - 1] = section_data[sp - 1] * section_data[sp];
+				NEXT;
+			OP(GT):
+				data[sp - 1] = data[sp - 1] > data[sp];
 				sp--;
-				break;
-			case DIV:
-				section_data[sp - 1] = section_data[sp - 1] / section_data[sp];
+				NEXT;
+			OP(GE):
+				data[sp - 1] = data[sp - 1] >= data[sp];
 				sp--;
-				break;
-			case MOD:
-				section_data[sp - 1] = section_data[sp - 1] % section_data[sp];
+				NEXT;
+			OP(EQ):
+				data[sp - 1] = data[sp - 1] == data[sp];
 				sp--;
-				break;
-			case POW:
-				section_data[sp - 1] = pow(section_data[sp - 1], section_data[sp]);
+				NEXT;
+			OP(NEQ):
+				data[sp - 1] = data[sp - 1] != data[sp];
 				sp--;
-				break;
-			case NOT:
-				section_data[sp] = !section_data[sp];
-				break;
-			case AND:
-				section_data[sp - 1] = section_data[sp - 1] && section_data[sp];
+				NEXT;
+			OP(NEG):
+				data[sp] = -data[sp];
+				NEXT;
+			OP(ADD):
+				data[sp - 1] = data[sp - 1] + data[sp];
 				sp--;
-				break;
-			case OR:
-				section_data[sp - 1] = section_data[sp - 1] || section_data[sp];
+				NEXT;
+			OP(SUB):
+				data[sp - 1] = data[sp - 1] - data[sp];
 				sp--;
-				break;
+				NEXT;
+			OP(MUL):
+				data[sp - 1] = data[sp - 1] * data[sp];
+				sp--;
+				NEXT;
+			OP(DIV):
+				if (data[sp] == 0)
+					goto zero;
+				data[sp - 1] = quotient(data[sp - 1], data[sp]);
+				sp--;
+				NEXT;
+			OP(MOD):
+				if (data[sp] == 0)
+					goto zero;
+				data[sp - 1] = remainder_of(data[sp - 1], data[sp]);
+				sp--;
+				NEXT;
+			OP(POW):
+				data[sp - 1] = pow(data[sp - 1], data[sp]);
+				sp--;
+				NEXT;
+			OP(NOT):
+				data[sp] = !data[sp];
+				NEXT;
+			OP(AND):
+				data[sp - 1] = data[sp - 1] && data[sp];
+				sp--;
+				NEXT;
+			OP(OR):
+				data[sp - 1] = data[sp - 1] || data[sp];
+				sp--;
+				NEXT;
+			OP(LODA):
+				data[++sp] = fp + ip->arg2;
+				NEXT;
+			OP(LODX):
+				if (!(p = array_at(data, data[sp - 1], data[sp])))
+					goto bounds;
+				data[--sp] = *p;
+				NEXT;
+			OP(STOX):
+				if (!(p = array_at(data, data[sp - 2], data[sp - 1])))
+					goto bounds;
+				*p = data[sp];
+				sp -= 3;
+				NEXT;
+			OP(FILL):
+				if (!array_fill(data, data[sp], data[sp - 1]))
+					goto bounds;
+				sp -= 2;
+				NEXT;
+			OP(COPY):
+				if (!array_copy(data, data[sp], data[sp - 1]))
+					goto bounds;
+				sp -= 2;
+				NEXT;
+#ifdef THREADED
+			watched:
+				vm->watcher(vm->watch_arg, pc - 1, code[pc - 1].op);
+				goto *handlers[code[pc - 1].op];
+#else
+			case END:
+				vm->watcher(vm->watch_arg, pc - 1, code[pc - 1].op);
+				op = code[pc - 1].op;
+				goto redispatch;
 			default:
-				printf("bad instruction: %s", op_names[ir.op]);
+				goto stop;
+#endif
 		}
-	} while (ir.op != HLT); // repeat until our program halts
+	}
+
+full:
+	fprintf(stderr, "out of room for the stack at %d\n", pc - 1);
+	goto stop;
+bounds:
+	fprintf(stderr, "array index out of bounds at %d\n", pc - 1);
+	goto stop;
+zero:
+	fprintf(stderr, "division by zero at %d\n", pc - 1);
+stop:
+	vm->faulted = true;
+halt:
+	vm->pc = pc;
+	vm->sp = sp;
+	vm->fp = fp;
+	vm->budget = left;
 }
 
+/*
+ * The register machine.  R points at the running function's
+ * registers; below them, in the register its caller gets the result
+ * in, are the caller's PC and FP until it returns.  With the JIT,
+ * functions called from native code have -1 there instead: when one
+ * of those returns, the machine does too
+ */
+static RunStatus
+reg_exec_cycle(ulc_vm_t *vm)
+{
+	FILE *in = vm->in ? vm->in : stdin;
+	FILE *out = vm->out ? vm->out : stdout;
+	const RegInstruction *reg_code = vm->reg_code;
+	long *data = vm->data;
+	long left = vm->budget;
+	int pc = vm->pc, fp = vm->fp;
+	long *R = data + fp;
+	long r0, r1, *p;
+#ifdef JIT
+	JitContext ctx = {
+		0, data + VM_DATA_SZ, vm->stack_end, in, out, vm, vm->jit
+	};
+	Jit *jit = vm->jitted ? vm->jit : NULL;
+	RunStatus status;
+	void *at;
+#endif
+#ifdef THREADED
+	static const void *const handlers[] = {
+		&&op_RHLT, &&op_RMOV, &&op_RLDI, &&op_RGETG, &&op_RSETG,
+		&&op_RJMP, &&op_RJMPZ, &&op_RCALL, &&op_RRET, &&op_RENTER,
+		&&op_RIN, &&op_ROUT, &&op_RNEG, &&op_RNOT, &&op_RLT, &&op_RLE,
+		&&op_RGT, &&op_RGE, &&op_REQ, &&op_RNEQ, &&op_RADD, &&op_RSUB,
+		&&op_RMUL, &&op_RDIV, &&op_RMOD, &&op_RPOW, &&op_RAND, &&op_ROR,
+		&&op_RLTI, &&op_RLEI, &&op_RGTI, &&op_RGEI, &&op_REQI,
+		&&op_RNEQI, &&op_RADDI, &&op_RSUBI, &&op_RMULI, &&op_RDIVI,
+		&&op_RMODI, &&op_RJLT, &&op_RJLE, &&op_RJGT, &&op_RJGE,
+		&&op_RJEQ, &&op_RJNE, &&op_RJLTI, &&op_RJLEI, &&op_RJGTI,
+		&&op_RJGEI, &&op_RJEQI, &&op_RJNEI, &&op_RCALLF, &&op_RADDJ,
+		&&op_RLEA, &&op_RLDX, &&op_RSTX, &&op_RFILL, &&op_RCOPY,
+	};
+	RegThreaded *text = vm->text;
+	const RegThreaded *ip;
+	size_t i;
+
+	// vm_load() checked the code already
+	if (vm->text_from != reg_code) {
+		for (i = 0; i < vm->code_len; i++) {
+			text[i].handler = vm->watcher ? &&watched :
+			    handlers[reg_code[i].op];
+			text[i].a = reg_code[i].a;
+			text[i].b = reg_code[i].b;
+			text[i].c = reg_code[i].c;
+		}
+		vm->text_from = reg_code;
+	}
+#else
+	const RegInstruction *text = reg_code;
+	const RegInstruction *ip;
+	RegOpCode op;
+	size_t i;
+
+	RegThreaded *copy = vm->text;
+
+	if (vm->watcher) {
+		if (vm->text_from != reg_code) {
+			for (i = 0; i < vm->code_len; i++) {
+				copy[i] = reg_code[i];
+				copy[i].op = REND;
+			}
+			vm->text_from = reg_code;
+		}
+		text = copy;
+	}
+#endif
+
+	for (;;) {
+		DISPATCH() {
+			OP(RHLT):
+				goto halt;
+			OP(RMOV):
+				R[ip->a] = R[ip->b];
+				NEXT;
+			OP(RLDI):
+				R[ip->a] = ip->b;
+				NEXT;
+			OP(RGETG):
+				R[ip->a] = data[ip->b];
+				NEXT;
+			OP(RSETG):
+				data[ip->b] = R[ip->a];
+				NEXT;
+			OP(RJMP):
+				if (left && --left == 0)
+					goto stop;
+				pc = ip->b;
+#ifdef JIT
+				// a hot loop carries on in native code, until its
+				// function returns
+				if (jit && pc <= ip - text && (at = jit_hot(jit, pc))) {
+					r1 = R[-1]; // the caller's PC and FP
+					ctx.left = left;
+					status = jit_enter(jit, at, R, data, &ctx);
+					left = ctx.left;
+					if (status != RUN_RET || r1 < 0)
+						goto ended;
+					if (!returnable(vm, r1))
+						goto stop;
+					pc = (int) (r1 & 0xffffffff);
+					fp = (int) (r1 >> 32);
+					R = data + fp;
+				}
+#endif
+				NEXT;
+			OP(RJMPZ):
+				if (R[ip->a] == 0)
+					pc = ip->b;
+				NEXT;
+			OP(RCALL):
+				if (left && --left == 0)
+					goto stop;
+#ifdef JIT
+				// compiled functions leave their result in R[a]
+				if (jit && (at = jit_hot(jit, ip->b))) {
+					ctx.left = left;
+					status = jit_enter(jit, at, R + ip->a + 1, data, &ctx);
+					left = ctx.left;
+					if (status != RUN_RET)
+						goto ended;
+					NEXT;
+				}
+#endif
+				R[ip->a] = (long) fp << 32 | pc;
+				fp += ip->a + 1;
+				R = data + fp;
+				pc = ip->b;
+				NEXT;
+			OP(RRET):
+				r0 = R[ip->a]; // save return value
+				r1 = R[-1]; // the caller's PC and FP
+				R[-1] = r0; // leave the return value
+#ifdef JIT
+				if (r1 < 0)
+					goto back;
+#endif
+				if (!returnable(vm, r1))
+					goto stop;
+				pc = (int) (r1 & 0xffffffff);
+				fp = (int) (r1 >> 32);
+				R = data + fp;
+				NEXT;
+			OP(RENTER):
+				// deep recursion: stop before the frame runs out of room
+				if (fp + ip->a > VM_DATA_SZ)
+					goto full;
+				NEXT;
+			OP(RIN):
+				// past the end of the input, read zeroes
+				if (fscanf(in, "%ld", R + ip->a) != 1)
+					R[ip->a] = 0;
+				NEXT;
+			OP(ROUT):
+				fprintf(out, "%ld\n", R[ip->a]);
+				NEXT;
+			OP(RNEG):
+				R[ip->a] = -R[ip->b];
+				NEXT;
+			OP(RNOT):
+				R[ip->a] = !R[ip->b];
+				NEXT;
+			OP(RLT):
+				R[ip->a] = R[ip->b] < R[ip->c];
+				NEXT;
+			OP(RLE):
+				R[ip->a] = R[ip->b] <= R[ip->c];
+				NEXT;
+			OP(RGT):
+				R[ip->a] = R[ip->b] > R[ip->c];
+				NEXT;
+			OP(RGE):
+				R[ip->a] = R[ip->b] >= R[ip->c];
+				NEXT;
+			OP(REQ):
+				R[ip->a] = R[ip->b] == R[ip->c];
+				NEXT;
+			OP(RNEQ):
+				R[ip->a] = R[ip->b] != R[ip->c];
+				NEXT;
+			OP(RADD):
+				R[ip->a] = R[ip->b] + R[ip->c];
+				NEXT;
+			OP(RSUB):
+				R[ip->a] = R[ip->b] - R[ip->c];
+				NEXT;
+			OP(RMUL):
+				R[ip->a] = R[ip->b] * R[ip->c];
+				NEXT;
+			OP(RDIV):
+				if (R[ip->c] == 0)
+					goto zero;
+				R[ip->a] = quotient(R[ip->b], R[ip->c]);
+				NEXT;
+			OP(RMOD):
+				if (R[ip->c] == 0)
+					goto zero;
+				R[ip->a] = remainder_of(R[ip->b], R[ip->c]);
+				NEXT;
+			OP(RPOW):
+				R[ip->a] = pow(R[ip->b], R[ip->c]);
+				NEXT;
+			OP(RAND):
+				R[ip->a] = R[ip->b] && R[ip->c];
+				NEXT;
+			OP(ROR):
+				R[ip->a] = R[ip->b] || R[ip->c];
+				NEXT;
+			OP(RLTI):
+				R[ip->a] = R[ip->b] < ip->c;
+				NEXT;
+			OP(RLEI):
+				R[ip->a] = R[ip->b] <= ip->c;
+				NEXT;
+			OP(RGTI):
+				R[ip->a] = R[ip->b] > ip->c;
+				NEXT;
+			OP(RGEI):
+				R[ip->a] = R[ip->b] >= ip->c;
+				NEXT;
+			OP(REQI):
+				R[ip->a] = R[ip->b] == ip->c;
+				NEXT;
+			OP(RNEQI):
+				R[ip->a] = R[ip->b] != ip->c;
+				NEXT;
+			OP(RADDI):
+				R[ip->a] = R[ip->b] + ip->c;
+				NEXT;
+			OP(RSUBI):
+				R[ip->a] = R[ip->b] - ip->c;
+				NEXT;
+			OP(RMULI):
+				R[ip->a] = R[ip->b] * ip->c;
+				NEXT;
+			OP(RDIVI):
+				if (ip->c == 0)
+					goto zero;
+				R[ip->a] = quotient(R[ip->b], ip->c);
+				NEXT;
+			OP(RMODI):
+				if (ip->c == 0)
+					goto zero;
+				R[ip->a] = remainder_of(R[ip->b], ip->c);
+				NEXT;
+			OP(RJLT):
+				if (R[ip->a] < R[ip->c])
+					pc = ip->b;
+				NEXT;
+			OP(RJLE):
+				if (R[ip->a] <= R[ip->c])
+					pc = ip->b;
+				NEXT;
+			OP(RJGT):
+				if (R[ip->a] > R[ip->c])
+					pc = ip->b;
+				NEXT;
+			OP(RJGE):
+				if (R[ip->a] >= R[ip->c])
+					pc = ip->b;
+				NEXT;
+			OP(RJEQ):
+				if (R[ip->a] == R[ip->c])
+					pc = ip->b;
+				NEXT;
+			OP(RJNE):
+				if (R[ip->a] != R[ip->c])
+					pc = ip->b;
+				NEXT;
+			OP(RJLTI):
+				if (R[ip->a] < ip->c)
+					pc = ip->b;
+				NEXT;
+			OP(RJLEI):
+				if (R[ip->a] <= ip->c)
+					pc = ip->b;
+				NEXT;
+			OP(RJGTI):
+				if (R[ip->a] > ip->c)
+					pc = ip->b;
+				NEXT;
+			OP(RJGEI):
+				if (R[ip->a] >= ip->c)
+					pc = ip->b;
+				NEXT;
+			OP(RJEQI):
+				if (R[ip->a] == ip->c)
+					pc = ip->b;
+				NEXT;
+			OP(RJNEI):
+				if (R[ip->a] != ip->c)
+					pc = ip->b;
+				NEXT;
+			OP(RCALLF):
+				if (left && --left == 0)
+					goto stop;
+#ifdef JIT
+				if (jit && (at = jit_hot(jit, ip->b))) {
+					ctx.left = left;
+					status = jit_enter(jit, at, R + ip->a + 1, data, &ctx);
+					left = ctx.left;
+					if (status != RUN_RET)
+						goto ended;
+					NEXT;
+				}
+#endif
+				// the callee's ENTER, done here
+				if (fp + ip->a + 1 + ip->c > VM_DATA_SZ)
+					goto full;
+				R[ip->a] = (long) fp << 32 | pc;
+				fp += ip->a + 1;
+				R = data + fp;
+				pc = ip->b + 1;
+				NEXT;
+			OP(RLEA):
+				R[ip->a] = fp + ip->b;
+				NEXT;
+			OP(RLDX):
+				if (!(p = array_at(data, R[ip->b], R[ip->c])))
+					goto bounds;
+				R[ip->a] = *p;
+				NEXT;
+			OP(RSTX):
+				if (!(p = array_at(data, R[ip->b], R[ip->c])))
+					goto bounds;
+				*p = R[ip->a];
+				NEXT;
+			OP(RFILL):
+				if (!array_fill(data, R[ip->a], R[ip->b]))
+					goto bounds;
+				NEXT;
+			OP(RCOPY):
+				if (!array_copy(data, R[ip->a], R[ip->b]))
+					goto bounds;
+				NEXT;
+			OP(RADDJ):
+				if (left && --left == 0)
+					goto stop;
+				R[ip->a] += ip->c;
+				pc = ip->b;
+#ifdef JIT
+				// a hot loop carries on in native code, as for RJMP
+				if (jit && pc <= ip - text && (at = jit_hot(jit, pc))) {
+					r1 = R[-1];
+					ctx.left = left;
+					status = jit_enter(jit, at, R, data, &ctx);
+					left = ctx.left;
+					if (status != RUN_RET || r1 < 0)
+						goto ended;
+					if (!returnable(vm, r1))
+						goto stop;
+					pc = (int) (r1 & 0xffffffff);
+					fp = (int) (r1 >> 32);
+					R = data + fp;
+				}
+#endif
+				NEXT;
+#ifdef THREADED
+			watched:
+				vm->watcher(vm->watch_arg, pc - 1,
+				    reg_code[pc - 1].op);
+				goto *handlers[reg_code[pc - 1].op];
+#else
+			case REND:
+				vm->watcher(vm->watch_arg, pc - 1,
+				    reg_code[pc - 1].op);
+				op = reg_code[pc - 1].op;
+				goto redispatch;
+			default:
+				goto stop;
+#endif
+		}
+	}
+
+#ifdef JIT
+ended:
+	if (status == RUN_RET)
+		goto back;
+	if (status == RUN_HALT)
+		goto halt;
+	goto stop;
+#endif
+
+full:
+	fprintf(stderr, "out of room for the stack at %d\n", pc - 1);
+	goto stop;
+bounds:
+	fprintf(stderr, "array index out of bounds at %d\n", pc - 1);
+	goto stop;
+zero:
+	fprintf(stderr, "division by zero at %d\n", pc - 1);
+stop:
+	vm->faulted = true;
+halt:
+	vm->pc = pc;
+	vm->fp = fp;
+	vm->budget = left;
+	return vm->faulted ? RUN_STOP : RUN_HALT;
+#ifdef JIT
+back:
+	vm->budget = left;
+	return RUN_RET;
+#endif
+}
+
+#ifdef JIT
+/*
+ * Run the function at `pc' for native code, with its registers at R,
+ * until it returns
+ */
+RunStatus
+vm_call(int pc, long *R, JitContext *ctx)
+{
+	ulc_vm_t *vm = ctx->vm;
+	RunStatus status;
+
+	R[-1] = -1;
+	vm->pc = pc;
+	vm->fp = R - vm->data;
+	vm->budget = ctx->left;
+	status = reg_exec_cycle(vm);
+	ctx->left = vm->budget;
+	return status;
+}
+
+/* FILL and COPY, for native code: false outside the arrays */
+bool
+vm_fill(long *data, long at, long v)
+{
+	return array_fill(data, at, v);
+}
+
+bool
+vm_copy(long *data, long to, long from)
+{
+	return array_copy(data, to, from);
+}
+#endif
+
+#undef OP
+#undef DISPATCH
+#undef NEXT
+
 #ifdef VM // are we compiling the interpreter program?
+#ifdef JIT
+#define OPTIONS "gp:jc:"
+#define USAGE "usage:\t%s [-g] [-p stacks] [-j] [-c calls] file ..."
+#else
+#define OPTIONS "gp:"
+#define USAGE "usage:\t%s [-g] [-p stacks] file ..."
+#endif
+
+/* opcodes, of either kind */
+#define NOPS ((int) END > (int) REND ? (int) END : (int) REND)
+
+/* opcode pairs and triples to report, of each */
+#define NGRAMS_SHOWN 20
+
+/* profile samples per second of CPU time, and functions reported */
+#define PROF_HZ 1000
+#define PROF_SHOWN 20
+
+typedef struct ngram {
+	long count;
+	int ops[3];
+} Ngram;
+
+/*
+ * A node of the profile's call tree: a call to `func', made from the
+ * call `parent', and the samples taken while it was the one running
+ */
+typedef struct frame {
+	int func;
+	int parent;   // -1 for the root, which is no call
+	int child;    // the first call made from this one; -1 for none
+	int sibling;  // the next made from its parent
+	long samples;
+} Frame;
+
+typedef struct func {
+	const char *name;
+	int at;       // its first instruction
+	long insns;   // instructions run in it
+	long samples; // samples taken in it
+} Func;
+
+static void watch(void *arg, int pc, int op);
+static void count_ngrams(int op);
+static void report_ngrams(const ulc_vm_t *vm, FILE *f, int len);
+static int by_count(const void *a, const void *b);
+static void start_profile(const ulc_vm_t *vm, const void *image,
+    size_t size);
+static void profile(int pc, int op);
+static int frame_of(int parent, int func);
+static void tick(int sig);
+static void report_profile(FILE *f);
+static int by_samples(const void *a, const void *b);
+static void write_stacks(FILE *f);
+static void catch_overflow(const ulc_vm_t *vm);
+static void overflowed(int sig, siginfo_t *si, void *context);
+
+/* the machine's guard page */
+static char *guard;
+static char *guard_end;
+
+/* the opcode pairs and triples -g counts, and the last two opcodes */
+static long (*bigrams)[NOPS];
+static long (*trigrams)[NOPS][NOPS];
+static int last_ops[2];
+static int nlast;
+
+/*
+ * What -p counts: instructions run, by opcode and by function, and
+ * samples of the call stack, taken at the first instruction after
+ * each tick of the profiling timer.  The functions are the code from
+ * each ENTER, where calls land, to the next one
+ */
+static struct {
+	bool regs;      // register code
+	int *func_of;   // the function of each instruction
+	Func *funcs;
+	int nfuncs;
+	long ops[NOPS];
+	Frame *frames;  // frames[0] is the root
+	int nframes;
+	int room;
+	int at;         // the call running now
+	bool called;    // the instruction before was a call
+	bool returned;  // or a return
+	long nsamples;
+} prof;
+
+static volatile sig_atomic_t sample_due;
+
 int main (int argc, char **argv)
 {
-	FILE *fin = NULL;
-	Instruction instr = {0};
+	const void *image;
+	struct stat st;
+	ulc_vm_t *vm;
+	bool ngrams = false;
+	FILE *stacks = NULL;
+	size_t size;
+	bool ok = true;
+	int opt, fd, i;
 
 	setprogname(argv[0]);
+	if (!(vm = vm_create()))
+		fatal("%s: could not allocate memory\n", getprogname());
 
-	if (argc != 2)
-		fatal("usage:\t%s file", getprogname());
+	// -g: count opcode pairs and triples; -p FILE: profile, with the
+	// call stacks sampled written to FILE; -j: compile hot functions;
+	// -c N: after N calls
+	while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+		switch (opt) {
+			case 'g':
+				ngrams = true;
+				break;
+			case 'p':
+				if (!(stacks = fopen(optarg, "w")))
+					fatal("%s: couldn't open %s\n", getprogname(),
+					    optarg);
+				break;
+#ifdef JIT
+			case 'j':
+				jit_threshold = JIT_HOT;
+				break;
+			case 'c':
+				if (!isNumber(optarg) || atol(optarg) < 1)
+					fatal("%s: bad call count: %s", getprogname(),
+					    optarg);
+				jit_threshold = atol(optarg);
+				break;
+#endif
+			default:
+				fatal(USAGE, getprogname());
+		}
+	}
 
-	if (!(fin = fopen(argv[1], "rb")))
-		fatal("%s: couldn't open the bytecodes file\n", getprogname());
+	// several files run one after the other, on one machine, as uws
+	// runs its pages; only one is counted or profiled
+	argc -= optind;
+	argv += optind;
+	if (argc < 1 || (argc > 1 && (ngrams || stacks)))
+		fatal(USAGE, getprogname());
 
-	// Load bytecode instructions from the file into memory
-	while (true) {
-		if (fread(&instr, sizeof(Instruction), 1, fin) != 1)
+	if (ngrams) {
+		bigrams = calloc(NOPS, sizeof(*bigrams));
+		trigrams = calloc(NOPS, sizeof(*trigrams));
+		if (!bigrams || !trigrams)
+			fatal("%s: could not allocate memory\n", getprogname());
+	}
+	if (ngrams || stacks) {
+		vm_watch(vm, watch, NULL);
+#ifdef JIT
+		// native code goes unwatched
+		jit_threshold = 0;
+#endif
+	}
+
+	catch_overflow(vm);
+	for (i = 0; i < argc; i++) {
+		if ((fd = open(argv[i], O_RDONLY)) == -1)
+			fatal("%s: couldn't open the bytecodes file\n",
+			    getprogname());
+
+		// the code is run from the file itself, however large
+		if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
 			fatal("%s: error loading bytecodes\n", getprogname());
-		// if instruction read was "END", stop and set up stack top
-		// and 'main' pointer
-		if (instr.op == END)
+		if ((size = st.st_size) == 0)
+			fatal("%s: bad bytecodes file\n", getprogname());
+		image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (image == MAP_FAILED)
+			fatal("%s: error loading bytecodes\n", getprogname());
+		close(fd);
+
+		if (!vm_load(vm, image, size))
+			fatal("%s: bad bytecodes file\n", getprogname());
+
+		if (stacks)
+			start_profile(vm, image, size);
+		ok = vm_run(vm, 0) && ok;
+		if (stacks) {
+			setitimer(ITIMER_PROF,
+			    &(struct itimerval) { { 0, 0 }, { 0, 0 } }, NULL);
+			report_profile(stderr);
+			write_stacks(stacks);
+			if (fclose(stacks) == EOF)
+				fatal("%s: error writing the call stacks\n",
+				    getprogname());
+		}
+		if (ngrams) {
+			report_ngrams(vm, stderr, 2);
+			report_ngrams(vm, stderr, 3);
+		}
+		munmap((void *) image, size);
+	}
+	vm_destroy(vm);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* what -g and -p have the machine call before every instruction */
+static void
+watch(void *arg, int pc, int op)
+{
+	(void) arg;
+	if (bigrams)
+		count_ngrams(op);
+	if (prof.func_of)
+		profile(pc, op);
+}
+
+/*
+ * Running into the guard page ends the program, saying why, rather
+ * than with a bare segmentation fault
+ */
+static void
+catch_overflow(const ulc_vm_t *vm)
+{
+	struct sigaction sa;
+
+	guard = (char *) (vm->data + VM_DATA_SZ);
+	guard_end = (char *) vm->data + vm->data_size;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = overflowed;
+	sa.sa_flags = SA_SIGINFO | SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, NULL);
+}
+
+/* any other fault is left to crash, as the handler is gone already */
+static void
+overflowed(int sig, siginfo_t *si, void *context)
+{
+	static const char msg[] = "out of room for the stack\n";
+	char *at = si->si_addr;
+
+	(void) sig;
+	(void) context;
+	if (at >= guard && at < guard_end) {
+		write(STDERR_FILENO, msg, sizeof(msg) - 1);
+		_exit(EXIT_FAILURE);
+	}
+}
+
+static void
+count_ngrams(int op)
+{
+	if (nlast == 2)
+		trigrams[last_ops[0]][last_ops[1]][op]++;
+	if (nlast >= 1)
+		bigrams[last_ops[nlast - 1]][op]++;
+
+	if (nlast == 2)
+		last_ops[0] = last_ops[1];
+	last_ops[nlast == 2 ? 1 : nlast++] = op;
+}
+
+/*
+ * Write the opcode pairs (`len' 2) or triples (3) run most, and how
+ * many times each one was
+ */
+static void
+report_ngrams(const ulc_vm_t *vm, FILE *f, int len)
+{
+	const char *const *names = vm->reg_code ? reg_op_names : op_names;
+	size_t n = 0, i;
+	long total = 0;
+	Ngram *ng;
+	int a, b, c;
+
+	if (!(ng = calloc(NOPS * NOPS * NOPS, sizeof(*ng))))
+		fatal("%s: could not allocate memory\n", getprogname());
+
+	for (a = 0; a < NOPS; a++)
+		for (b = 0; b < NOPS; b++)
+			for (c = 0; c < (len == 2 ? 1 : NOPS); c++) {
+				ng[n].count = len == 2 ? bigrams[a][b] :
+				    trigrams[a][b][c];
+				ng[n].ops[0] = a;
+				ng[n].ops[1] = b;
+				ng[n].ops[2] = c;
+				total += ng[n].count;
+				n += ng[n].count != 0;
+			}
+	qsort(ng, n, sizeof(*ng), by_count);
+
+	fprintf(f, "%s %s, of %ld:\n", vm->reg_code ? "register" : "stack",
+	    len == 2 ? "opcode pairs" : "opcode triples", total);
+	for (i = 0; i < n && i < NGRAMS_SHOWN; i++) {
+		fprintf(f, "%12ld %5.1f%%  %s %s", ng[i].count,
+		    100.0 * ng[i].count / total, names[ng[i].ops[0]],
+		    names[ng[i].ops[1]]);
+		if (len == 3)
+			fprintf(f, " %s", names[ng[i].ops[2]]);
+		fprintf(f, "\n");
+	}
+
+	free(ng);
+}
+
+static int
+by_count(const void *a, const void *b)
+{
+	const Ngram *x = a, *y = b;
+
+	return (y->count > x->count) - (y->count < x->count);
+}
+
+/*
+ * Split the loaded code into functions, named from the file's symbols
+ * where it has them, and start the profiling timer
+ */
+static void
+start_profile(const ulc_vm_t *vm, const void *image, size_t size)
+{
+	const ImageHeader *head = image;
+	const ImageSection *sect = sections(image, size);
+	const ImageSym *syms = NULL;
+	const char *names = NULL;
+	size_t nsyms = 0, nnames = 0, i;
+	struct sigaction sa;
+	struct itimerval every;
+	char buf[32];
+	int op, f = -1;
+
+	prof.regs = vm->reg_code != NULL;
+	prof.func_of = malloc(vm->code_len * sizeof(*prof.func_of));
+	prof.funcs = malloc(vm->code_len * sizeof(*prof.funcs));
+	prof.room = 64;
+	prof.frames = malloc(prof.room * sizeof(*prof.frames));
+	if (!prof.func_of || !prof.funcs || !prof.frames)
+		fatal("%s: could not allocate memory\n", getprogname());
+
+	// whatever runs before the first ENTER is a function too
+	for (i = 0; i < vm->code_len; i++) {
+		op = prof.regs ? (int) vm->reg_code[i].op : (int) vm->code[i].op;
+		if (i == 0 || op == (prof.regs ? RENTER : ENTER)) {
+			f = prof.nfuncs++;
+			prof.funcs[f] = (Func) { NULL, i, 0, 0 };
+		}
+		prof.func_of[i] = f;
+	}
+
+	for (i = 0; i < head->nsections; i++) {
+		if (sect[i].kind == SECT_SYMS) {
+			syms = (const void *) ((const char *) image + sect[i].offset);
+			nsyms = sect[i].count;
+		} else if (sect[i].kind == SECT_NAMES) {
+			names = (const char *) image + sect[i].offset;
+			nnames = sect[i].count;
+		}
+	}
+	// the file stays mapped, names and all; a bad one is left out
+	for (i = 0; names && i < nsyms; i++) {
+		if (syms[i].at >= vm->code_len || syms[i].name >= nnames ||
+		    !memchr(names + syms[i].name, '\0', nnames - syms[i].name))
+			continue;
+		f = prof.func_of[syms[i].at];
+		if (prof.funcs[f].at == (int) syms[i].at)
+			prof.funcs[f].name = names + syms[i].name;
+	}
+	for (f = 0; f < prof.nfuncs; f++) {
+		if (prof.funcs[f].name)
+			continue;
+		if (prof.funcs[f].at == 0)
+			snprintf(buf, sizeof(buf), "(start)");
+		else
+			snprintf(buf, sizeof(buf), "@%d", prof.funcs[f].at);
+		if (!(prof.funcs[f].name = strdup(buf)))
+			fatal("%s: could not allocate memory\n", getprogname());
+	}
+
+	prof.frames[0] = (Frame) { -1, -1, -1, -1, 0 };
+	prof.nframes = 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = tick;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPROF, &sa, NULL);
+
+	every.it_interval.tv_sec = 0;
+	every.it_interval.tv_usec = 1000000 / PROF_HZ;
+	every.it_value = every.it_interval;
+	setitimer(ITIMER_PROF, &every, NULL);
+}
+
+/* the sample itself is left to profile(), outside the handler */
+static void
+tick(int sig)
+{
+	(void) sig;
+	sample_due = 1;
+}
+
+static void
+profile(int pc, int op)
+{
+	int f = prof.func_of[pc];
+	const Frame *at;
+
+	// a call makes a frame, a return goes back to its parent, and
+	// anything else which leaves the function jumped: the same depth
+	if (prof.called)
+		prof.at = frame_of(prof.at, f);
+	else if (prof.returned && prof.frames[prof.at].parent > 0)
+		prof.at = prof.frames[prof.at].parent;
+	at = &prof.frames[prof.at];
+	if (at->func != f)
+		prof.at = frame_of(at->parent < 0 ? 0 : at->parent, f);
+
+	if (prof.regs) {
+		prof.called = op == RCALL || op == RCALLF;
+		prof.returned = op == RRET;
+	} else {
+		prof.called = op == CALL;
+		prof.returned = op == RET;
+	}
+
+	prof.ops[op]++;
+	prof.funcs[f].insns++;
+	if (sample_due) {
+		sample_due = 0;
+		prof.frames[prof.at].samples++;
+		prof.funcs[f].samples++;
+		prof.nsamples++;
+	}
+}
+
+/* the frame for a call to `func' from `parent', made the first time */
+static int
+frame_of(int parent, int func)
+{
+	Frame *frames;
+	int i;
+
+	for (i = prof.frames[parent].child; i != -1; i = prof.frames[i].sibling)
+		if (prof.frames[i].func == func)
+			return i;
+
+	if (prof.nframes == prof.room) {
+		frames = realloc(prof.frames, 2 * prof.room * sizeof(*frames));
+		if (!frames)
+			fatal("%s: could not allocate memory\n", getprogname());
+		prof.frames = frames;
+		prof.room *= 2;
+	}
+	i = prof.nframes++;
+	prof.frames[i] = (Frame) { func, parent, -1, prof.frames[parent].child,
+	    0 };
+	prof.frames[parent].child = i;
+	return i;
+}
+
+/*
+ * The flat profile: the functions most sampled (or, as a tie, most
+ * run), with the instructions run in each, then every opcode run
+ */
+static void
+report_profile(FILE *f)
+{
+	const char *const *names = prof.regs ? reg_op_names : op_names;
+	Ngram ops[NOPS];
+	Func *funcs;
+	long total = 0;
+	int n = 0, i;
+
+	for (i = 0; i < NOPS; i++) {
+		ops[n].count = prof.ops[i];
+		ops[n].ops[0] = i;
+		total += prof.ops[i];
+		n += prof.ops[i] != 0;
+	}
+	qsort(ops, n, sizeof(*ops), by_count);
+	// sorted apart, as the call stacks still name them by index
+	if (!(funcs = malloc(prof.nfuncs * sizeof(*funcs))))
+		fatal("%s: could not allocate memory\n", getprogname());
+	memcpy(funcs, prof.funcs, prof.nfuncs * sizeof(*funcs));
+	qsort(funcs, prof.nfuncs, sizeof(*funcs), by_samples);
+
+	fprintf(f, "functions, of %ld samples %d ms apart, and %ld "
+	    "instructions:\n", prof.nsamples, 1000 / PROF_HZ, total);
+	for (i = 0; i < prof.nfuncs && i < PROF_SHOWN; i++) {
+		if (!funcs[i].insns)
 			break;
-		// ... otherwise, just increment pc and repeat
-		section_code[pc++] = instr;
+		fprintf(f, "%8ld %5.1f%% %12ld %5.1f%%  %s\n", funcs[i].samples,
+		    prof.nsamples ? 100.0 * funcs[i].samples / prof.nsamples : 0.0,
+		    funcs[i].insns, 100.0 * funcs[i].insns / total, funcs[i].name);
 	}
+	free(funcs);
+
+	fprintf(f, "%s opcodes, of %ld:\n", prof.regs ? "register" : "stack",
+	    total);
+	for (i = 0; i < n; i++)
+		fprintf(f, "%12ld %5.1f%%  %s\n", ops[i].count,
+		    100.0 * ops[i].count / total, names[ops[i].ops[0]]);
+}
+
+static int
+by_samples(const void *a, const void *b)
+{
+	const Func *x = a, *y = b;
+
+	if (x->samples != y->samples)
+		return (y->samples > x->samples) - (y->samples < x->samples);
+	return (y->insns > x->insns) - (y->insns < x->insns);
+}
+
+/*
+ * The call stacks sampled, one line for each, collapsed as flame
+ * graph scripts take them: the functions from the outermost in, split
+ * by `;', then the number of samples
+ */
+static void
+write_stacks(FILE *f)
+{
+	int *path, depth, i, j;
 
-	// first END instruction contains the stack top
-	sp = instr.arg2 == 0 ? -1 : sp;
-	// second END instruction contains the entry point pointer
-	fread(&instr, sizeof(Instruction), 1, fin);
-	pc = instr.arg2;
+	if (!(path = malloc(prof.nframes * sizeof(*path))))
+		fatal("%s: could not allocate memory\n", getprogname());
 
-	fclose(fin);
-	fetch_exec_cycle();
+	for (i = 1; i < prof.nframes; i++) {
+		if (!prof.frames[i].samples)
+			continue;
+		depth = 0;
+		for (j = i; j > 0; j = prof.frames[j].parent)
+			path[depth++] = prof.frames[j].func;
+		while (depth--)
+			fprintf(f, "%s%c", prof.funcs[path[depth]].name,
+			    depth ? ';' : ' ');
+		fprintf(f, "%ld\n", prof.frames[i].samples);
+	}
 
-	return EXIT_SUCCESS;
+	free(path);
 }
 #endif
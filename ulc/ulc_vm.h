@@ -1,9 +1,29 @@
 #ifndef ulc_vm_h
 #define ulc_vm_h
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* the most code and data ulcc makes a program of */
 #define SEC_CODE_SZ 2048
 #define SEC_DATA_SZ 4096
 
+/*
+ * The data a machine reserves, in slots: globals, then the stack.  Its
+ * pages are only taken as a program first touches them, and a guard
+ * page after it stops anything which runs off the end
+ */
+#define VM_DATA_SZ (1L << 20)
+
+/*
+ * Arrays are a slot with their length, then the elements, in the
+ * globals or a frame.  An array is known by the address of its length
+ * slot, which is what the indexed opcodes take; they stop the program
+ * at an index (or an address) outside the array
+ */
+
 /*
  * Opcodes
  */
@@ -12,8 +32,10 @@ typedef enum {
 	STO,  // STO,   BASE, OFF: store the top of the stack in BASE+OFF
 	JMP,  // JMP,   0,    NPC: set PC to NPC
 	JMPZ, // JMPZ,  0,    NPC: set PC to NPC if top of stack is zero
-	CALL, // CALL,  NFP,  NPC: set FP to NFP and FP to NFP
-	RET,  // RET,   0,      0: restore PC and leave value on the stack
+	CALL, // CALL,  N,    NPC: FP = SP-N (the return address, before the
+	      //                   N arguments), push the old FP, set PC to NPC
+	RET,  // RET,   0,    OFF: restore PC, and FP from FP+OFF, and leave
+	      //                   the value on the stack, where PC was
 	LODI, // LODI,  0,    VAL: load integer onto the stack
 	LODV, // LODV,  BASE, OFF: load value at BASE+OFF onto the stack
 	IN,   // IN,    BASE, OFF: read standard input into BASE+OFF
@@ -34,6 +56,21 @@ typedef enum {
 	NOT,  // NOT    0,      0: STACK[TOP]   = !STACK[TOP]
 	AND,  // AND    0,      0: STACK[TOP-1] =  STACK[TOP-1] && STACK[TOP]; TOP--
 	OR,   // OR     0,      0: STACK[TOP-1] =  STACK[TOP-1] || STACK[TOP]; TOP--
+	LODL, // LODL,  0,    OFF: load the local at FP+OFF onto the stack
+	STOL, // STOL,  0,    OFF: store the top of the stack in FP+OFF
+	INL,  // INL,   0,    OFF: read standard input into FP+OFF
+	ENTER,// ENTER, 0,      N: make room for N locals (SP = FP+N)
+	JLT,  // JLT,   0,    NPC: set PC to NPC if STACK[TOP-1] <  STACK[TOP]; TOP -= 2
+	JLE,  // JLE,   0,    NPC: set PC to NPC if STACK[TOP-1] <= STACK[TOP]; TOP -= 2
+	JGT,  // JGT,   0,    NPC: set PC to NPC if STACK[TOP-1] >  STACK[TOP]; TOP -= 2
+	JGE,  // JGE,   0,    NPC: set PC to NPC if STACK[TOP-1] >= STACK[TOP]; TOP -= 2
+	JEQ,  // JEQ,   0,    NPC: set PC to NPC if STACK[TOP-1] == STACK[TOP]; TOP -= 2
+	JNE,  // JNE,   0,    NPC: set PC to NPC if STACK[TOP-1] != STACK[TOP]; TOP -= 2
+	LODA, // LODA,  0,    OFF: load the address FP+OFF onto the stack
+	LODX, // LODX,  0,      0: STACK[TOP-1] = element STACK[TOP] of the array at STACK[TOP-1]; TOP--
+	STOX, // STOX,  0,      0: element STACK[TOP-1] of the array at STACK[TOP-2] = STACK[TOP]; TOP -= 3
+	FILL, // FILL,  0,      0: every element of the array at STACK[TOP] = STACK[TOP-1]; TOP -= 2
+	COPY, // COPY,  0,      0: the array at STACK[TOP] = the one at STACK[TOP-1], as long; TOP -= 2
 	END   // placeholder
 } OpCode;
 
@@ -50,4 +87,151 @@ typedef struct instruction {
 	long arg2;
 } Instruction;
 
+/*
+ * Register machine opcodes: three-address code over the registers
+ * of the running function, R[0...] (its parameters first, then its
+ * locals and temporaries), and the globals, G[0...]
+ */
+typedef enum {
+	RHLT,  // HLT
+	RMOV,  // MOV    A, B:      R[A] = R[B]
+	RLDI,  // LDI    A, VAL:    R[A] = VAL
+	RGETG, // GETG   A, G:      R[A] = G[G]
+	RSETG, // SETG   A, G:      G[G] = R[A]
+	RJMP,  // JMP    0, NPC:    set PC to NPC
+	RJMPZ, // JMPZ   A, NPC:    set PC to NPC if R[A] is zero
+	RCALL, // CALL   A, NPC:    call NPC with its registers from R[A+1]
+	       //                   on (the arguments), and the result in R[A]
+	RRET,  // RET    A:         return R[A]
+	RENTER,// ENTER  A:         the function takes A registers
+	RIN,   // IN     A:         read standard input into R[A]
+	ROUT,  // OUT    A:         write R[A] to standard out
+	RNEG,  // NEG    A, B:      R[A] = -R[B]
+	RNOT,  // NOT    A, B:      R[A] = !R[B]
+	RLT,   // LT     A, B, C:   R[A] = R[B] <  R[C]
+	RLE,   // LE     A, B, C:   R[A] = R[B] <= R[C]
+	RGT,   // GT     A, B, C:   R[A] = R[B] >  R[C]
+	RGE,   // GE     A, B, C:   R[A] = R[B] >= R[C]
+	REQ,   // EQ     A, B, C:   R[A] = R[B] == R[C]
+	RNEQ,  // NEQ    A, B, C:   R[A] = R[B] != R[C]
+	RADD,  // ADD    A, B, C:   R[A] = R[B] +  R[C]
+	RSUB,  // SUB    A, B, C:   R[A] = R[B] -  R[C]
+	RMUL,  // MUL    A, B, C:   R[A] = R[B] *  R[C]
+	RDIV,  // DIV    A, B, C:   R[A] = R[B] /  R[C]
+	RMOD,  // MOD    A, B, C:   R[A] = R[B] %  R[C]
+	RPOW,  // POW    A, B, C:   R[A] = R[B] ^  R[C]
+	RAND,  // AND    A, B, C:   R[A] = R[B] && R[C]
+	ROR,   // OR     A, B, C:   R[A] = R[B] || R[C]
+	RLTI,  // LTI    A, B, VAL: R[A] = R[B] <  VAL
+	RLEI,  // LEI    A, B, VAL: R[A] = R[B] <= VAL
+	RGTI,  // GTI    A, B, VAL: R[A] = R[B] >  VAL
+	RGEI,  // GEI    A, B, VAL: R[A] = R[B] >= VAL
+	REQI,  // EQI    A, B, VAL: R[A] = R[B] == VAL
+	RNEQI, // NEQI   A, B, VAL: R[A] = R[B] != VAL
+	RADDI, // ADDI   A, B, VAL: R[A] = R[B] +  VAL
+	RSUBI, // SUBI   A, B, VAL: R[A] = R[B] -  VAL
+	RMULI, // MULI   A, B, VAL: R[A] = R[B] *  VAL
+	RDIVI, // DIVI   A, B, VAL: R[A] = R[B] /  VAL
+	RMODI, // MODI   A, B, VAL: R[A] = R[B] %  VAL
+	RJLT,  // JLT    A, NPC, C: set PC to NPC if R[A] <  R[C]
+	RJLE,  // JLE    A, NPC, C: set PC to NPC if R[A] <= R[C]
+	RJGT,  // JGT    A, NPC, C: set PC to NPC if R[A] >  R[C]
+	RJGE,  // JGE    A, NPC, C: set PC to NPC if R[A] >= R[C]
+	RJEQ,  // JEQ    A, NPC, C: set PC to NPC if R[A] == R[C]
+	RJNE,  // JNE    A, NPC, C: set PC to NPC if R[A] != R[C]
+	RJLTI, // JLTI   A, NPC, VAL: set PC to NPC if R[A] <  VAL
+	RJLEI, // JLEI   A, NPC, VAL: set PC to NPC if R[A] <= VAL
+	RJGTI, // JGTI   A, NPC, VAL: set PC to NPC if R[A] >  VAL
+	RJGEI, // JGEI   A, NPC, VAL: set PC to NPC if R[A] >= VAL
+	RJEQI, // JEQI   A, NPC, VAL: set PC to NPC if R[A] == VAL
+	RJNEI, // JNEI   A, NPC, VAL: set PC to NPC if R[A] != VAL
+	RCALLF,// CALLF  A, NPC, N: CALL A, NPC and the ENTER N there, in one
+	RADDJ, // ADDJ   A, NPC, VAL: R[A] = R[A] + VAL, and set PC to NPC
+	RLEA,  // LEA    A, B:      R[A] = the address of R[B]
+	RLDX,  // LDX    A, B, C:   R[A] = element R[C] of the array at R[B]
+	RSTX,  // STX    A, B, C:   element R[C] of the array at R[B] = R[A]
+	RFILL, // FILL   A, B:      every element of the array at R[A] = R[B]
+	RCOPY, // COPY   A, B:      the array at R[A] = the one at R[B], as long
+	REND   // placeholder
+} RegOpCode;
+
+extern const char* const reg_op_names[];
+
+typedef struct reginstruction {
+	RegOpCode op;
+	int a;
+	long b;
+	long c;
+} RegInstruction;
+
+/*
+ * Bytecode files, as ulcc writes them and vm_load() takes them: a
+ * header, the table of the sections, then the sections, each at an
+ * offset from the start of the file which is a multiple of 8.  Every
+ * field has a fixed width, so a file mapped in is read where it is.
+ * Numbers are in the byte order of the machine that wrote them; in a
+ * file from one of the other order, the magic number is backwards
+ */
+#define IMG_MAGIC 0x31636c75 /* "ulc1" */
+#define IMG_VERSION 1
+
+typedef enum {
+	SECT_STACK = 1, // stack code: ImageInsn, ARG1 and ARG2 in B and C
+	SECT_REGS,      // register code: ImageInsn
+	SECT_CONST,     // int64_t operands too wide for an instruction
+	SECT_SYMS,      // ImageSym, one per function; optional
+	SECT_NAMES      // the names they give, NUL-terminated
+} SectionKind;
+
+typedef struct imageheader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t nsections;
+	uint32_t ndata;    // globals
+	uint32_t entry;    // where main starts
+} ImageHeader;
+
+typedef struct imagesection {
+	uint32_t kind;
+	uint32_t count;    // entries; bytes, for SECT_NAMES
+	uint64_t offset;
+} ImageSection;
+
+/*
+ * Instructions: the opcode in the low 8 bits of `op', and A in the
+ * bits above, up to IMG_A_MAX.  B and C are the operands, or with
+ * IMG_BIG_B (IMG_BIG_C) set, where they are in SECT_CONST
+ */
+#define IMG_BIG_B (1u << 31)
+#define IMG_BIG_C (1u << 30)
+#define IMG_A_MAX ((1 << 22) - 1)
+
+typedef struct imageinsn {
+	uint32_t op;
+	int32_t b;
+	int32_t c;
+} ImageInsn;
+
+typedef struct imagesym {
+	uint32_t at;       // the function's first instruction
+	uint32_t name;     // where its name starts, in SECT_NAMES
+} ImageSym;
+
+/*
+ * Running programs: a machine runs one program at a time, on one
+ * thread at a time, but machines share nothing, so a host can run
+ * as many of them at once as it has threads for
+ */
+typedef struct ulc_vm ulc_vm_t;
+
+ulc_vm_t *vm_create(void);
+void vm_destroy(ulc_vm_t *vm);
+bool vm_load(ulc_vm_t *vm, const void *image, size_t size);
+void vm_io(ulc_vm_t *vm, FILE *in, FILE *out);
+bool vm_run(ulc_vm_t *vm, long limit);
+
+/* for profilers and the like: see vm_watch() */
+typedef void (*vm_watcher)(void *arg, int pc, int op);
+void vm_watch(ulc_vm_t *vm, vm_watcher watcher, void *arg);
+
 #endif
@@ -0,0 +1,259 @@
+/*
+ * Dynamic pages: programs compiled by ulc, whose bytecodes under
+ * pages/app/ are all loaded at startup and then run in-process,
+ * with no fork or exec, by the thread serving the request (each
+ * has a VM of its own, made on its first request).  The values of
+ * the query parameters, in order, are what the program reads; what
+ * it writes is the body.
+ */
+
+#define _GNU_SOURCE /* fmemopen, open_memstream */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "include/http.h"
+#include "include/app.h"
+#include "ulc_vm.h"
+
+struct program {
+	char *name;           /* as found after APP_PREFIX */
+	void *image;          /* stack or register code, as ulcc wrote it */
+	size_t size;
+};
+
+static struct program *programs;  /* sorted by name */
+static size_t nprograms;
+static _Thread_local ulc_vm_t *vm;
+
+static bool load(ulc_vm_t *check, const char *name, struct program *p);
+static const struct program *lookup(struct strView name);
+static size_t programInput(struct strView query, char *buff);
+static int  hexValue(char c);
+static int  compareProgram(const void *a, const void *b);
+
+/*
+ * Load every program there is; having none is fine
+ */
+bool
+appInit(void)
+{
+	struct program *p;
+	struct dirent *de;
+	size_t cap = 0, len;
+	ulc_vm_t *check;
+	DIR *dir;
+
+	if (!(dir = opendir(APP_DIR)))
+		return errno == ENOENT;
+	if (!(check = vm_create())) {
+		closedir(dir);
+		return false;
+	}
+
+	while ((de = readdir(dir))) {
+		len = strlen(de->d_name);
+		if (len <= strlen(APP_EXT) ||
+		    strcmp(de->d_name + len - strlen(APP_EXT), APP_EXT) != 0)
+			continue;
+
+		if (nprograms == cap) {
+			cap = cap ? cap * 2 : 16;
+			if (!(p = realloc(programs, cap * sizeof(*p))))
+				break;
+			programs = p;
+		}
+		if (load(check, de->d_name, &programs[nprograms]))
+			nprograms++;
+		else
+			fprintf(stdout, "cannot load %s/%s\n", APP_DIR, de->d_name);
+	}
+	closedir(dir);
+	vm_destroy(check);
+
+	qsort(programs, nprograms, sizeof(*programs), compareProgram);
+	return true;
+}
+
+/*
+ * Is it a path we run rather than send?  Nothing under APP_PREFIX
+ * is ever sent as is
+ */
+bool
+appPath(struct strView path)
+{
+	return path.len >= strlen(APP_PREFIX) &&
+	    memcmp(path.ptr, APP_PREFIX, strlen(APP_PREFIX)) == 0;
+}
+
+/*
+ * Run the program a path names; its output, to be freed by the
+ * caller, if it ran to the end (200).  NULL if there is no such
+ * program (404), or it failed or ran for too long (500)
+ */
+char *
+appRun(struct strView path, int *status, size_t *len)
+{
+	const struct program *p;
+	struct strView name, query = {NULL, 0};
+	char input[REQ_BUFF_SZ + 1];
+	char *body = NULL;
+	const char *q;
+	FILE *in, *out;
+	bool ok;
+
+	name.ptr = path.ptr + strlen(APP_PREFIX);
+	name.len = path.len - strlen(APP_PREFIX);
+	if ((q = memchr(name.ptr, '?', name.len))) {
+		query.ptr = q + 1;
+		query.len = name.len - (q + 1 - name.ptr);
+		name.len = q - name.ptr;
+	}
+
+	*status = 404;
+	if (!(p = lookup(name)))
+		return NULL;
+
+	*status = 500;
+	if (!vm && !(vm = vm_create()))
+		return NULL;
+	/* fmemopen(3) wants some room, even for no input at all */
+	if (!(in = fmemopen(input, programInput(query, input) + 1, "r")))
+		return NULL;
+	if (!(out = open_memstream(&body, len))) {
+		fclose(in);
+		return NULL;
+	}
+
+	vm_io(vm, in, out);
+	ok = vm_load(vm, p->image, p->size) && vm_run(vm, APP_BUDGET);
+	vm_io(vm, NULL, NULL);
+	fclose(in);
+
+	if (fclose(out) != 0 || !ok) {
+		free(body);
+		return NULL;
+	}
+
+	*status = 200;
+	return body;
+}
+
+/*
+ * Read a program in, and load it on `check' to see that it would run
+ */
+static bool
+load(ulc_vm_t *check, const char *name, struct program *p)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", APP_DIR, name);
+	if (!(f = fopen(path, "rb")))
+		return false;
+
+	p->image = NULL;
+	p->name = strdup(name);
+	p->size = fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) ?
+	    st.st_size : 0;
+
+	/* whatever vm_load() would turn down, turn down now */
+	if (!p->name || p->size == 0 ||
+	    !(p->image = malloc(p->size)) ||
+	    fread(p->image, 1, p->size, f) != p->size ||
+	    !vm_load(check, p->image, p->size)) {
+		fclose(f);
+		free(p->name);
+		free(p->image);
+		return false;
+	}
+
+	fclose(f);
+	return true;
+}
+
+static const struct program *
+lookup(struct strView name)
+{
+	size_t lo = 0, hi = nprograms, mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = strncmp(programs[mid].name, name.ptr, name.len);
+		if (cmp == 0 && programs[mid].name[name.len] != '\0')
+			cmp = 1;
+		if (cmp == 0)
+			return &programs[mid];
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+/*
+ * The values of the parameters in a query ("a=1&b=2" reads as "1\n2\n"),
+ * decoded; `buff' must take at least query.len + 1 bytes
+ */
+static size_t
+programInput(struct strView query, char *buff)
+{
+	const char *s = query.ptr, *end = query.ptr + query.len;
+	size_t len = 0;
+	bool value = false;
+	int hi, lo;
+
+	for (; s < end; s++) {
+		if (*s == '&') {
+			if (value)
+				buff[len++] = '\n';
+			value = false;
+		} else if (*s == '=' && !value) {
+			value = true;
+		} else if (!value) {
+			continue;
+		} else if (*s == '+') {
+			buff[len++] = ' ';
+		} else if (*s == '%' && end - s > 2 && (hi = hexValue(s[1])) >= 0 &&
+		    (lo = hexValue(s[2])) >= 0) {
+			buff[len++] = hi << 4 | lo;
+			s += 2;
+		} else {
+			buff[len++] = *s;
+		}
+	}
+	if (value)
+		buff[len++] = '\n';
+	buff[len] = '\0';
+
+	return len;
+}
+
+static int
+hexValue(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static int
+compareProgram(const void *a, const void *b)
+{
+	return strcmp(((const struct program *) a)->name,
+	    ((const struct program *) b)->name);
+}
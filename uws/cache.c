@@ -0,0 +1,503 @@
+/*
+ * In-memory cache of small static files, kept along with their
+ * prebuilt response headers so that a hit costs one writev(2),
+ * and with compressed variants of them built on demand.
+ * The cache is bounded in size, evicting the least recently used
+ * entries first, and an inotify watch on the document root drops
+ * entries as soon as the files behind them change.
+ *
+ * Entries are reference counted: one evicted or invalidated while
+ * a response is still being sent is freed on its last release.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#include "include/cache.h"
+
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | \
+    IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | \
+    IN_ONLYDIR)
+
+/* a watched directory; `dir' is "" for the root, "sub/dir/" otherwise */
+struct watch {
+	int wd;
+	char *dir;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cacheEntry *table[CACHE_BUCKETS];
+static struct cacheEntry *lruHead;
+static struct cacheEntry *lruTail;
+static size_t bytes;
+static size_t maxBytes;
+/* bumped on every invalidation; see cacheInsert() */
+static unsigned generation;
+static bool enabled = false;
+
+static int ifd = -1;
+static struct watch *watches;
+static int nwatches;
+
+static void *watcher(void *data);
+static void handleEvent(struct inotify_event *ev);
+static void watchTree(const char *dir);
+static void cacheDrop(const char *path);
+static void cacheFlush(void);
+static void unlinkEntry(struct cacheEntry *e);
+static void freeEntry(struct cacheEntry *e);
+static size_t entrySize(struct cacheEntry *e);
+static bool cacheable(const char *path);
+static unsigned hash(const char *str);
+
+/*
+ * Start caching files under the current directory; false (and
+ * no caching at all) if we cannot watch it for changes
+ */
+bool
+cacheInit(size_t max)
+{
+	pthread_t thread;
+
+	if ((ifd = inotify_init1(IN_CLOEXEC)) == -1)
+		return false;
+
+	watchTree("");
+	if (nwatches == 0) {
+		close(ifd);
+		return false;
+	}
+
+	if (pthread_create(&thread, NULL, watcher, NULL) != 0) {
+		close(ifd);
+		return false;
+	}
+	pthread_detach(thread);
+
+	maxBytes = max;
+	enabled = true;
+	return true;
+}
+
+/*
+ * Find and pin an entry.  `gen' is set to the generation the
+ * lookup saw; a miss hands it over to cacheInsert()
+ */
+struct cacheEntry *
+cacheLookup(const char *path, int status, unsigned *gen)
+{
+	struct cacheEntry *e = NULL;
+
+	pthread_mutex_lock(&lock);
+	*gen = generation;
+
+	if (!enabled) {
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+
+	for (e = table[hash(path) % CACHE_BUCKETS]; e; e = e->hnext)
+		if (e->status == status && strcmp(e->path, path) == 0)
+			break;
+
+	if (e) {
+		/* move to the front of the LRU list */
+		if (e != lruHead) {
+			e->prev->next = e->next;
+			if (e->next)
+				e->next->prev = e->prev;
+			else
+				lruTail = e->prev;
+			e->prev = NULL;
+			e->next = lruHead;
+			lruHead->prev = e;
+			lruHead = e;
+		}
+		e->refs++;
+	}
+
+	pthread_mutex_unlock(&lock);
+	return e;
+}
+
+/*
+ * Load `size' bytes of `fd' into a new entry and pin it.  Nothing
+ * is cached if the file is too big, or if anything was invalidated
+ * since the lookup that missed (generation `gen'): the file we read
+ * might already be stale
+ */
+struct cacheEntry *
+cacheInsert(const char *path, int status, const char *head, size_t headLen,
+    int fd, size_t size, const struct timespec *mtime, unsigned gen)
+{
+	struct cacheEntry *e, *old;
+	struct variant *v;
+	unsigned b;
+	size_t off;
+	ssize_t n;
+
+	if (!enabled || size > CACHE_MAX_FILE || headLen + size > maxBytes ||
+	    !cacheable(path))
+		return NULL;
+
+	if (!(e = calloc(1, sizeof(struct cacheEntry))))
+		return NULL;
+
+	v = &e->var[ENC_IDENTITY];
+	if (!(e->path = strdup(path)) || !(v->head = malloc(headLen)) ||
+	    !(v->body = malloc(size ? size : 1))) {
+		freeEntry(e);
+		return NULL;
+	}
+
+	e->status = status;
+	e->mtime = *mtime;
+	e->tried[ENC_IDENTITY] = true;
+	v->headLen = headLen;
+	v->bodyLen = size;
+	memcpy(v->head, head, headLen);
+
+	for (off = 0; off < size; off += n) {
+		if ((n = pread(fd, v->body + off, size - off, off)) == -1 &&
+		    errno == EINTR)
+			n = 0;
+		else if (n <= 0) {
+			freeEntry(e);
+			return NULL;
+		}
+	}
+
+	pthread_mutex_lock(&lock);
+
+	if (gen != generation) {
+		pthread_mutex_unlock(&lock);
+		freeEntry(e);
+		return NULL;
+	}
+
+	b = hash(path) % CACHE_BUCKETS;
+	for (old = table[b]; old; old = old->hnext)
+		if (old->status == status && strcmp(old->path, path) == 0)
+			break;
+
+	if (old) {
+		/* somebody else got here first */
+		old->refs++;
+		pthread_mutex_unlock(&lock);
+		freeEntry(e);
+		return old;
+	}
+
+	while (lruTail && bytes + headLen + size > maxBytes)
+		unlinkEntry(lruTail);
+
+	e->hnext = table[b];
+	table[b] = e;
+	e->next = lruHead;
+	if (lruHead)
+		lruHead->prev = e;
+	else
+		lruTail = e;
+	lruHead = e;
+
+	bytes += headLen + size;
+	e->cached = true;
+	e->refs = 1;
+
+	pthread_mutex_unlock(&lock);
+	return e;
+}
+
+/*
+ * Get the `enc' variant of a pinned entry: 1 if it is there, 0 if
+ * nobody built it yet, -1 if it was found not worth having
+ */
+int
+cacheVariant(struct cacheEntry *e, int enc, struct variant *v)
+{
+	int status;
+
+	pthread_mutex_lock(&lock);
+	if (!e->tried[enc])
+		status = 0;
+	else if (!e->var[enc].head)
+		status = -1;
+	else {
+		*v = e->var[enc];
+		status = 1;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return status;
+}
+
+/*
+ * Hand a freshly built variant (v->head == NULL if not worth it)
+ * over to a pinned entry; dropped if another one got there first
+ */
+void
+cacheSetVariant(struct cacheEntry *e, int enc, struct variant *v)
+{
+	pthread_mutex_lock(&lock);
+
+	if (e->tried[enc]) {
+		pthread_mutex_unlock(&lock);
+		free(v->head);
+		free(v->body);
+		return;
+	}
+
+	e->tried[enc] = true;
+	e->var[enc] = *v;
+
+	if (e->cached) {
+		bytes += v->headLen + v->bodyLen;
+		while (lruTail && lruTail != e && bytes > maxBytes)
+			unlinkEntry(lruTail);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+void
+cacheRelease(struct cacheEntry *e)
+{
+	bool dead;
+
+	pthread_mutex_lock(&lock);
+	dead = --e->refs == 0 && !e->cached;
+	pthread_mutex_unlock(&lock);
+
+	if (dead)
+		freeEntry(e);
+}
+
+static void
+cacheDrop(const char *path)
+{
+	struct cacheEntry *e, *next;
+
+	pthread_mutex_lock(&lock);
+	generation++;
+	for (e = table[hash(path) % CACHE_BUCKETS]; e; e = next) {
+		next = e->hnext;
+		if (strcmp(e->path, path) == 0)
+			unlinkEntry(e);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+cacheFlush(void)
+{
+	pthread_mutex_lock(&lock);
+	generation++;
+	while (lruHead)
+		unlinkEntry(lruHead);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Take an entry out of the table and the LRU list; it is freed
+ * right away unless some response still holds it.  Call locked
+ */
+static void
+unlinkEntry(struct cacheEntry *e)
+{
+	struct cacheEntry **pp;
+
+	for (pp = &table[hash(e->path) % CACHE_BUCKETS]; *pp != e; pp = &(*pp)->hnext)
+		;
+	*pp = e->hnext;
+
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		lruHead = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		lruTail = e->prev;
+
+	bytes -= entrySize(e);
+	e->cached = false;
+
+	if (e->refs == 0)
+		freeEntry(e);
+}
+
+static void
+freeEntry(struct cacheEntry *e)
+{
+	int i;
+
+	for (i = 0; i < ENC_COUNT; i++) {
+		free(e->var[i].head);
+		free(e->var[i].body);
+	}
+	free(e->path);
+	free(e);
+}
+
+static size_t
+entrySize(struct cacheEntry *e)
+{
+	size_t sz = 0;
+	int i;
+
+	for (i = 0; i < ENC_COUNT; i++)
+		sz += e->var[i].headLen + e->var[i].bodyLen;
+
+	return sz;
+}
+
+static void *
+watcher(void *data)
+{
+	char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+
+	(void) data;
+
+	while (true) {
+		if ((n = read(ifd, buff, sizeof(buff))) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (p = buff; p < buff + n; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (struct inotify_event *) p;
+			handleEvent(ev);
+		}
+	}
+
+	/* can't tell about changes anymore: stop caching */
+	pthread_mutex_lock(&lock);
+	enabled = false;
+	pthread_mutex_unlock(&lock);
+	cacheFlush();
+	return NULL;
+}
+
+static void
+handleEvent(struct inotify_event *ev)
+{
+	char path[PATH_MAX];
+	int i;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		cacheFlush();
+		return;
+	}
+
+	for (i = 0; i < nwatches; i++)
+		if (watches[i].wd == ev->wd)
+			break;
+	if (i == nwatches)
+		return;
+
+	if (ev->mask & IN_IGNORED) {
+		free(watches[i].dir);
+		watches[i] = watches[--nwatches];
+		return;
+	}
+
+	if (!ev->len)
+		return;
+
+	snprintf(path, sizeof(path), "%s%s", watches[i].dir, ev->name);
+
+	if (ev->mask & IN_ISDIR) {
+		/* a whole subtree came or went; start over */
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+			strncat(path, "/", sizeof(path) - strlen(path) - 1);
+			watchTree(path);
+		}
+		cacheFlush();
+		return;
+	}
+
+	cacheDrop(path);
+}
+
+/*
+ * Watch `dir' (relative to the root, "" for the root itself,
+ * otherwise with a trailing slash) and every directory below it
+ */
+static void
+watchTree(const char *dir)
+{
+	char sub[PATH_MAX];
+	struct watch *w;
+	struct dirent *de;
+	DIR *dp;
+	int wd;
+
+	if ((wd = inotify_add_watch(ifd, *dir ? dir : ".", WATCH_MASK)) == -1)
+		return;
+
+	if ((w = realloc(watches, (nwatches + 1) * sizeof(struct watch)))) {
+		watches = w;
+		watches[nwatches].wd = wd;
+		if ((watches[nwatches].dir = strdup(dir)))
+			nwatches++;
+	}
+
+	if (!(dp = opendir(*dir ? dir : ".")))
+		return;
+
+	while ((de = readdir(dp))) {
+		if (de->d_type != DT_DIR || strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+		snprintf(sub, sizeof(sub), "%s%s/", dir, de->d_name);
+		watchTree(sub);
+	}
+
+	closedir(dp);
+}
+
+/*
+ * Only plain relative paths can be cached: a file reachable under
+ * several names ("a//b", "./a/b") would miss its invalidations
+ */
+static bool
+cacheable(const char *path)
+{
+	const char *p = path, *slash;
+	size_t len;
+
+	do {
+		slash = strchr(p, '/');
+		len = slash ? (size_t) (slash - p) : strlen(p);
+		if (len == 0 || (len == 1 && p[0] == '.') ||
+		    (len == 2 && p[0] == '.' && p[1] == '.'))
+			return false;
+		p = slash + 1;
+	} while (slash);
+
+	return true;
+}
+
+/* FNV-1a */
+static unsigned
+hash(const char *str)
+{
+	unsigned h = 2166136261u;
+
+	while (*str)
+		h = (h ^ (unsigned char) *str++) * 16777619u;
+
+	return h;
+}
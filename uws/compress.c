@@ -0,0 +1,95 @@
+/*
+ * Content codings for cached bodies.  Compression happens once
+ * per file and encoding, so we can afford high levels
+ */
+
+#include <stdlib.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+
+#include "include/http.h"
+#include "include/compress.h"
+
+static char *gzip(const char *in, size_t len, size_t *outLen);
+static char *brotli(const char *in, size_t len, size_t *outLen);
+
+/*
+ * Encode `len' bytes of `in' into a new buffer; NULL if that
+ * failed or did not make the body any smaller
+ */
+char *
+compressBody(int enc, const char *in, size_t len, size_t *outLen)
+{
+	char *out;
+
+	switch (enc) {
+	case ENC_GZIP:
+		out = gzip(in, len, outLen);
+		break;
+	case ENC_BR:
+		out = brotli(in, len, outLen);
+		break;
+	default:
+		return NULL;
+	}
+
+	if (out && *outLen >= len) {
+		free(out);
+		return NULL;
+	}
+
+	return out;
+}
+
+static char *
+gzip(const char *in, size_t len, size_t *outLen)
+{
+	z_stream zs = {0};
+	char *out;
+	size_t bound;
+
+	/* 15 + 16: largest window, gzip wrapper */
+	if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+
+	bound = deflateBound(&zs, len);
+	if (!(out = malloc(bound))) {
+		deflateEnd(&zs);
+		return NULL;
+	}
+
+	zs.next_in = (Bytef *) in;
+	zs.avail_in = len;
+	zs.next_out = (Bytef *) out;
+	zs.avail_out = bound;
+
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&zs);
+		free(out);
+		return NULL;
+	}
+
+	*outLen = zs.total_out;
+	deflateEnd(&zs);
+	return out;
+}
+
+static char *
+brotli(const char *in, size_t len, size_t *outLen)
+{
+	char *out;
+
+	*outLen = BrotliEncoderMaxCompressedSize(len);
+	if (*outLen == 0 || !(out = malloc(*outLen)))
+		return NULL;
+
+	if (!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW,
+	    BROTLI_MODE_GENERIC, len, (const uint8_t *) in, outLen,
+	    (uint8_t *) out)) {
+		free(out);
+		return NULL;
+	}
+
+	return out;
+}
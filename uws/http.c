@@ -0,0 +1,383 @@
+/*
+ * HTTP request parsing.  The parser never copies nor allocates:
+ * it hands back views into the caller's buffer, and can simply be
+ * run again over the same buffer once more data has arrived
+ */
+
+#define _GNU_SOURCE /* memmem, strptime, timegm */
+
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "include/http.h"
+
+static const char *nextLine(const char *p, const char *end, struct strView *line);
+static struct strView trim(const char *p, const char *end);
+static const char *token(const char *p, const char *end, struct strView *tok);
+static bool hasToken(struct strView list, const char *tok);
+static bool zeroWeight(struct strView q);
+static const char *number(const char *p, const char *end, off_t *n);
+
+/*
+ * Parse the request at the start of `buff'.  Returns 1 when it is
+ * complete, 0 if more data is needed and -1 if it is malformed
+ */
+int
+parseRequest(const char *buff, size_t len, struct httpRequest *req)
+{
+	const char *p = buff, *end = buff + len, *q;
+	struct strView line;
+
+	req->nheaders = 0;
+
+	/* skip empty lines ahead of the request line (RFC 7230, 3.5) */
+	do {
+		if (!(p = nextLine(p, end, &line)))
+			return 0;
+	} while (line.len == 0);
+
+	/* request line: method SP path SP version */
+	q = token(line.ptr, line.ptr + line.len, &req->method);
+	q = token(q, line.ptr + line.len, &req->path);
+	token(q, line.ptr + line.len, &req->version);
+
+	if (!req->method.len || !req->path.len || !req->version.len)
+		return -1;
+
+	/* headers, up to the first empty line */
+	while (true) {
+		if (!(p = nextLine(p, end, &line)))
+			return 0;
+		if (line.len == 0)
+			break;
+
+		if (req->nheaders == MAX_HEADERS)
+			return -1;
+		if (!(q = memchr(line.ptr, ':', line.len)))
+			return -1;
+
+		req->headers[req->nheaders].name = trim(line.ptr, q);
+		req->headers[req->nheaders].value = trim(q + 1, line.ptr + line.len);
+		req->nheaders++;
+	}
+
+	req->len = p - buff;
+	return 1;
+}
+
+/*
+ * Drop an answered request from the front of the buffer
+ */
+void
+consumeRequest(struct reqBuff *in, const struct httpRequest *req)
+{
+	in->len -= req->len;
+	memmove(in->data, in->data + req->len, in->len);
+}
+
+const struct strView *
+findHeader(const struct httpRequest *req, const char *name)
+{
+	int i;
+
+	for (i = 0; i < req->nheaders; i++)
+		if (viewCaseEq(req->headers[i].name, name))
+			return &req->headers[i].value;
+
+	return NULL;
+}
+
+/*
+ * HTTP/1.1 connections persist unless told otherwise;
+ * HTTP/1.0 ones only when asked to
+ */
+bool
+requestKeepAlive(const struct httpRequest *req)
+{
+	const struct strView *conn = findHeader(req, "Connection");
+
+	if (conn && hasToken(*conn, "close"))
+		return false;
+	if (conn && hasToken(*conn, "keep-alive"))
+		return true;
+
+	return viewEq(req->version, "HTTP/1.1");
+}
+
+/*
+ * Content codings the client takes, from Accept-Encoding, as a
+ * bitmask of (1 << ENC_*).  Identity is always acceptable
+ */
+int
+acceptedEncodings(const struct httpRequest *req)
+{
+	const struct strView *accept = findHeader(req, "Accept-Encoding");
+	const char *p, *end, *comma, *semi, *q;
+	struct strView name;
+	int mask = 1 << ENC_IDENTITY;
+
+	if (!accept)
+		return mask;
+
+	for (p = accept->ptr, end = p + accept->len; p < end; p = comma + 1) {
+		if (!(comma = memchr(p, ',', end - p)))
+			comma = end;
+		if (!(semi = memchr(p, ';', comma - p)))
+			semi = comma;
+
+		/* a weight of zero means "not acceptable" */
+		if ((q = memmem(semi, comma - semi, "q=", 2)) &&
+		    zeroWeight(trim(q + 2, comma)))
+			continue;
+
+		name = trim(p, semi);
+		if (viewCaseEq(name, "gzip") || viewCaseEq(name, "x-gzip"))
+			mask |= 1 << ENC_GZIP;
+		else if (viewCaseEq(name, "br"))
+			mask |= 1 << ENC_BR;
+		else if (viewEq(name, "*"))
+			mask |= (1 << ENC_GZIP) | (1 << ENC_BR);
+	}
+
+	return mask;
+}
+
+/*
+ * Resolve a single-range `Range' header against a body of `size'
+ * bytes.  Returns 1 with the (inclusive) bounds set, -1 if the
+ * range cannot be satisfied, 0 if there is no range we handle:
+ * none, a malformed one, or several (the whole body will do)
+ */
+int
+requestRange(const struct httpRequest *req, off_t size, off_t *first,
+    off_t *last)
+{
+	const struct strView *range = findHeader(req, "Range");
+	const char *p, *end;
+	off_t n;
+
+	if (!range || range->len < 6 || strncasecmp(range->ptr, "bytes=", 6) != 0)
+		return 0;
+
+	p = range->ptr + 6;
+	end = range->ptr + range->len;
+	if (memchr(p, ',', end - p))
+		return 0;
+
+	if (p < end && *p == '-') {
+		/* the last n bytes */
+		if (!(p = number(p + 1, end, &n)) || p != end)
+			return 0;
+		if (n == 0 || size == 0)
+			return -1;
+		*first = n < size ? size - n : 0;
+		*last = size - 1;
+		return 1;
+	}
+
+	if (!(p = number(p, end, first)) || p == end || *p++ != '-')
+		return 0;
+	*last = size - 1;
+	if (p < end) {
+		if (!(p = number(p, end, &n)) || p != end || n < *first)
+			return 0;
+		if (n < *last)
+			*last = n;
+	}
+
+	return *first < size ? 1 : -1;
+}
+
+/*
+ * Does an If-None-Match / If-Range list of entity tags match
+ * `etag'?  The strong comparison never matches weak tags
+ */
+bool
+matchETag(struct strView list, const char *etag, bool strong)
+{
+	const char *p = list.ptr, *end = list.ptr + list.len, *comma;
+	struct strView tag;
+
+	if (viewEq(list, "*"))
+		return true;
+	if (strncmp(etag, "W/", 2) == 0) {
+		if (strong)
+			return false;
+		etag += 2;
+	}
+
+	while (p < end) {
+		if (!(comma = memchr(p, ',', end - p)))
+			comma = end;
+		tag = trim(p, comma);
+		p = comma + 1;
+
+		if (tag.len > 2 && strncmp(tag.ptr, "W/", 2) == 0) {
+			if (strong)
+				continue;
+			tag.ptr += 2;
+			tag.len -= 2;
+		}
+		if (viewEq(tag, etag))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Format `t' as an HTTP-date into a buffer of HTTP_DATE_SZ bytes
+ */
+void
+httpDate(char *buff, time_t t)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(buff, HTTP_DATE_SZ, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/*
+ * Only the preferred IMF-fixdate format is understood; anything
+ * else counts as no date at all
+ */
+bool
+parseHttpDate(struct strView v, time_t *t)
+{
+	char date[HTTP_DATE_SZ];
+	struct tm tm;
+	const char *end;
+
+	if (v.len >= sizeof(date))
+		return false;
+	memcpy(date, v.ptr, v.len);
+	date[v.len] = '\0';
+
+	memset(&tm, 0, sizeof(tm));
+	if (!(end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm)) || *end)
+		return false;
+
+	*t = timegm(&tm);
+	return true;
+}
+
+bool
+viewEq(struct strView v, const char *str)
+{
+	return strlen(str) == v.len && memcmp(v.ptr, str, v.len) == 0;
+}
+
+bool
+viewCaseEq(struct strView v, const char *str)
+{
+	return strlen(str) == v.len && strncasecmp(v.ptr, str, v.len) == 0;
+}
+
+/*
+ * Find the line starting at `p'; returns where the next one
+ * starts, or NULL if the line is not complete yet.  Both CRLF
+ * and bare LF terminators are accepted
+ */
+static const char *
+nextLine(const char *p, const char *end, struct strView *line)
+{
+	const char *nl;
+
+	if (!(nl = memchr(p, '\n', end - p)))
+		return NULL;
+
+	line->ptr = p;
+	line->len = nl - p;
+	if (line->len && nl[-1] == '\r')
+		line->len--;
+
+	return nl + 1;
+}
+
+static struct strView
+trim(const char *p, const char *end)
+{
+	struct strView v;
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+		end--;
+
+	v.ptr = p;
+	v.len = end - p;
+	return v;
+}
+
+/*
+ * Split off the next space-separated token
+ */
+static const char *
+token(const char *p, const char *end, struct strView *tok)
+{
+	while (p < end && *p == ' ')
+		p++;
+
+	tok->ptr = p;
+	while (p < end && *p != ' ')
+		p++;
+	tok->len = p - tok->ptr;
+
+	return p;
+}
+
+/*
+ * Does a comma-separated header value list `tok'?
+ */
+static bool
+hasToken(struct strView list, const char *tok)
+{
+	const char *p = list.ptr, *end = list.ptr + list.len, *comma;
+
+	while (p < end) {
+		if (!(comma = memchr(p, ',', end - p)))
+			comma = end;
+		if (viewCaseEq(trim(p, comma), tok))
+			return true;
+		p = comma + 1;
+	}
+
+	return false;
+}
+
+/*
+ * Is a qvalue ("0", "0.0", "0.000"...) zero?
+ */
+static bool
+zeroWeight(struct strView q)
+{
+	size_t i;
+
+	if (q.len == 0 || q.ptr[0] != '0')
+		return false;
+	for (i = 1; i < q.len; i++)
+		if (q.ptr[i] != '.' && q.ptr[i] != '0')
+			return false;
+
+	return true;
+}
+
+/*
+ * Parse a run of decimal digits; NULL if there are none, or too
+ * many of them
+ */
+static const char *
+number(const char *p, const char *end, off_t *n)
+{
+	const char *start = p;
+
+	for (*n = 0; p < end && *p >= '0' && *p <= '9'; p++) {
+		if (*n > (INT64_MAX - 9) / 10)
+			return NULL;
+		*n = *n * 10 + (*p - '0');
+	}
+
+	return p == start ? NULL : p;
+}
@@ -0,0 +1,18 @@
+#ifndef app_h
+#define app_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "http.h"
+
+#define APP_PREFIX "/app/"     /* where the programs are found, and run */
+#define APP_DIR "app"          /* their bytecodes, under pages/ */
+#define APP_EXT ".ulb"
+#define APP_BUDGET 1000000L    /* jumps and calls a run may take */
+
+bool  appInit(void);
+bool  appPath(struct strView path);
+char *appRun(struct strView path, int *status, size_t *len);
+
+#endif // app_h
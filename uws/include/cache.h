@@ -0,0 +1,52 @@
+#ifndef cache_h
+#define cache_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "http.h"
+
+#define CACHE_MAX_BYTES (64 << 20) /* whole cache, headers included */
+#define CACHE_MAX_FILE (256 << 10) /* larger files go out with sendfile */
+#define CACHE_BUCKETS 1024
+
+/*
+ * A cached body in one content coding, with its prebuilt header
+ * (all but the Connection bits and the blank line)
+ */
+struct variant {
+	char *head;
+	size_t headLen;
+	char *body;
+	size_t bodyLen;
+};
+
+/*
+ * A cached response.  The identity variant is always there; the
+ * compressed ones are added by the first request asking for them
+ * and, like it, never change afterwards
+ */
+struct cacheEntry {
+	char *path;
+	int status;
+	struct timespec mtime;  /* of the file, for the validators */
+	struct variant var[ENC_COUNT];
+	bool tried[ENC_COUNT];  /* was var[] built (or found not worth it)? */
+	unsigned refs;      /* responses still sending it */
+	bool cached;        /* still reachable from the table */
+	struct cacheEntry *hnext;
+	struct cacheEntry *prev;  /* LRU list, most recently used first */
+	struct cacheEntry *next;
+};
+
+bool cacheInit(size_t maxBytes);
+struct cacheEntry *cacheLookup(const char *path, int status, unsigned *gen);
+struct cacheEntry *cacheInsert(const char *path, int status, const char *head,
+    size_t headLen, int fd, size_t size, const struct timespec *mtime,
+    unsigned gen);
+int  cacheVariant(struct cacheEntry *e, int enc, struct variant *v);
+void cacheSetVariant(struct cacheEntry *e, int enc, struct variant *v);
+void cacheRelease(struct cacheEntry *e);
+
+#endif // cache_h
@@ -0,0 +1,11 @@
+#ifndef compress_h
+#define compress_h
+
+#include <stddef.h>
+
+#define GZIP_LEVEL 9
+#define BROTLI_QUALITY 9
+
+char *compressBody(int enc, const char *in, size_t len, size_t *outLen);
+
+#endif // compress_h
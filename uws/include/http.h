@@ -0,0 +1,66 @@
+#ifndef http_h
+#define http_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define REQ_BUFF_SZ 4096
+#define MAX_HEADERS 32
+#define HTTP_DATE_SZ 30 /* "Sun, 06 Nov 1994 08:49:37 GMT" */
+
+/* content codings, in increasing order of preference */
+enum {
+	ENC_IDENTITY,
+	ENC_GZIP,
+	ENC_BR,
+	ENC_COUNT
+};
+
+/*
+ * A string view: points into the buffer the request was
+ * parsed from; not NUL-terminated
+ */
+struct strView {
+	const char *ptr;
+	size_t len;
+};
+
+struct httpHeader {
+	struct strView name;
+	struct strView value;
+};
+
+struct httpRequest {
+	struct strView method;
+	struct strView path;
+	struct strView version;
+	struct httpHeader headers[MAX_HEADERS];
+	int nheaders;
+	size_t len;  /* bytes taken by the request, blank line included */
+};
+
+/*
+ * Per-connection read buffer; pipelined requests stay in it
+ * until the ones before them have been answered
+ */
+struct reqBuff {
+	char data[REQ_BUFF_SZ];
+	size_t len;
+};
+
+int  parseRequest(const char *buff, size_t len, struct httpRequest *req);
+void consumeRequest(struct reqBuff *in, const struct httpRequest *req);
+const struct strView *findHeader(const struct httpRequest *req, const char *name);
+bool requestKeepAlive(const struct httpRequest *req);
+int  acceptedEncodings(const struct httpRequest *req);
+int  requestRange(const struct httpRequest *req, off_t size, off_t *first,
+    off_t *last);
+bool matchETag(struct strView list, const char *etag, bool strong);
+void httpDate(char *buff, time_t t);
+bool parseHttpDate(struct strView v, time_t *t);
+bool viewEq(struct strView v, const char *str);
+bool viewCaseEq(struct strView v, const char *str);
+
+#endif // http_h
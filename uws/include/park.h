@@ -0,0 +1,25 @@
+#ifndef park_h
+#define park_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define PARK_EVENTS 256
+
+/*
+ * A connection's place in the park, kept along with the rest of
+ * its state by whoever parks it
+ */
+struct parking {
+	int fd;
+	void *data;         /* handed back when it is time to move on */
+	time_t deadline;
+	size_t pos;         /* in the deadline heap; 0 when not parked */
+	bool added;         /* is fd in the epoll set already? */
+};
+
+bool parkStart(void (*ready)(void *), void (*expired)(void *));
+bool parkWait(struct parking *p, bool out, int secs);
+
+#endif // park_h
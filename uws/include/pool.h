@@ -0,0 +1,12 @@
+#ifndef pool_h
+#define pool_h
+
+#include <stdbool.h>
+
+#define POOL_SZ 64          /* default number of worker threads */
+#define POOL_QUEUE_SZ 1024  /* connections waiting; a power of 2 */
+
+bool poolStart(int nthreads, void (*handler)(void *));
+bool poolSubmit(void *conn);
+
+#endif // pool_h
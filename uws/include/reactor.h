@@ -0,0 +1,11 @@
+#ifndef reactor_h
+#define reactor_h
+
+#define MAX_EVENTS 256
+
+struct deadlines;
+
+void runReactor(int *ssockets, int nsockets, int nthreads,
+    const struct deadlines *dl);
+
+#endif // reactor_h
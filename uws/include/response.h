@@ -0,0 +1,46 @@
+#ifndef response_h
+#define response_h
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define RESP_HEAD_SZ 512
+#define RESP_IOV 3
+
+struct cacheEntry;
+struct httpRequest;
+
+/*
+ * A response being sent: the in-memory parts in `iov' (the
+ * headers, plus the body when it comes from the cache) followed
+ * by the contents of `fd', if any.  The body length is only known
+ * (and sent) for regular files.  Nothing is to be sent back when
+ * iovCnt is 0
+ */
+struct response {
+	char   head[RESP_HEAD_SZ];  /* headers built for this response */
+	struct iovec iov[RESP_IOV];
+	int    iovPos;
+	int    iovCnt;
+	int    fd;
+	bool   regular;
+	off_t  bodyOff;
+	off_t  bodyLen;
+	bool   keepAlive;
+	int    status;
+	off_t  sent;                /* bytes out so far, headers included */
+	char   *body;               /* generated body, freed with the response */
+	struct cacheEntry *entry;   /* pinned until finishResponse() */
+};
+
+void prepareResponse(struct response *res, const struct httpRequest *req,
+    bool keepAlive);
+int  sendResponse(int sfd, struct response *res, char *chunk, size_t chunkSz);
+void finishResponse(struct response *res);
+size_t fileHeader(char *buff, size_t sz, const char *path, int status, int enc,
+    off_t length, const struct stat *st);
+bool fileCompressible(const char *path);
+
+#endif // response_h
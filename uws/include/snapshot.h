@@ -0,0 +1,29 @@
+#ifndef snapshot_h
+#define snapshot_h
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "cache.h"
+
+#define SNAP_MAX_BYTES (1L << 30) /* a bigger tree is served from disk */
+#define SNAP_BUCKET_KEYS 4        /* paths per bucket of the perfect hash */
+#define SNAP_MAX_SEED (1 << 20)   /* tries per bucket before growing the table */
+
+/*
+ * A file as packed in the snapshot, every pointer into the
+ * mapping: its path, and its responses in each coding worth having
+ * (head NULL where there is none)
+ */
+struct snapFile {
+	const char *path;
+	int status;
+	struct timespec mtime;
+	struct variant var[ENC_COUNT];
+};
+
+bool snapInit(size_t maxBytes);
+bool snapLookup(const char *path, struct snapFile *f);
+bool snapNotFound(struct snapFile *f);
+
+#endif // snapshot_h
@@ -0,0 +1,29 @@
+#ifndef stats_h
+#define stats_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#define STATS_PATH "/__stats"
+
+#define LOG_RING_SZ 4096   /* access log records per thread; a power of 2 */
+#define LOG_FLUSH_MS 100   /* how often the writer drains the rings */
+#define LOG_PATH_SZ 128    /* longer paths are logged truncated */
+#define LAT_BUCKETS 32     /* latency histogram: powers of 2, in us */
+
+struct httpRequest;
+
+void  statsInit(bool accessLog);
+bool  statsLogging(void);
+void  statsConnOpen(void);
+void  statsConnClose(void);
+void  statsRejected(void);
+void  statsRequest(const struct sockaddr_in *peer,
+    const struct httpRequest *req, int status, off_t sent,
+    const struct timespec *start);
+char *statsReport(size_t *len);
+
+#endif // stats_h
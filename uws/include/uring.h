@@ -0,0 +1,16 @@
+#ifndef uring_h
+#define uring_h
+
+#include <stdbool.h>
+
+#define UR_ENTRIES 1024     /* submission queue entries, per thread */
+#define UR_MAX_CONNS 256    /* connections served at once, per thread */
+#define UR_CHUNK_SZ 16384   /* file bytes read and sent per linked pair */
+#define UR_CHAIN_PAIRS 4    /* pairs per chain, all through the same chunk */
+
+struct deadlines;
+
+bool runUring(int *ssockets, int nsockets, int nthreads,
+    const struct deadlines *dl);
+
+#endif // uring_h
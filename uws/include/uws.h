@@ -2,19 +2,25 @@
 #define uws_h
 
 #define PORT_NUM "8080"
-#define IN_QUEUE_SZ 7
 
-#define PACKET_BUFF_SZ 1024
+#define BODY_BUFF_SZ 65536
 #define PAGES_DIR "pages"
 
-const char *found_header[] =
-{"HTTP/1.1 200 OK\r\n",
- "Content-Type: text/html\r\n",
- "\r\n"};
+#define KEEPALIVE_TIMEOUT 5 /* seconds an idle connection is kept open */
+#define KEEPALIVE_MAX 100   /* requests served over a single connection */
+#define READ_TIMEOUT 10     /* default seconds for a request to come in whole */
+#define WRITE_TIMEOUT 30    /* default seconds a peer may take nothing sent */
 
-const char *not_found_header[] = 
-{"HTTP/1.1 404 Not Found\r\n",
- "Content-Type: text/html\r\n",
- "\r\n"};
+/*
+ * How long a peer may keep a connection stuck, in seconds: from
+ * the first byte of a request to its end, and without taking any
+ * of a response (the wait between requests is KEEPALIVE_TIMEOUT)
+ */
+struct deadlines {
+	int read;
+	int write;
+};
+
+void pinCpu(int i);
 
 #endif // uws_h
@@ -0,0 +1,228 @@
+/*
+ * Where the thread pool leaves connections it cannot move forward
+ * right now: a peer not sending (the next request, or the rest of
+ * one) or not taking what is sent to it.  A single thread waits on
+ * them all with epoll, hands each one back to the pool as soon as
+ * its socket is ready, and drops those that stay stuck past their
+ * deadline.  So a slow or idle peer costs a pool thread only while
+ * there is actually something to do for it.
+ */
+
+#define _GNU_SOURCE /* CLOCK_MONOTONIC_COARSE */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include "include/park.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int epfd = -1;
+static struct parking **heap;  /* earliest deadline first, from 1 */
+static size_t heapLen;
+static size_t heapCap;
+static void (*onReady)(void *);
+static void (*onExpired)(void *);
+
+static void *parkLoop(void *data);
+static struct parking *expiring(time_t t);
+static bool push(struct parking *p);
+static void removeAt(size_t i);
+static void siftUp(size_t i);
+static void siftDown(size_t i);
+static void place(struct parking *p, size_t i);
+static time_t now(void);
+
+/*
+ * Start the park: ready connections go to `ready', from the park's
+ * thread, and stuck ones to `expired'
+ */
+bool
+parkStart(void (*ready)(void *), void (*expired)(void *))
+{
+	pthread_t thread;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		return false;
+
+	onReady = ready;
+	onExpired = expired;
+
+	if (pthread_create(&thread, NULL, parkLoop, NULL) != 0) {
+		close(epfd);
+		epfd = -1;
+		return false;
+	}
+	pthread_detach(thread);
+	return true;
+}
+
+/*
+ * Park a connection until its socket is readable (writable, if
+ * `out') or `secs' seconds have passed.  The caller must not touch
+ * it afterwards: it is not theirs anymore.  False if it could not
+ * be parked, and so is still theirs
+ */
+bool
+parkWait(struct parking *p, bool out, int secs)
+{
+	struct epoll_event ev;
+	bool ok;
+
+	/* one shot: only a single pool thread gets it back */
+	ev.events = (out ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+	ev.data.ptr = p;
+
+	/* armed under the lock, or it could expire before we are done */
+	pthread_mutex_lock(&lock);
+	p->deadline = now() + secs;
+	if ((ok = push(p))) {
+		ok = epoll_ctl(epfd, p->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, p->fd,
+		    &ev) == 0;
+		if (ok)
+			p->added = true;
+		else
+			removeAt(p->pos);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return ok;
+}
+
+static void *
+parkLoop(void *data)
+{
+	struct epoll_event events[PARK_EVENTS];
+	struct parking *p;
+	bool parked;
+	int i, n;
+
+	(void) data;
+
+	while (true) {
+		/* wake up at least once a second to drop the stuck ones */
+		if ((n = epoll_wait(epfd, events, PARK_EVENTS, 1000)) == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stdout, "epoll_wait error: %s\n", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			p = events[i].data.ptr;
+			pthread_mutex_lock(&lock);
+			if ((parked = p->pos != 0))
+				removeAt(p->pos);
+			pthread_mutex_unlock(&lock);
+			if (parked)
+				onReady(p->data);
+		}
+
+		while ((p = expiring(now())))
+			onExpired(p->data);
+	}
+
+	return NULL;
+}
+
+/*
+ * Take out the next connection whose deadline is past, if any
+ */
+static struct parking *
+expiring(time_t t)
+{
+	struct parking *p = NULL;
+
+	pthread_mutex_lock(&lock);
+	if (heapLen > 0 && heap[1]->deadline <= t) {
+		p = heap[1];
+		removeAt(1);
+		epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+		p->added = false;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return p;
+}
+
+static bool
+push(struct parking *p)
+{
+	struct parking **h;
+	size_t cap;
+
+	if (heapLen + 1 >= heapCap) {
+		cap = heapCap ? heapCap * 2 : 1024;
+		if (!(h = realloc(heap, cap * sizeof(struct parking *))))
+			return false;
+		heap = h;
+		heapCap = cap;
+	}
+
+	place(p, ++heapLen);
+	siftUp(heapLen);
+	return true;
+}
+
+static void
+removeAt(size_t i)
+{
+	struct parking *last = heap[heapLen--];
+
+	heap[i]->pos = 0;
+	if (i > heapLen)
+		return;
+
+	place(last, i);
+	siftUp(i);
+	siftDown(last->pos);
+}
+
+static void
+siftUp(size_t i)
+{
+	struct parking *p = heap[i];
+
+	for (; i > 1 && heap[i / 2]->deadline > p->deadline; i /= 2)
+		place(heap[i / 2], i);
+	place(p, i);
+}
+
+static void
+siftDown(size_t i)
+{
+	struct parking *p = heap[i];
+	size_t c;
+
+	while ((c = 2 * i) <= heapLen) {
+		if (c < heapLen && heap[c + 1]->deadline < heap[c]->deadline)
+			c++;
+		if (heap[c]->deadline >= p->deadline)
+			break;
+		place(heap[c], i);
+		i = c;
+	}
+	place(p, i);
+}
+
+static void
+place(struct parking *p, size_t i)
+{
+	heap[i] = p;
+	p->pos = i;
+}
+
+static time_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
@@ -0,0 +1,141 @@
+/*
+ * Microbenchmark: request parsing through readLine(), one read(2)
+ * per byte as the server used to do, versus the buffered parser.
+ * A writer thread feeds pipelined requests through a socketpair
+ * and the main thread parses them back
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "include/http.h"
+#include "util.h"
+
+#define NREQS 20000
+#define LINE_SZ 1024
+
+static const char request[] =
+	"GET /index.html HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n";
+
+static void *writer(void *data);
+static long readLineLoop(int fd);
+static long parserLoop(int fd);
+static void run(const char *name, long (*loop)(int));
+static double elapsed(struct timespec *start);
+
+int
+main(void)
+{
+	run("readLine", readLineLoop);
+	run("parseRequest", parserLoop);
+	return EXIT_SUCCESS;
+}
+
+static void
+run(const char *name, long (*loop)(int))
+{
+	struct timespec start;
+	pthread_t thread;
+	int sv[2];
+	long n;
+	double secs;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+		fatal("socketpair failed\n");
+
+	pthread_create(&thread, NULL, writer, &sv[1]);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	n = loop(sv[0]);
+	secs = elapsed(&start);
+
+	pthread_join(thread, NULL);
+	close(sv[0]);
+
+	printf("%-14s %8ld requests in %6.3fs: %10.0f req/s\n",
+	    name, n, secs, n / secs);
+}
+
+static void *
+writer(void *data)
+{
+	int fd = *(int *) data;
+	int i;
+
+	for (i = 0; i < NREQS; i++)
+		writeLine(fd, request, sizeof(request) - 1);
+
+	close(fd);
+	return NULL;
+}
+
+/*
+ * The old path: a calloc'ed request line, then a fresh line
+ * buffer per header, each filled one byte at a time
+ */
+static long
+readLineLoop(int fd)
+{
+	long n = 0;
+	char *buff;
+
+	while (true) {
+		if (!(buff = calloc(LINE_SZ, sizeof(char))))
+			fatal("calloc failed\n");
+		if (readLine(fd, buff, LINE_SZ) <= 0) {
+			free(buff);
+			return n;
+		}
+		while (true) {
+			char tmp[LINE_SZ] = {'\0'};
+			if (readLine(fd, tmp, LINE_SZ) <= 0 || strcmp(tmp, "\r\n") == 0)
+				break;
+		}
+		free(buff);
+		n++;
+	}
+}
+
+static long
+parserLoop(int fd)
+{
+	struct httpRequest req;
+	struct reqBuff in;
+	ssize_t nread;
+	long n = 0;
+	int status;
+
+	in.len = 0;
+	while (true) {
+		while ((status = parseRequest(in.data, in.len, &req)) == 1) {
+			consumeRequest(&in, &req);
+			n++;
+		}
+		if (status == -1)
+			fatal("parse error\n");
+		if ((nread = read(fd, in.data + in.len, sizeof(in.data) - in.len)) <= 0)
+			return n;
+		in.len += nread;
+	}
+}
+
+static double
+elapsed(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
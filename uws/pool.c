@@ -0,0 +1,139 @@
+/*
+ * A fixed pool of worker threads serving connections, new ones or
+ * ones ready to move on again.  The acceptors (and the park) hand
+ * connections over through a bounded lock-free
+ * MPMC queue (Dmitry Vyukov's, one sequence number per cell); the
+ * workers sleep on a semaphore counting the queued connections.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <errno.h>
+
+#include "include/pool.h"
+
+struct cell {
+	atomic_size_t seq;
+	void *conn;
+};
+
+static struct cell cells[POOL_QUEUE_SZ];
+/* keep the producer and consumer cursors on separate cache lines */
+static _Alignas(64) atomic_size_t enqPos;
+static _Alignas(64) atomic_size_t deqPos;
+static sem_t queued;
+static void (*serve)(void *);
+
+static void *poolThread(void *data);
+static bool dequeue(void **conn);
+
+bool
+poolStart(int nthreads, void (*handler)(void *))
+{
+	pthread_t thread;
+	size_t i;
+	int n;
+
+	for (i = 0; i < POOL_QUEUE_SZ; i++)
+		atomic_init(&cells[i].seq, i);
+	atomic_init(&enqPos, 0);
+	atomic_init(&deqPos, 0);
+
+	if (sem_init(&queued, 0, 0) == -1)
+		return false;
+
+	serve = handler;
+
+	for (n = 0; n < nthreads; n++)
+		if (pthread_create(&thread, NULL, poolThread, NULL) != 0)
+			return false;
+		else
+			pthread_detach(thread);
+
+	return true;
+}
+
+/*
+ * Queue a connection for the workers; false if the queue is full
+ */
+bool
+poolSubmit(void *conn)
+{
+	size_t pos = atomic_load_explicit(&enqPos, memory_order_relaxed);
+	struct cell *c;
+	intptr_t dif;
+
+	while (true) {
+		c = &cells[pos & (POOL_QUEUE_SZ - 1)];
+		dif = (intptr_t) atomic_load_explicit(&c->seq, memory_order_acquire) -
+		    (intptr_t) pos;
+
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&enqPos, &pos, pos + 1,
+			    memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (dif < 0)
+			return false; /* a lap ahead of the consumers: full */
+		else
+			pos = atomic_load_explicit(&enqPos, memory_order_relaxed);
+	}
+
+	c->conn = conn;
+	atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+	sem_post(&queued);
+	return true;
+}
+
+static bool
+dequeue(void **conn)
+{
+	size_t pos = atomic_load_explicit(&deqPos, memory_order_relaxed);
+	struct cell *c;
+	intptr_t dif;
+
+	while (true) {
+		c = &cells[pos & (POOL_QUEUE_SZ - 1)];
+		dif = (intptr_t) atomic_load_explicit(&c->seq, memory_order_acquire) -
+		    (intptr_t) (pos + 1);
+
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&deqPos, &pos, pos + 1,
+			    memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (dif < 0)
+			return false; /* empty */
+		else
+			pos = atomic_load_explicit(&deqPos, memory_order_relaxed);
+	}
+
+	*conn = c->conn;
+	atomic_store_explicit(&c->seq, pos + POOL_QUEUE_SZ, memory_order_release);
+	return true;
+}
+
+static void *
+poolThread(void *data)
+{
+	void *conn;
+
+	(void) data;
+
+	while (true) {
+		while (sem_wait(&queued) == -1 && errno == EINTR)
+			;
+		/*
+		 * The semaphore says a connection is ours, but with several
+		 * acceptors the cell at the head may still be being filled
+		 */
+		while (!dequeue(&conn))
+			sched_yield();
+		serve(conn);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,406 @@
+/*
+ * Reactor mode: a fixed set of threads, each running its own
+ * edge-triggered epoll loop over non-blocking sockets.  Every
+ * thread waits on a listening socket as well (EPOLLEXCLUSIVE,
+ * so a new connection wakes up only one of those sharing it) and
+ * keeps the connections it accepts for their whole lifetime, so no
+ * locking is needed around connection state.  With several
+ * SO_REUSEPORT listeners (-workers), each thread gets its own and
+ * is pinned to a CPU.
+ *
+ * A response the peer does not take stays with its connection
+ * until the socket has room again (EPOLLOUT), so a slow reader
+ * holds nothing but its own memory.  Connections sit on one of
+ * three lists, by what they wait for: the next request, the rest
+ * of one, or the peer to take more of a response.  Each list has
+ * a fixed timeout, so appending to the tail keeps it sorted by
+ * deadline and expiring is a look at the heads.
+ */
+
+#define _GNU_SOURCE /* accept4 */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "include/uws.h"
+#include "include/http.h"
+#include "include/response.h"
+#include "include/reactor.h"
+#include "include/stats.h"
+
+/* what a connection is waiting for, each with its own deadline */
+enum timer {
+	T_IDLE,        /* the next request */
+	T_READ,        /* the rest of the request */
+	T_WRITE,       /* the peer to take more of the response */
+	T_COUNT
+};
+
+enum connState {
+	CONN_READING,  /* waiting for a complete request header */
+	CONN_WRITING   /* sending the response */
+};
+
+struct conn {
+	int fd;
+	struct sockaddr_in peer;
+	enum connState state;
+	struct reqBuff in;
+	struct httpRequest req;
+	int nreq;           /* requests served so far */
+	struct response res;
+	struct timespec start;  /* of the response being sent */
+	enum timer timer;   /* the list it is on */
+	time_t since;       /* started waiting */
+	struct conn *prev;  /* its list, longest waiting first */
+	struct conn *next;
+};
+
+struct timerList {
+	struct conn *head;
+	struct conn *tail;
+	int timeout;
+};
+
+struct worker {
+	pthread_t thread;
+	int epfd;
+	int ssocket;
+	int cpu;            /* to pin to, or -1 */
+	struct timerList timers[T_COUNT];
+	char chunk[BODY_BUFF_SZ];
+};
+
+static void *workerLoop(void *data);
+static void acceptConns(struct worker *w);
+static void handleConn(struct worker *w, struct conn *c);
+static int  connRead(struct conn *c);
+static bool nextRequest(struct conn *c);
+static void startResponse(struct conn *c);
+static void touchConn(struct worker *w, struct conn *c, enum timer t);
+static void unlinkConn(struct worker *w, struct conn *c);
+static void expireConns(struct worker *w);
+static void closeConn(struct worker *w, struct conn *c);
+static time_t now(void);
+
+void
+runReactor(int *ssockets, int nsockets, int nthreads,
+    const struct deadlines *dl)
+{
+	struct epoll_event ev;
+	struct worker *workers;
+	int i;
+
+	if (nthreads < 1)
+		nthreads = 1;
+
+	for (i = 0; i < nsockets; i++)
+		if (fcntl(ssockets[i], F_SETFL, fcntl(ssockets[i], F_GETFL) | O_NONBLOCK) == -1) {
+			fprintf(stdout, "fcntl error: %s\n", strerror(errno));
+			return;
+		}
+
+	if (!(workers = calloc(nthreads, sizeof(struct worker))))
+		return;
+
+	for (i = 0; i < nthreads; i++) {
+		workers[i].ssocket = ssockets[i % nsockets];
+		workers[i].cpu = nsockets > 1 ? i : -1;
+		workers[i].timers[T_IDLE].timeout = KEEPALIVE_TIMEOUT;
+		workers[i].timers[T_READ].timeout = dl->read;
+		workers[i].timers[T_WRITE].timeout = dl->write;
+		if ((workers[i].epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+			fprintf(stdout, "epoll_create1 error: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		/* the listener stays level-triggered; data.ptr == NULL marks it */
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, workers[i].ssocket, &ev) == -1) {
+			fprintf(stdout, "epoll_ctl error: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		if (pthread_create(&workers[i].thread, NULL, workerLoop, &workers[i]) != 0) {
+			fprintf(stdout, "pthread_create error\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	free(workers);
+}
+
+static void *
+workerLoop(void *data)
+{
+	struct worker *w = data;
+	struct epoll_event events[MAX_EVENTS];
+	struct conn *c;
+	int i, n;
+
+	if (w->cpu != -1)
+		pinCpu(w->cpu);
+
+	while (true) {
+		/* wake up at least once a second to drop stuck connections */
+		if ((n = epoll_wait(w->epfd, events, MAX_EVENTS, 1000)) == -1) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stdout, "epoll_wait error: %s\n", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (!(c = events[i].data.ptr))
+				acceptConns(w);
+			else if (events[i].events & (EPOLLERR | EPOLLHUP))
+				closeConn(w, c);
+			else
+				handleConn(w, c);
+		}
+
+		expireConns(w);
+	}
+
+	return NULL;
+}
+
+static void
+acceptConns(struct worker *w)
+{
+	struct sockaddr_in peer;
+	struct epoll_event ev;
+	socklen_t len;
+	struct conn *c;
+	int sfd;
+
+	while (true) {
+		len = sizeof(peer);
+		sfd = accept4(w->ssocket, (struct sockaddr *) &peer, &len,
+		    SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (sfd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			/* EAGAIN: drained; anything else (EMFILE...): retry later */
+			return;
+		}
+
+		if (!(c = calloc(1, sizeof(struct conn)))) {
+			close(sfd);
+			continue;
+		}
+
+		c->fd = sfd;
+		c->peer = peer;
+		c->state = CONN_READING;
+		c->res.fd = -1;
+		statsConnOpen();
+		touchConn(w, c, T_IDLE);
+
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.ptr = c;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, sfd, &ev) == -1)
+			closeConn(w, c);
+	}
+}
+
+/*
+ * Drive a connection's state machine as far as the socket allows;
+ * with edge-triggered notifications we have to go until EAGAIN.
+ * Pipelined requests already sitting in the buffer are answered
+ * back to back without waiting for another notification
+ */
+static void
+handleConn(struct worker *w, struct conn *c)
+{
+	off_t sent;
+
+	while (true) {
+		switch (c->state) {
+		case CONN_READING:
+			switch (connRead(c)) {
+			case -1:
+				closeConn(w, c);
+				return;
+			case 0:
+				/* the read deadline runs from a request's first byte */
+				if (c->in.len > 0 && c->timer != T_READ)
+					touchConn(w, c, T_READ);
+				return;
+			}
+			startResponse(c);
+			if (c->res.iovCnt == 0) {
+				closeConn(w, c);
+				return;
+			}
+			c->state = CONN_WRITING;
+			/* FALLTHROUGH */
+		case CONN_WRITING:
+			sent = c->res.sent;
+			switch (sendResponse(c->fd, &c->res, w->chunk, sizeof(w->chunk))) {
+			case -1:
+				closeConn(w, c);
+				return;
+			case 0:
+				/* and the write deadline from the last progress */
+				if (c->res.sent != sent || c->timer != T_WRITE)
+					touchConn(w, c, T_WRITE);
+				return;
+			}
+			statsRequest(&c->peer, &c->req, c->res.status, c->res.sent,
+			    &c->start);
+			if (!nextRequest(c)) {
+				closeConn(w, c);
+				return;
+			}
+			touchConn(w, c, c->in.len > 0 ? T_READ : T_IDLE);
+			break;
+		}
+	}
+}
+
+/*
+ * Read whatever is available; returns 1 once a whole request is
+ * buffered (and parsed into c->req), 0 if we need to wait for more
+ * data and -1 if the connection should be dropped
+ */
+static int
+connRead(struct conn *c)
+{
+	ssize_t n;
+	int status;
+
+	while ((status = parseRequest(c->in.data, c->in.len, &c->req)) == 0) {
+		if (c->in.len == sizeof(c->in.data))
+			return -1; /* header too large */
+
+		n = read(c->fd, c->in.data + c->in.len, sizeof(c->in.data) - c->in.len);
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		if (n == 0)
+			return -1;
+
+		c->in.len += n;
+	}
+
+	return status;
+}
+
+static void
+startResponse(struct conn *c)
+{
+	c->nreq++;
+	clock_gettime(CLOCK_MONOTONIC, &c->start);
+	prepareResponse(&c->res, &c->req,
+	    requestKeepAlive(&c->req) && c->nreq < KEEPALIVE_MAX);
+}
+
+/*
+ * Done with a response: drop its request from the buffer and
+ * get ready for the next one, if the connection is to persist
+ */
+static bool
+nextRequest(struct conn *c)
+{
+	finishResponse(&c->res);
+
+	if (!c->res.keepAlive)
+		return false;
+
+	consumeRequest(&c->in, &c->req);
+	c->state = CONN_READING;
+	return true;
+}
+
+/*
+ * Start a connection waiting for `t': to the tail of that list,
+ * which thus stays sorted by deadline
+ */
+static void
+touchConn(struct worker *w, struct conn *c, enum timer t)
+{
+	struct timerList *l = &w->timers[t];
+
+	unlinkConn(w, c);
+
+	c->timer = t;
+	c->next = NULL;
+	c->prev = l->tail;
+	if (l->tail)
+		l->tail->next = c;
+	else
+		l->head = c;
+	l->tail = c;
+
+	c->since = now();
+}
+
+static void
+unlinkConn(struct worker *w, struct conn *c)
+{
+	struct timerList *l = &w->timers[c->timer];
+
+	if (c->prev)
+		c->prev->next = c->next;
+	else if (l->head == c)
+		l->head = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	else if (l->tail == c)
+		l->tail = c->prev;
+
+	c->prev = c->next = NULL;
+}
+
+static void
+expireConns(struct worker *w)
+{
+	struct timerList *l;
+	time_t t = now();
+
+	for (l = w->timers; l < w->timers + T_COUNT; l++)
+		while (l->head && t - l->head->since >= l->timeout)
+			closeConn(w, l->head);
+}
+
+static void
+closeConn(struct worker *w, struct conn *c)
+{
+	unlinkConn(w, c);
+
+	/* closing the socket also drops it from the epoll set */
+	close(c->fd);
+	statsConnClose();
+	finishResponse(&c->res);
+	free(c);
+}
+
+static time_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
@@ -0,0 +1,703 @@
+/*
+ * Building and sending responses; shared by the threaded and
+ * the reactor mode
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "include/uws.h"
+#include "include/http.h"
+#include "include/cache.h"
+#include "include/compress.h"
+#include "include/stats.h"
+#include "include/snapshot.h"
+#include "include/app.h"
+#include "include/response.h"
+
+#define str(s) #s
+#define xstr(s) str(s)
+
+#define ETAG_SZ 64
+
+/* what a file's ETag and Last-Modified are made of */
+struct validator {
+	off_t size;
+	struct timespec mtime;
+};
+
+struct mimeType {
+	const char *ext;
+	const char *type;
+	bool compress;  /* worth sending compressed? */
+};
+
+static const struct mimeType mime_types[] = {
+	{"html",  "text/html",              true},
+	{"htm",   "text/html",              true},
+	{"css",   "text/css",               true},
+	{"js",    "application/javascript", true},
+	{"mjs",   "application/javascript", true},
+	{"json",  "application/json",       true},
+	{"xml",   "application/xml",        true},
+	{"txt",   "text/plain",             true},
+	{"svg",   "image/svg+xml",          true},
+	{"wasm",  "application/wasm",       true},
+	{"png",   "image/png",              false},
+	{"jpg",   "image/jpeg",             false},
+	{"jpeg",  "image/jpeg",             false},
+	{"gif",   "image/gif",              false},
+	{"webp",  "image/webp",             false},
+	{"ico",   "image/x-icon",           false},
+	{"woff",  "font/woff",              false},
+	{"woff2", "font/woff2",             false},
+	{"pdf",   "application/pdf",        false},
+};
+
+static const struct mimeType default_type =
+	{"", "application/octet-stream", false};
+
+static const struct mimeType stats_type =
+	{"json", "application/json", false};
+
+static const struct mimeType app_type =
+	{"txt", "text/plain", false};
+
+static const char *encoding_names[] = {
+	[ENC_IDENTITY] = NULL,
+	[ENC_GZIP]     = "gzip",
+	[ENC_BR]       = "br",
+};
+
+static const char keep_alive_tail[] =
+	"Connection: keep-alive\r\n"
+	"Keep-Alive: timeout=" xstr(KEEPALIVE_TIMEOUT) "\r\n"
+	"\r\n";
+
+static const char close_tail[] =
+	"Connection: close\r\n"
+	"\r\n";
+
+static void serveStats(struct response *res, bool keepAlive);
+static bool serveApp(struct response *res, const struct httpRequest *req,
+    bool keepAlive);
+static void serveGenerated(struct response *res, int status,
+    const struct mimeType *mt, size_t len, bool keepAlive);
+static void serveEntry(struct response *res, const struct httpRequest *req,
+    struct cacheEntry *e, const struct mimeType *mt, int accepted,
+    bool keepAlive);
+static void serveSnapshot(struct response *res, const struct httpRequest *req,
+    const struct snapFile *f, bool keepAlive);
+static void serveVariant(struct response *res, const struct httpRequest *req,
+    int status, struct variant v, int enc, const struct validator *val,
+    const struct mimeType *mt, bool keepAlive);
+static bool encodedVariant(struct cacheEntry *e, int enc,
+    const struct mimeType *mt, struct variant *v);
+static bool notModified(const struct httpRequest *req,
+    const struct validator *val);
+static int  rangeStatus(const struct httpRequest *req,
+    const struct validator *val, off_t *first, off_t *last);
+static void bodiless(struct response *res, int status,
+    const struct mimeType *mt, int enc, const struct validator *val,
+    bool keepAlive);
+static void setTail(struct response *res, int i, bool keepAlive);
+static size_t buildHeader(char *buff, size_t sz, int status,
+    const struct mimeType *mt, int enc, off_t length,
+    const struct validator *val, off_t first);
+static void formatETag(char *buff, const struct validator *val, bool weak);
+static const char *statusLine(int status);
+static int  acceptable(const struct httpRequest *req,
+    const struct mimeType *mt);
+static const struct mimeType *mimeType(const char *path);
+
+/*
+ * Resolve a request into a response: headers and body from the
+ * snapshot or the cache, or freshly built headers and the file
+ * making up the body
+ */
+void
+prepareResponse(struct response *res, const struct httpRequest *req,
+    bool keepAlive)
+{
+	const struct mimeType *mt;
+	char path[PATH_MAX];
+	char *file = path + 1;
+	struct cacheEntry *e;
+	struct snapFile sf;
+	struct validator val;
+	struct stat st;
+	off_t first, last;
+	unsigned gen;
+	int status = 200, accepted;
+	bool app;
+
+	memset(res, 0, sizeof(*res));
+	res->fd = -1;
+
+	if (!viewEq(req->method, "GET") || req->path.len >= sizeof(path))
+		return;
+
+	if (viewEq(req->path, STATS_PATH)) {
+		serveStats(res, keepAlive);
+		return;
+	}
+
+	/* programs are run, never sent: the 404 page if there is no such one */
+	if ((app = appPath(req->path)) && serveApp(res, req, keepAlive))
+		return;
+
+	/* open(2) wants the path NUL-terminated */
+	if (req->path.len == 1)
+		strcpy(path, "/index.html");
+	else {
+		memcpy(path, req->path.ptr, req->path.len);
+		path[req->path.len] = '\0';
+	}
+
+	/* with a snapshot, what it does not have does not exist */
+	if ((!app && snapLookup(file, &sf)) || snapNotFound(&sf)) {
+		serveSnapshot(res, req, &sf, keepAlive);
+		return;
+	}
+
+	mt = mimeType(file);
+	accepted = acceptable(req, mt);
+
+	if (!app && (e = cacheLookup(file, status, &gen))) {
+		serveEntry(res, req, e, mt, accepted, keepAlive);
+		return;
+	}
+
+	if (app || (res->fd = open(file, O_RDONLY)) == -1) {
+		file = "errors/404.html";
+		status = 404;
+		mt = mimeType(file);
+		accepted = acceptable(req, mt);
+
+		if ((e = cacheLookup(file, status, &gen))) {
+			serveEntry(res, req, e, mt, accepted, keepAlive);
+			return;
+		}
+		if ((res->fd = open(file, O_RDONLY)) == -1)
+			return;
+	}
+
+	if (fstat(res->fd, &st) == -1) {
+		close(res->fd);
+		res->fd = -1;
+		return;
+	}
+
+	/* only regular files have a size we can announce up front */
+	res->regular = S_ISREG(st.st_mode);
+	val.size = st.st_size;
+	val.mtime = st.st_mtim;
+
+	/* a 304 needs nothing from the body: settle it before reading any */
+	if (status == 200 && res->regular && notModified(req, &val)) {
+		close(res->fd);
+		res->fd = -1;
+		bodiless(res, 304, mt, ENC_IDENTITY, &val, keepAlive);
+		return;
+	}
+
+	res->bodyLen = res->regular ? st.st_size : -1;
+	res->iov[0].iov_base = res->head;
+	res->iov[0].iov_len = buildHeader(res->head, sizeof(res->head), status,
+	    mt, ENC_IDENTITY, res->bodyLen,
+	    status == 200 && res->regular ? &val : NULL, 0);
+
+	if (res->regular && (e = cacheInsert(file, status, res->head,
+	    res->iov[0].iov_len, res->fd, st.st_size, &st.st_mtim, gen))) {
+		close(res->fd);
+		res->fd = -1;
+		serveEntry(res, req, e, mt, accepted, keepAlive);
+		return;
+	}
+
+	if (status == 200 && res->regular) {
+		switch (rangeStatus(req, &val, &first, &last)) {
+		case 206:
+			/* sendfile(2) takes it from there */
+			status = 206;
+			res->bodyOff = first;
+			res->bodyLen = last + 1;
+			res->iov[0].iov_len = buildHeader(res->head, sizeof(res->head),
+			    206, mt, ENC_IDENTITY, last - first + 1, &val, first);
+			break;
+		case 416:
+			close(res->fd);
+			res->fd = -1;
+			bodiless(res, 416, mt, ENC_IDENTITY, &val, keepAlive);
+			return;
+		}
+	}
+
+	/* without a length, only closing the connection ends the body */
+	res->status = status;
+	setTail(res, 1, keepAlive && res->regular);
+	res->iovCnt = 2;
+}
+
+/*
+ * The counters, gathered at the time of asking
+ */
+static void
+serveStats(struct response *res, bool keepAlive)
+{
+	size_t len;
+
+	if (!(res->body = statsReport(&len)))
+		return;
+
+	serveGenerated(res, 200, &stats_type, len, keepAlive);
+}
+
+/*
+ * The output of a program, run for this request.  False if there
+ * is no such program
+ */
+static bool
+serveApp(struct response *res, const struct httpRequest *req, bool keepAlive)
+{
+	size_t len = 0;
+	int status;
+
+	res->body = appRun(req->path, &status, &len);
+	if (status == 404)
+		return false;
+
+	serveGenerated(res, status, &app_type, res->body ? len : 0, keepAlive);
+	return true;
+}
+
+/*
+ * A body made for this response only, already in res->body
+ */
+static void
+serveGenerated(struct response *res, int status, const struct mimeType *mt,
+    size_t len, bool keepAlive)
+{
+	res->status = status;
+	res->iov[0].iov_base = res->head;
+	res->iov[0].iov_len = buildHeader(res->head, sizeof(res->head), status,
+	    mt, ENC_IDENTITY, len, NULL, 0);
+	res->iov[0].iov_len += snprintf(res->head + res->iov[0].iov_len,
+	    sizeof(res->head) - res->iov[0].iov_len, "Cache-Control: no-store\r\n");
+	setTail(res, 1, keepAlive);
+	res->iov[2].iov_base = res->body;
+	res->iov[2].iov_len = len;
+	res->iovCnt = 3;
+}
+
+/*
+ * A cache hit: header, Connection bits and body in one writev(2),
+ * using the best coding the client takes that we have (or can make)
+ */
+static void
+serveEntry(struct response *res, const struct httpRequest *req,
+    struct cacheEntry *e, const struct mimeType *mt, int accepted,
+    bool keepAlive)
+{
+	struct variant v = e->var[ENC_IDENTITY];
+	struct validator val = {v.bodyLen, e->mtime};
+	int enc;
+
+	for (enc = ENC_COUNT - 1; enc > ENC_IDENTITY; enc--)
+		if ((accepted & (1 << enc)) && encodedVariant(e, enc, mt, &v))
+			break;
+
+	res->entry = e;
+	serveVariant(res, req, e->status, v, enc, &val, mt, keepAlive);
+}
+
+/*
+ * A snapshot hit: the same, with every variant made in advance
+ */
+static void
+serveSnapshot(struct response *res, const struct httpRequest *req,
+    const struct snapFile *f, bool keepAlive)
+{
+	const struct mimeType *mt = mimeType(f->path);
+	struct validator val = {f->var[ENC_IDENTITY].bodyLen, f->mtime};
+	int enc, accepted = acceptable(req, mt);
+
+	for (enc = ENC_COUNT - 1; enc > ENC_IDENTITY; enc--)
+		if ((accepted & (1 << enc)) && f->var[enc].head)
+			break;
+
+	serveVariant(res, req, f->status, f->var[enc], enc, &val, mt, keepAlive);
+}
+
+/*
+ * Answer from a body in memory and its prebuilt header, unless the
+ * request is conditional or asks for a range
+ */
+static void
+serveVariant(struct response *res, const struct httpRequest *req,
+    int status, struct variant v, int enc, const struct validator *val,
+    const struct mimeType *mt, bool keepAlive)
+{
+	off_t first, last;
+
+	if (status == 200 && notModified(req, val)) {
+		bodiless(res, 304, mt, enc, val, keepAlive);
+		return;
+	}
+	if (status == 200 && enc == ENC_IDENTITY)
+		status = rangeStatus(req, val, &first, &last);
+
+	switch (status) {
+	case 206:
+		res->iov[0].iov_base = res->head;
+		res->iov[0].iov_len = buildHeader(res->head, sizeof(res->head), 206,
+		    mt, enc, last - first + 1, val, first);
+		v.body += first;
+		v.bodyLen = last - first + 1;
+		break;
+	case 416:
+		bodiless(res, 416, mt, enc, val, keepAlive);
+		return;
+	default:
+		res->iov[0].iov_base = v.head;
+		res->iov[0].iov_len = v.headLen;
+	}
+
+	res->status = status;
+	setTail(res, 1, keepAlive);
+	res->iov[2].iov_base = v.body;
+	res->iov[2].iov_len = v.bodyLen;
+	res->iovCnt = 3;
+}
+
+/*
+ * Fetch the `enc' variant of an entry, compressing it first if
+ * we are the first to ask for it
+ */
+static bool
+encodedVariant(struct cacheEntry *e, int enc, const struct mimeType *mt,
+    struct variant *v)
+{
+	struct validator val = {e->var[ENC_IDENTITY].bodyLen, e->mtime};
+	struct variant nv = {0};
+	int status;
+
+	if ((status = cacheVariant(e, enc, v)) != 0)
+		return status == 1;
+
+	nv.body = compressBody(enc, e->var[ENC_IDENTITY].body,
+	    e->var[ENC_IDENTITY].bodyLen, &nv.bodyLen);
+
+	if (nv.body && (nv.head = malloc(RESP_HEAD_SZ)))
+		nv.headLen = buildHeader(nv.head, RESP_HEAD_SZ, e->status, mt, enc,
+		    nv.bodyLen, e->status == 200 ? &val : NULL, 0);
+	else {
+		free(nv.body);
+		nv.body = NULL;
+	}
+
+	cacheSetVariant(e, enc, &nv);
+	return cacheVariant(e, enc, v) == 1;
+}
+
+/*
+ * If-None-Match, or failing that If-Modified-Since: does the
+ * client have the current version already?
+ */
+static bool
+notModified(const struct httpRequest *req, const struct validator *val)
+{
+	const struct strView *h;
+	char etag[ETAG_SZ];
+	time_t since;
+
+	if ((h = findHeader(req, "If-None-Match"))) {
+		formatETag(etag, val, false);
+		return matchETag(*h, etag, false);
+	}
+	if ((h = findHeader(req, "If-Modified-Since")) && parseHttpDate(*h, &since))
+		return val->mtime.tv_sec <= since;
+
+	return false;
+}
+
+/*
+ * 206 with the bounds of the range asked for, 416 if it is out
+ * of the body, or 200 if the whole body is wanted: no Range, or
+ * an If-Range the file no longer matches
+ */
+static int
+rangeStatus(const struct httpRequest *req, const struct validator *val,
+    off_t *first, off_t *last)
+{
+	const struct strView *h;
+	char etag[ETAG_SZ];
+	time_t date;
+	int r;
+
+	if ((r = requestRange(req, val->size, first, last)) == 0)
+		return 200;
+
+	if ((h = findHeader(req, "If-Range"))) {
+		formatETag(etag, val, false);
+		if (h->len && h->ptr[0] == '"' ? !matchETag(*h, etag, true) :
+		    !parseHttpDate(*h, &date) || date != val->mtime.tv_sec)
+			return 200;
+	}
+
+	return r == 1 ? 206 : 416;
+}
+
+/*
+ * The responses that are all header: 304 and 416
+ */
+static void
+bodiless(struct response *res, int status, const struct mimeType *mt, int enc,
+    const struct validator *val, bool keepAlive)
+{
+	res->status = status;
+	res->iov[0].iov_base = res->head;
+	res->iov[0].iov_len = buildHeader(res->head, sizeof(res->head), status,
+	    mt, enc, status == 304 ? -1 : 0, val, 0);
+	setTail(res, 1, keepAlive);
+	res->iovCnt = 2;
+}
+
+static void
+setTail(struct response *res, int i, bool keepAlive)
+{
+	res->keepAlive = keepAlive;
+	res->iov[i].iov_base = (void *) (keepAlive ? keep_alive_tail : close_tail);
+	res->iov[i].iov_len = keepAlive ? sizeof(keep_alive_tail) - 1 :
+	    sizeof(close_tail) - 1;
+}
+
+/*
+ * Push as much of the response as the socket takes; returns 0
+ * if it would block, 1 when done and -1 on error.  Regular files
+ * go out with sendfile(2), straight from the page cache; anything
+ * else is copied through `chunk'
+ */
+int
+sendResponse(int sfd, struct response *res, char *chunk, size_t chunkSz)
+{
+	struct iovec *iov;
+	ssize_t n, nread;
+
+	while (res->iovPos < res->iovCnt) {
+		iov = res->iov + res->iovPos;
+		if ((n = writev(sfd, iov, res->iovCnt - res->iovPos)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		res->sent += n;
+
+		/* skip what went out, possibly stopping mid-iovec */
+		for (; res->iovPos < res->iovCnt && (size_t) n >= iov->iov_len; iov++) {
+			n -= iov->iov_len;
+			res->iovPos++;
+		}
+		if (res->iovPos < res->iovCnt) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+
+	if (res->fd == -1)
+		return 1;
+
+	while (res->regular) {
+		if (res->bodyOff >= res->bodyLen)
+			return 1;
+		n = sendfile(sfd, res->fd, &res->bodyOff, res->bodyLen - res->bodyOff);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		if (n == 0) /* file shrank under us */
+			return -1;
+		res->sent += n;
+	}
+
+	while (true) {
+		/* pread at our own offset, so a short write loses nothing */
+		if ((nread = pread(res->fd, chunk, chunkSz, res->bodyOff)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (nread == 0)
+			return 1;
+
+		if ((n = write(sfd, chunk, nread)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		res->bodyOff += n;
+		res->sent += n;
+	}
+}
+
+/*
+ * Let go of whatever the response holds
+ */
+void
+finishResponse(struct response *res)
+{
+	if (res->fd != -1)
+		close(res->fd);
+	if (res->entry)
+		cacheRelease(res->entry);
+	free(res->body);
+	res->fd = -1;
+	res->entry = NULL;
+	res->body = NULL;
+}
+
+/*
+ * The header of a whole file sent as is (or in `enc'), validators
+ * and all if `st' is given; for what is built ahead of time
+ */
+size_t
+fileHeader(char *buff, size_t sz, const char *path, int status, int enc,
+    off_t length, const struct stat *st)
+{
+	struct validator val;
+
+	if (st) {
+		val.size = st->st_size;
+		val.mtime = st->st_mtim;
+	}
+	return buildHeader(buff, sz, status, mimeType(path), enc, length,
+	    st ? &val : NULL, 0);
+}
+
+bool
+fileCompressible(const char *path)
+{
+	return mimeType(path)->compress;
+}
+
+/*
+ * Everything but the Connection bits.  `val' adds the validators,
+ * and `first' is where a 206 body starts in the file
+ */
+static size_t
+buildHeader(char *buff, size_t sz, int status, const struct mimeType *mt,
+    int enc, off_t length, const struct validator *val, off_t first)
+{
+	char etag[ETAG_SZ], date[HTTP_DATE_SZ];
+	size_t len;
+
+	len = snprintf(buff, sz, "%s", statusLine(status));
+
+	/* 304 and 416 carry no body to describe */
+	if (status != 304 && status != 416) {
+		len += snprintf(buff + len, sz - len, "Content-Type: %s\r\n", mt->type);
+		if (enc != ENC_IDENTITY)
+			len += snprintf(buff + len, sz - len, "Content-Encoding: %s\r\n",
+			    encoding_names[enc]);
+	}
+	/* caches must not hand a compressed body to just anybody */
+	if (mt->compress)
+		len += snprintf(buff + len, sz - len, "Vary: Accept-Encoding\r\n");
+
+	if (val) {
+		/* a compressed body is only the same file "weakly" */
+		formatETag(etag, val, enc != ENC_IDENTITY);
+		httpDate(date, val->mtime.tv_sec);
+		len += snprintf(buff + len, sz - len, "ETag: %s\r\n"
+		    "Last-Modified: %s\r\n", etag, date);
+		if (enc == ENC_IDENTITY && status != 304)
+			len += snprintf(buff + len, sz - len, "Accept-Ranges: bytes\r\n");
+	}
+
+	if (status == 206)
+		len += snprintf(buff + len, sz - len,
+		    "Content-Range: bytes %lld-%lld/%lld\r\n", (long long) first,
+		    (long long) (first + length - 1), (long long) val->size);
+	else if (status == 416)
+		len += snprintf(buff + len, sz - len, "Content-Range: bytes */%lld\r\n",
+		    (long long) val->size);
+
+	if (length >= 0)
+		len += snprintf(buff + len, sz - len, "Content-Length: %lld\r\n",
+		    (long long) length);
+
+	return len;
+}
+
+/*
+ * Size and modification time, down to the nanosecond, tell
+ * versions of a file apart well enough
+ */
+static void
+formatETag(char *buff, const struct validator *val, bool weak)
+{
+	snprintf(buff, ETAG_SZ, "%s\"%llx-%llx\"", weak ? "W/" : "",
+	    (long long) val->size,
+	    (long long) val->mtime.tv_sec * 1000000000LL + val->mtime.tv_nsec);
+}
+
+static const char *
+statusLine(int status)
+{
+	switch (status) {
+	case 200:
+		return "HTTP/1.1 200 OK\r\n";
+	case 206:
+		return "HTTP/1.1 206 Partial Content\r\n";
+	case 304:
+		return "HTTP/1.1 304 Not Modified\r\n";
+	case 416:
+		return "HTTP/1.1 416 Range Not Satisfiable\r\n";
+	case 500:
+		return "HTTP/1.1 500 Internal Server Error\r\n";
+	default:
+		return "HTTP/1.1 404 Not Found\r\n";
+	}
+}
+
+/*
+ * Codings we may answer in; ranges are only served from the
+ * identity body
+ */
+static int
+acceptable(const struct httpRequest *req, const struct mimeType *mt)
+{
+	if (!mt->compress || findHeader(req, "Range"))
+		return 1 << ENC_IDENTITY;
+
+	return acceptedEncodings(req);
+}
+
+/*
+ * Look a file's type up by its extension
+ */
+static const struct mimeType *
+mimeType(const char *path)
+{
+	const char *dot = strrchr(path, '.');
+	size_t i;
+
+	if (!dot || strchr(dot, '/'))
+		return &default_type;
+
+	for (i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i++)
+		if (strcasecmp(dot + 1, mime_types[i].ext) == 0)
+			return &mime_types[i];
+
+	return &default_type;
+}
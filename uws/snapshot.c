@@ -0,0 +1,583 @@
+/*
+ * A read-only snapshot of the document root, for sites that do
+ * not change while being served: every file is packed at startup,
+ * with its prebuilt response headers and compressed variants, into
+ * a single mapping that then never changes.  A lookup is a perfect
+ * hash of the path (hash and displace: a bucket of a few paths,
+ * then the displacement that bucket got to land all of them in
+ * free slots) and one compare, so a hit takes no open(2), no path
+ * resolution and no lock, and goes out with one writev(2).
+ *
+ * The mapping is laid out as a header, the displacements, the
+ * slots (plus one for the 404 page) and the data they point into,
+ * all as offsets, so it does not care where it is mapped.
+ */
+
+#define _GNU_SOURCE /* MAP_ANONYMOUS */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "include/http.h"
+#include "include/compress.h"
+#include "include/response.h"
+#include "include/snapshot.h"
+
+#define SNAP_MAGIC "uwssnap1"
+#define NOT_FOUND_PAGE "errors/404.html"
+
+struct snapHeader {
+	char magic[8];
+	uint32_t nfiles;
+	uint32_t nbuckets;
+	uint32_t nslots;
+	uint32_t pad;
+	uint64_t size;
+};
+
+/* a body in one coding and its header; headLen 0 if there is none */
+struct snapPart {
+	uint64_t headOff;
+	uint64_t headLen;
+	uint64_t bodyOff;
+	uint64_t bodyLen;
+};
+
+struct snapEntry {
+	uint64_t pathOff;
+	uint32_t pathLen;  /* 0 for an empty slot */
+	int32_t status;
+	int64_t mtimeSec;
+	int64_t mtimeNsec;
+	struct snapPart part[ENC_COUNT];
+};
+
+/* a file on its way into the snapshot; offsets are into `blob' */
+struct record {
+	char *path;
+	size_t pathLen;
+	uint64_t pathOff;
+	uint64_t hash;
+	uint32_t slot;
+	int status;
+	struct timespec mtime;
+	struct snapPart part[ENC_COUNT];
+};
+
+/* the data part, built on the heap before it is mapped */
+struct blob {
+	char *data;
+	size_t len;
+	size_t cap;
+	size_t max;
+};
+
+struct bucket {
+	uint32_t id;
+	uint32_t keys;
+};
+
+static const char *base;
+static const struct snapHeader *header;
+static const uint32_t *disp;
+static const struct snapEntry *slots;
+
+static bool collect(const char *dir, struct record **recs, size_t *n);
+static bool packFile(struct blob *b, struct record *r, struct record *nf);
+static bool placeKeys(struct record *recs, size_t n, uint32_t *d,
+    uint32_t nbuckets, uint32_t nslots);
+static int  byKeys(const void *a, const void *b);
+static bool mapSnapshot(struct blob *b, struct record *recs, size_t n,
+    const struct record *nf, uint32_t nbuckets, uint32_t nslots,
+    const uint32_t *d);
+static void fillEntry(struct snapEntry *e, const struct record *r,
+    uint64_t dataOff);
+static void fillFile(const struct snapEntry *e, struct snapFile *f);
+static uint64_t hashPath(const char *path, size_t len);
+static uint32_t slotOf(uint64_t h, uint32_t seed, uint32_t nslots);
+static bool reserve(struct blob *b, size_t len);
+static bool append(struct blob *b, const void *data, size_t len,
+    uint64_t *off);
+
+/*
+ * Pack the current directory, the document root; false if it
+ * could not be done (or would take more than `maxBytes'), in which
+ * case files are served from disk as usual
+ */
+bool
+snapInit(size_t maxBytes)
+{
+	struct blob b = {NULL, 0, 0, maxBytes};
+	struct record *recs = NULL, nf = {0};
+	uint32_t *d = NULL, nbuckets, nslots;
+	bool ok = false;
+	size_t n = 0, i;
+
+	if (!collect("", &recs, &n) || n >= UINT32_MAX / 4)
+		goto out;
+
+	for (i = 0; i < n; i++)
+		if (!packFile(&b, &recs[i], &nf)) {
+			fprintf(stdout, "cannot pack %s: %s\n", recs[i].path,
+			    errno ? strerror(errno) : "snapshot too large");
+			goto out;
+		}
+
+	/* a little slack keeps the search for displacements short */
+	nbuckets = n / SNAP_BUCKET_KEYS + 1;
+	nslots = n + n / 4 + 1;
+	if (!(d = calloc(nbuckets, sizeof(uint32_t))))
+		goto out;
+	while (!placeKeys(recs, n, d, nbuckets, nslots))
+		if (nslots > UINT32_MAX / 2)
+			goto out;
+		else
+			nslots *= 2;
+
+	ok = mapSnapshot(&b, recs, n, nf.pathLen ? &nf : NULL, nbuckets, nslots, d);
+
+out:
+	for (i = 0; i < n; i++)
+		free(recs[i].path);
+	free(recs);
+	free(d);
+	free(b.data);
+	return ok;
+}
+
+/*
+ * The 200 response for `path', relative to the document root
+ */
+bool
+snapLookup(const char *path, struct snapFile *f)
+{
+	const struct snapEntry *e;
+	size_t len;
+	uint64_t h;
+
+	if (!base)
+		return false;
+
+	len = strlen(path);
+	h = hashPath(path, len);
+	e = &slots[slotOf(h, disp[(h >> 32) % header->nbuckets], header->nslots)];
+
+	/* anything not in the tree lands somewhere too */
+	if (e->pathLen != len || memcmp(base + e->pathOff, path, len) != 0)
+		return false;
+
+	fillFile(e, f);
+	return true;
+}
+
+/*
+ * The 404 response, if the tree has a page for it
+ */
+bool
+snapNotFound(struct snapFile *f)
+{
+	const struct snapEntry *e;
+
+	if (!base)
+		return false;
+
+	e = &slots[header->nslots];
+	if (e->pathLen == 0)
+		return false;
+
+	fillFile(e, f);
+	return true;
+}
+
+/*
+ * Every regular file under `dir' ("" for the root, "sub/dir/"
+ * otherwise), symbolic links to them included
+ */
+static bool
+collect(const char *dir, struct record **recs, size_t *n)
+{
+	char path[PATH_MAX];
+	struct record *r;
+	struct dirent *de;
+	struct stat st;
+	bool ok = true;
+	DIR *dp;
+
+	if (!(dp = opendir(*dir ? dir : "."))) {
+		fprintf(stdout, "opendir error: %s\n", strerror(errno));
+		return false;
+	}
+
+	while (ok && (de = readdir(dp))) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (snprintf(path, sizeof(path), "%s%s", dir, de->d_name) >=
+		    (int) sizeof(path) - 1 || lstat(path, &st) == -1)
+			continue;
+
+		/* linked directories are left out: they could loop */
+		if (S_ISDIR(st.st_mode)) {
+			strcat(path, "/");
+			ok = collect(path, recs, n);
+			continue;
+		}
+		if (S_ISLNK(st.st_mode) && stat(path, &st) == -1)
+			continue;
+		if (!S_ISREG(st.st_mode))
+			continue;
+
+		if (!(r = realloc(*recs, (*n + 1) * sizeof(struct record))) ||
+		    !(r[*n].path = strdup(path))) {
+			if (r)
+				*recs = r;
+			ok = false;
+			break;
+		}
+		*recs = r;
+		r += (*n)++;
+		r->pathLen = strlen(path);
+		r->mtime = st.st_mtim;
+	}
+
+	closedir(dp);
+	return ok;
+}
+
+/*
+ * Append a file's path and its responses to the blob: the file
+ * read straight into place, then the codings that make it smaller.
+ * The 404 page also gets its 404 response, in `nf', sharing bodies
+ * with its 200 one
+ */
+static bool
+packFile(struct blob *b, struct record *r, struct record *nf)
+{
+	char head[RESP_HEAD_SZ], *body;
+	struct snapPart *p;
+	struct stat st;
+	size_t len;
+	ssize_t n;
+	off_t off;
+	int fd, enc;
+
+	errno = 0;
+	if (!append(b, r->path, r->pathLen + 1, &r->pathOff))
+		return false;
+
+	if ((fd = open(r->path, O_RDONLY)) == -1)
+		return false;
+	if (fstat(fd, &st) == -1 || !reserve(b, st.st_size)) {
+		close(fd);
+		return false;
+	}
+
+	/* the file may still be changing: pack what we read */
+	for (off = 0; off < st.st_size; off += n)
+		if ((n = pread(fd, b->data + b->len + off, st.st_size - off, off)) <= 0) {
+			if (n == -1 && errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			break;
+		}
+	close(fd);
+
+	st.st_size = off;
+	r->status = 200;
+	r->mtime = st.st_mtim;
+	r->hash = hashPath(r->path, r->pathLen);
+	memset(r->part, 0, sizeof(r->part));
+	r->part[ENC_IDENTITY].bodyOff = b->len;
+	r->part[ENC_IDENTITY].bodyLen = off;
+	b->len += off;
+
+	for (enc = ENC_IDENTITY + 1; fileCompressible(r->path) && enc < ENC_COUNT;
+	    enc++) {
+		p = &r->part[enc];
+		if (!(body = compressBody(enc, b->data + r->part[ENC_IDENTITY].bodyOff,
+		    off, &len)))
+			continue;
+		p->bodyLen = len;
+		if (!append(b, body, len, &p->bodyOff)) {
+			free(body);
+			return false;
+		}
+		free(body);
+	}
+
+	for (enc = ENC_IDENTITY; enc < ENC_COUNT; enc++) {
+		p = &r->part[enc];
+		if (enc != ENC_IDENTITY && p->bodyLen == 0)
+			continue;
+		len = fileHeader(head, sizeof(head), r->path, 200, enc, p->bodyLen, &st);
+		if (!append(b, head, len, &p->headOff))
+			return false;
+		p->headLen = len;
+	}
+
+	if (strcmp(r->path, NOT_FOUND_PAGE) != 0)
+		return true;
+
+	*nf = *r;
+	nf->status = 404;
+	for (enc = ENC_IDENTITY; enc < ENC_COUNT; enc++) {
+		p = &nf->part[enc];
+		if (p->headLen == 0)
+			continue;
+		len = fileHeader(head, sizeof(head), r->path, 404, enc, p->bodyLen,
+		    NULL);
+		if (!append(b, head, len, &p->headOff))
+			return false;
+		p->headLen = len;
+	}
+	return true;
+}
+
+/*
+ * Find each bucket, fullest first, a displacement sending all its
+ * paths to free slots; false if some bucket found none
+ */
+static bool
+placeKeys(struct record *recs, size_t n, uint32_t *d, uint32_t nbuckets,
+    uint32_t nslots)
+{
+	struct bucket *order;
+	uint32_t *start, *members, *fill;
+	uint32_t b, k, j, seed, s;
+	bool *taken, ok = false;
+	size_t i;
+
+	order = calloc(nbuckets, sizeof(struct bucket));
+	start = calloc(nbuckets + 1, sizeof(uint32_t));
+	fill = calloc(nbuckets, sizeof(uint32_t));
+	members = calloc(n + 1, sizeof(uint32_t));
+	taken = calloc(nslots, sizeof(bool));
+	if (!order || !start || !fill || !members || !taken)
+		goto out;
+
+	/* the paths of each bucket, next to each other in `members' */
+	for (i = 0; i < n; i++)
+		start[(recs[i].hash >> 32) % nbuckets + 1]++;
+	for (b = 0; b < nbuckets; b++) {
+		order[b].id = b;
+		order[b].keys = start[b + 1];
+		start[b + 1] += start[b];
+	}
+	for (i = 0; i < n; i++) {
+		b = (recs[i].hash >> 32) % nbuckets;
+		members[start[b] + fill[b]++] = i;
+	}
+	qsort(order, nbuckets, sizeof(struct bucket), byKeys);
+
+	for (b = 0; b < nbuckets && order[b].keys > 0; b++) {
+		const uint32_t *m = members + start[order[b].id];
+
+		for (seed = 0; seed < SNAP_MAX_SEED; seed++) {
+			for (k = 0; k < order[b].keys; k++) {
+				s = slotOf(recs[m[k]].hash, seed, nslots);
+				if (taken[s])
+					break;
+				for (j = 0; j < k && recs[m[j]].slot != s; j++)
+					;
+				if (j < k)
+					break;
+				recs[m[k]].slot = s;
+			}
+			if (k == order[b].keys)
+				break;
+		}
+		if (seed == SNAP_MAX_SEED)
+			goto out;
+
+		d[order[b].id] = seed;
+		for (k = 0; k < order[b].keys; k++)
+			taken[recs[m[k]].slot] = true;
+	}
+	ok = true;
+
+out:
+	free(order);
+	free(start);
+	free(fill);
+	free(members);
+	free(taken);
+	return ok;
+}
+
+static int
+byKeys(const void *a, const void *b)
+{
+	const struct bucket *x = a, *y = b;
+
+	return (x->keys < y->keys) - (x->keys > y->keys);
+}
+
+/*
+ * Lay the index and the data out in an anonymous mapping, and
+ * make it read-only
+ */
+static bool
+mapSnapshot(struct blob *b, struct record *recs, size_t n,
+    const struct record *nf, uint32_t nbuckets, uint32_t nslots,
+    const uint32_t *d)
+{
+	struct snapHeader *h;
+	struct snapEntry *e;
+	uint64_t dataOff;
+	size_t size, i;
+	char *m;
+
+	dataOff = sizeof(struct snapHeader) + nbuckets * sizeof(uint32_t);
+	dataOff = (dataOff + 7) & ~(uint64_t) 7;
+	dataOff += (nslots + 1) * (uint64_t) sizeof(struct snapEntry);
+	size = dataOff + b->len;
+
+	m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+	    -1, 0);
+	if (m == MAP_FAILED) {
+		fprintf(stdout, "mmap error: %s\n", strerror(errno));
+		return false;
+	}
+
+	h = (struct snapHeader *) m;
+	memcpy(h->magic, SNAP_MAGIC, sizeof(h->magic));
+	h->nfiles = n;
+	h->nbuckets = nbuckets;
+	h->nslots = nslots;
+	h->size = size;
+	memcpy(m + sizeof(struct snapHeader), d, nbuckets * sizeof(uint32_t));
+
+	/* the anonymous mapping leaves the other slots empty */
+	e = (struct snapEntry *) (m + ((sizeof(struct snapHeader) +
+	    nbuckets * sizeof(uint32_t) + 7) & ~(size_t) 7));
+	for (i = 0; i < n; i++)
+		fillEntry(&e[recs[i].slot], &recs[i], dataOff);
+	if (nf)
+		fillEntry(&e[nslots], nf, dataOff);
+
+	if (b->len)
+		memcpy(m + dataOff, b->data, b->len);
+	if (mprotect(m, size, PROT_READ) == -1) {
+		fprintf(stdout, "mprotect error: %s\n", strerror(errno));
+		munmap(m, size);
+		return false;
+	}
+
+	base = m;
+	header = h;
+	disp = (const uint32_t *) (m + sizeof(struct snapHeader));
+	slots = e;
+	return true;
+}
+
+static void
+fillEntry(struct snapEntry *e, const struct record *r, uint64_t dataOff)
+{
+	int enc;
+
+	e->pathOff = dataOff + r->pathOff;
+	e->pathLen = r->pathLen;
+	e->status = r->status;
+	e->mtimeSec = r->mtime.tv_sec;
+	e->mtimeNsec = r->mtime.tv_nsec;
+	for (enc = ENC_IDENTITY; enc < ENC_COUNT; enc++) {
+		if (r->part[enc].headLen == 0)
+			continue;
+		e->part[enc] = r->part[enc];
+		e->part[enc].headOff += dataOff;
+		e->part[enc].bodyOff += dataOff;
+	}
+}
+
+static void
+fillFile(const struct snapEntry *e, struct snapFile *f)
+{
+	const struct snapPart *p;
+	int enc;
+
+	f->path = base + e->pathOff;
+	f->status = e->status;
+	f->mtime.tv_sec = e->mtimeSec;
+	f->mtime.tv_nsec = e->mtimeNsec;
+	for (enc = ENC_IDENTITY; enc < ENC_COUNT; enc++) {
+		p = &e->part[enc];
+		/* the variants are never written through */
+		f->var[enc].head = p->headLen ? (char *) base + p->headOff : NULL;
+		f->var[enc].headLen = p->headLen;
+		f->var[enc].body = (char *) base + p->bodyOff;
+		f->var[enc].bodyLen = p->bodyLen;
+	}
+}
+
+/* FNV-1a, 64 bits: the upper half picks the bucket */
+static uint64_t
+hashPath(const char *path, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (len--)
+		h = (h ^ (unsigned char) *path++) * 1099511628211ULL;
+
+	return h;
+}
+
+/*
+ * The slot a path goes to under a displacement: its hash mixed
+ * with the seed (splitmix64's finalizer)
+ */
+static uint32_t
+slotOf(uint64_t h, uint32_t seed, uint32_t nslots)
+{
+	h ^= seed * 0x9e3779b97f4a7c15ULL;
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+
+	return h % nslots;
+}
+
+/*
+ * Room for `len' more bytes, within the size limit
+ */
+static bool
+reserve(struct blob *b, size_t len)
+{
+	size_t cap;
+	char *data;
+
+	if (len > b->max - b->len)
+		return false;
+	if (b->len + len <= b->cap)
+		return true;
+
+	for (cap = b->cap ? b->cap : 65536; cap < b->len + len; cap *= 2)
+		;
+	if (!(data = realloc(b->data, cap)))
+		return false;
+
+	b->data = data;
+	b->cap = cap;
+	return true;
+}
+
+static bool
+append(struct blob *b, const void *data, size_t len, uint64_t *off)
+{
+	if (!reserve(b, len))
+		return false;
+
+	memcpy(b->data + b->len, data, len);
+	*off = b->len;
+	b->len += len;
+	return true;
+}
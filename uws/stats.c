@@ -0,0 +1,392 @@
+/*
+ * Request counters and the access log.  Every thread serving
+ * requests gets a block of its own, registered the first time it
+ * reports anything: counters only their owner writes (bumping one
+ * is a plain load and store, no locked instruction), and a
+ * single-producer ring of access log records that a background
+ * thread drains to stdout in batches, every LOG_FLUSH_MS or as soon
+ * as a ring gets half full.  Readers (the /__stats report and the
+ * log writer) walk the blocks and add them up as they go.
+ */
+
+#define _GNU_SOURCE /* CLOCK_REALTIME_COARSE */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "include/http.h"
+#include "include/stats.h"
+
+#define LOG_BUFF_SZ 65536  /* the writer's batch */
+#define LOG_LINE_MAX 512
+
+/* counters are only ever written by the thread owning them */
+#define bump(c, n) atomic_store_explicit(&(c), \
+	atomic_load_explicit(&(c), memory_order_relaxed) + (n), memory_order_relaxed)
+#define peek(c) atomic_load_explicit(&(c), memory_order_relaxed)
+
+struct logRecord {
+	time_t when;
+	struct sockaddr_in peer;
+	char method[8];
+	char path[LOG_PATH_SZ];
+	int status;
+	off_t sent;
+	long usecs;
+};
+
+struct threadStats {
+	atomic_ulong requests;
+	atomic_ulong bytes;
+	atomic_ulong opened;    /* connections */
+	atomic_ulong closed;
+	atomic_ulong rejected;  /* turned down with a 503 */
+	atomic_ulong status[6]; /* by class: [2] is 2xx... */
+	atomic_ulong latency[LAT_BUCKETS];
+	atomic_ulong dropped;   /* log records that found the ring full */
+
+	/* the owner produces, the writer consumes */
+	_Alignas(64) atomic_size_t head;
+	_Alignas(64) atomic_size_t tail;
+	struct logRecord *ring;
+	struct threadStats *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct threadStats *_Atomic all;
+static bool logging;
+static sem_t wakeup;  /* a ring is filling up: drain it now */
+static _Thread_local struct threadStats *mine;
+
+static struct threadStats *self(void);
+static void *logWriter(void *data);
+static size_t formatRecord(char *buff, size_t sz, const struct logRecord *r);
+static void flushLog(const char *buff, size_t len);
+static void copyView(char *dst, size_t sz, struct strView v);
+static int  bucket(long usecs);
+
+/*
+ * Turn the access log on or off; call before any thread starts
+ * reporting
+ */
+void
+statsInit(bool accessLog)
+{
+	pthread_t thread;
+
+	if (!accessLog || sem_init(&wakeup, 0, 0) == -1)
+		return;
+
+	if (pthread_create(&thread, NULL, logWriter, NULL) != 0) {
+		fprintf(stdout, "cannot start the log writer; not logging\n");
+		return;
+	}
+	pthread_detach(thread);
+	logging = true;
+}
+
+bool
+statsLogging(void)
+{
+	return logging;
+}
+
+void
+statsConnOpen(void)
+{
+	struct threadStats *t;
+
+	if ((t = self()))
+		bump(t->opened, 1);
+}
+
+void
+statsConnClose(void)
+{
+	struct threadStats *t;
+
+	if ((t = self()))
+		bump(t->closed, 1);
+}
+
+void
+statsRejected(void)
+{
+	struct threadStats *t;
+
+	if ((t = self()))
+		bump(t->rejected, 1);
+}
+
+/*
+ * Account for an answered request, started at `start'
+ * (CLOCK_MONOTONIC), and queue its access log record
+ */
+void
+statsRequest(const struct sockaddr_in *peer, const struct httpRequest *req,
+    int status, off_t sent, const struct timespec *start)
+{
+	struct threadStats *t;
+	struct logRecord *r;
+	struct timespec now;
+	size_t head;
+	long usecs;
+
+	if (!(t = self()))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usecs = (now.tv_sec - start->tv_sec) * 1000000L +
+	    (now.tv_nsec - start->tv_nsec) / 1000;
+
+	bump(t->requests, 1);
+	bump(t->bytes, sent);
+	if (status >= 100 && status < 600)
+		bump(t->status[status / 100], 1);
+	bump(t->latency[bucket(usecs)], 1);
+
+	if (!t->ring)
+		return;
+
+	head = atomic_load_explicit(&t->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&t->tail, memory_order_acquire) == LOG_RING_SZ) {
+		bump(t->dropped, 1);
+		return;
+	}
+
+	r = &t->ring[head & (LOG_RING_SZ - 1)];
+	clock_gettime(CLOCK_REALTIME_COARSE, &now);
+	r->when = now.tv_sec;
+	if (peer)
+		r->peer = *peer;
+	else
+		memset(&r->peer, 0, sizeof(r->peer));
+	copyView(r->method, sizeof(r->method), req->method);
+	copyView(r->path, sizeof(r->path), req->path);
+	r->status = status;
+	r->sent = sent;
+	r->usecs = usecs;
+
+	atomic_store_explicit(&t->head, head + 1, memory_order_release);
+
+	/* once per half ring, so not worth avoiding */
+	if (head - atomic_load_explicit(&t->tail, memory_order_relaxed) ==
+	    LOG_RING_SZ / 2)
+		sem_post(&wakeup);
+}
+
+/*
+ * The /__stats body, as JSON in a malloc'ed buffer
+ */
+char *
+statsReport(size_t *len)
+{
+	unsigned long requests = 0, bytes = 0, opened = 0, closed = 0;
+	unsigned long rejected = 0, dropped = 0;
+	unsigned long status[6] = {0}, latency[LAT_BUCKETS] = {0};
+	struct threadStats *t, *first;
+	const char *sep = "";
+	char *buff;
+	FILE *f;
+	int i, nthreads = 0;
+
+	first = atomic_load_explicit(&all, memory_order_acquire);
+	for (t = first; t; t = t->next) {
+		requests += peek(t->requests);
+		bytes += peek(t->bytes);
+		opened += peek(t->opened);
+		closed += peek(t->closed);
+		rejected += peek(t->rejected);
+		dropped += peek(t->dropped);
+		for (i = 0; i < 6; i++)
+			status[i] += peek(t->status[i]);
+		for (i = 0; i < LAT_BUCKETS; i++)
+			latency[i] += peek(t->latency[i]);
+		nthreads++;
+	}
+
+	if (!(f = open_memstream(&buff, len)))
+		return NULL;
+
+	fprintf(f, "{\n  \"threads\": %d,\n", nthreads);
+	fprintf(f, "  \"requests\": %lu,\n  \"bytes_sent\": %lu,\n", requests, bytes);
+	/* counted apart, the two may pass each other for a moment */
+	fprintf(f, "  \"active_connections\": %lu,\n  \"connections\": %lu,\n",
+	    opened > closed ? opened - closed : 0, opened);
+	fprintf(f, "  \"rejected\": %lu,\n  \"log_dropped\": %lu,\n", rejected,
+	    dropped);
+
+	fprintf(f, "  \"status\": {");
+	for (i = 1; i < 6; i++)
+		fprintf(f, "%s\"%dxx\": %lu", i > 1 ? ", " : "", i, status[i]);
+	fprintf(f, "},\n");
+
+	/* keyed by upper bound: "8": requests taking 4 to 7us */
+	fprintf(f, "  \"latency_us\": {");
+	for (i = 0; i < LAT_BUCKETS; i++)
+		if (latency[i]) {
+			fprintf(f, "%s\"%lu\": %lu", sep, 1UL << i, latency[i]);
+			sep = ", ";
+		}
+	fprintf(f, "},\n");
+
+	fprintf(f, "  \"thread_requests\": [");
+	for (t = first; t; t = t->next)
+		fprintf(f, "%lu%s", peek(t->requests), t->next ? ", " : "");
+	fprintf(f, "]\n}\n");
+
+	if (fclose(f) != 0) {
+		free(buff);
+		return NULL;
+	}
+	return buff;
+}
+
+/*
+ * The calling thread's block, set up on first use
+ */
+static struct threadStats *
+self(void)
+{
+	struct threadStats *t;
+
+	if (mine)
+		return mine;
+
+	if (posix_memalign((void **) &t, 64, sizeof(struct threadStats)) != 0)
+		return NULL;
+	memset(t, 0, sizeof(struct threadStats));
+
+	/* without a ring, this thread just does not log */
+	if (logging)
+		t->ring = calloc(LOG_RING_SZ, sizeof(struct logRecord));
+
+	pthread_mutex_lock(&lock);
+	t->next = atomic_load_explicit(&all, memory_order_relaxed);
+	atomic_store_explicit(&all, t, memory_order_release);
+	pthread_mutex_unlock(&lock);
+
+	return mine = t;
+}
+
+/*
+ * Move whatever the rings hold to stdout, a buffer at a time
+ */
+static void *
+logWriter(void *data)
+{
+	char buff[LOG_BUFF_SZ];
+	struct threadStats *t;
+	struct timespec until;
+	size_t len, head, tail;
+
+	(void) data;
+
+	while (true) {
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += LOG_FLUSH_MS * 1000000L;
+		if (until.tv_nsec >= 1000000000L) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		while (sem_timedwait(&wakeup, &until) == -1 && errno == EINTR)
+			;
+
+		len = 0;
+		for (t = atomic_load_explicit(&all, memory_order_acquire); t; t = t->next) {
+			if (!t->ring)
+				continue;
+
+			tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+			head = atomic_load_explicit(&t->head, memory_order_acquire);
+			for (; tail != head; tail++) {
+				if (sizeof(buff) - len < LOG_LINE_MAX) {
+					flushLog(buff, len);
+					len = 0;
+				}
+				len += formatRecord(buff + len, sizeof(buff) - len,
+				    &t->ring[tail & (LOG_RING_SZ - 1)]);
+			}
+			atomic_store_explicit(&t->tail, tail, memory_order_release);
+		}
+
+		flushLog(buff, len);
+	}
+
+	return NULL;
+}
+
+/*
+ * Common Log Format, plus the time taken
+ */
+static size_t
+formatRecord(char *buff, size_t sz, const struct logRecord *r)
+{
+	/* only the writer thread gets here */
+	static char date[32];
+	static time_t dateOf = -1;
+	char addr[INET_ADDRSTRLEN];
+	struct tm tm;
+	int n;
+
+	inet_ntop(AF_INET, &r->peer.sin_addr, addr, sizeof(addr));
+	if (r->when != dateOf) {
+		gmtime_r(&r->when, &tm);
+		strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+		dateOf = r->when;
+	}
+
+	n = snprintf(buff, sz, "%s - - [%s] \"%s %s\" %d %lld %ldus\n", addr, date,
+	    r->method, r->path, r->status, (long long) r->sent, r->usecs);
+
+	return n < 0 ? 0 : (size_t) n < sz ? (size_t) n : sz - 1;
+}
+
+static void
+flushLog(const char *buff, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(STDOUT_FILENO, buff, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return; /* nowhere to log to: the batch is lost */
+		}
+		buff += n;
+		len -= n;
+	}
+}
+
+static void
+copyView(char *dst, size_t sz, struct strView v)
+{
+	size_t n = v.len < sz - 1 ? v.len : sz - 1;
+
+	memcpy(dst, v.ptr, n);
+	dst[n] = '\0';
+}
+
+/*
+ * Bucket i holds latencies below 2^i us
+ */
+static int
+bucket(long usecs)
+{
+	int b;
+
+	if (usecs <= 0)
+		return 0;
+
+	b = 64 - __builtin_clzl(usecs);
+	return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
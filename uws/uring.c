@@ -0,0 +1,756 @@
+/*
+ * io_uring mode: like the reactor, a fixed set of threads each
+ * serving the connections it accepts, but every socket and file
+ * operation is queued on a ring of the thread's own instead of
+ * being a syscall.  Listeners get a multishot accept; requests are
+ * read into buffers registered with the kernel up front, each read
+ * linked to a timeout (the keep-alive limit, or what is left of the
+ * read deadline once a request has started); responses go out as
+ * a chain of linked operations: a sendmsg for the part in memory,
+ * then the file in chunks, each read into a registered buffer and
+ * linked to the send pushing it out (linked operations run one after
+ * the other, so the pairs of a chain can share the buffer).  Every
+ * send is linked to a timeout too, the write deadline, so a peer
+ * taking nothing cannot hold its slot forever.  A short or failed
+ * operation cancels the rest of its chain; the connection picks up
+ * from whatever completed once the whole chain is back.
+ *
+ * The rings are driven with raw syscalls (no liburing).
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+#include "include/uws.h"
+#include "include/http.h"
+#include "include/response.h"
+#include "include/stats.h"
+#include "include/uring.h"
+
+/*
+ * What a completion is about: the low byte of its user_data; the
+ * connection slot comes next, and file reads carry the length they
+ * asked for in the upper half
+ */
+enum {
+	OP_ACCEPT,
+	OP_READ,     /* request bytes, into the slot's registered buffer */
+	OP_TIMEOUT,  /* linked to an OP_READ or a send: its deadline */
+	OP_SENDMSG,  /* the in-memory part of a response */
+	OP_FREAD,    /* a file chunk, into the slot's registered chunk */
+	OP_SEND,     /* linked to an OP_FREAD: that chunk */
+	OP_BACKOFF   /* the wait before accepting again, after an error */
+};
+
+/* registered buffer indexes */
+enum {
+	BUF_REQ,
+	BUF_CHUNK
+};
+
+enum uconnState {
+	UC_READING,
+	UC_WRITING
+};
+
+struct ring {
+	int fd;
+	unsigned *sqHead;
+	unsigned *sqTail;
+	unsigned *sqMask;
+	unsigned *sqArray;
+	unsigned sqEntries;
+	struct io_uring_sqe *sqes;
+	unsigned *cqHead;
+	unsigned *cqTail;
+	unsigned *cqMask;
+	struct io_uring_cqe *cqes;
+	unsigned toSubmit;
+	void *sq, *cq;
+	size_t sqSz, cqSz, sqesSz;
+};
+
+struct uconn {
+	int fd;                 /* -1 while the slot is free */
+	struct sockaddr_in peer;
+	enum uconnState state;
+	int pending;            /* operations in flight */
+	bool closing;
+	int nreq;
+	struct httpRequest req;
+	struct response res;
+	struct msghdr msg;
+	struct timespec start;
+	time_t since;           /* the request being read started coming */
+	struct __kernel_timespec wait;  /* for the read in flight */
+};
+
+struct uworker {
+	pthread_t thread;
+	struct ring ring;
+	int ssocket;
+	int cpu;                /* to pin to, or -1 */
+	bool multishot;         /* does the kernel do multishot accept? */
+	int readTimeout;
+	struct __kernel_timespec writeTimeout;
+	struct uconn conns[UR_MAX_CONNS];
+	int freeSlots[UR_MAX_CONNS];
+	int nfree;
+	struct reqBuff *bufs;   /* BUF_REQ: one per slot */
+	char *chunks;           /* BUF_CHUNK: UR_CHUNK_SZ per slot */
+};
+
+static bool ringSetup(struct ring *r, unsigned entries);
+static void ringFree(struct ring *r);
+static struct io_uring_sqe *ringSqe(struct ring *r);
+static void ringReserve(struct ring *r, unsigned n);
+static int  ringEnter(struct ring *r, bool wait);
+static bool workerSetup(struct uworker *w);
+static void workerFree(struct uworker *w);
+static void *uringLoop(void *data);
+static void armAccept(struct uworker *w);
+static void backOff(struct uworker *w);
+static void acceptConn(struct uworker *w, int res, unsigned flags);
+static void complete(struct uworker *w, uint64_t data, int res);
+static void advance(struct uworker *w, struct uconn *c);
+static bool submitRead(struct uworker *w, struct uconn *c);
+static void linkTimeout(struct uworker *w, struct uconn *c,
+    const struct __kernel_timespec *ts, bool link);
+static bool sendMore(struct uworker *w, struct uconn *c);
+static void skipSent(struct response *res, size_t n);
+static void endConn(struct uworker *w, struct uconn *c);
+static uint64_t tag(struct uworker *w, struct uconn *c, int op);
+static time_t now(void);
+
+/*
+ * Serve the listeners from `nthreads' rings.  False, with nothing
+ * started, if io_uring cannot be set up; otherwise it only returns
+ * once every thread has given up
+ */
+bool
+runUring(int *ssockets, int nsockets, int nthreads,
+    const struct deadlines *dl)
+{
+	struct uworker *workers;
+	int i;
+
+	if (nthreads < 1)
+		nthreads = 1;
+
+	if (!(workers = calloc(nthreads, sizeof(struct uworker))))
+		return false;
+
+	/* set every ring up before starting any thread */
+	for (i = 0; i < nthreads; i++) {
+		workers[i].ssocket = ssockets[i % nsockets];
+		workers[i].cpu = nsockets > 1 ? i : -1;
+		workers[i].readTimeout = dl->read;
+		workers[i].writeTimeout.tv_sec = dl->write;
+		if (!workerSetup(&workers[i])) {
+			while (i-- > 0)
+				workerFree(&workers[i]);
+			free(workers);
+			return false;
+		}
+	}
+
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&workers[i].thread, NULL, uringLoop, &workers[i]) != 0) {
+			fprintf(stdout, "pthread_create error\n");
+			exit(EXIT_FAILURE);
+		}
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (i = 0; i < nthreads; i++)
+		workerFree(&workers[i]);
+	free(workers);
+	return true;
+}
+
+static bool
+ringSetup(struct ring *r, unsigned entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(r, 0, sizeof(*r));
+
+	/* no need to interrupt us for task work: we only ever wait in enter */
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_COOP_TASKRUN;
+	if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1 &&
+	    errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	}
+	if (r->fd == -1) {
+		fprintf(stdout, "io_uring_setup error: %s\n", strerror(errno));
+		return false;
+	}
+
+	r->sqSz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cqSz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->sqSz = r->cqSz = r->sqSz > r->cqSz ? r->sqSz : r->cqSz;
+	r->sqesSz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	r->sq = mmap(NULL, r->sqSz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq == MAP_FAILED)
+		goto fail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq = r->sq;
+	else if ((r->cq = mmap(NULL, r->cqSz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+		goto fail;
+
+	if ((r->sqes = mmap(NULL, r->sqesSz, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES)) == MAP_FAILED)
+		goto fail;
+
+	sq = r->sq;
+	cq = r->cq;
+	r->sqHead = (unsigned *) (sq + p.sq_off.head);
+	r->sqTail = (unsigned *) (sq + p.sq_off.tail);
+	r->sqMask = (unsigned *) (sq + p.sq_off.ring_mask);
+	r->sqArray = (unsigned *) (sq + p.sq_off.array);
+	r->sqEntries = p.sq_entries;
+	r->cqHead = (unsigned *) (cq + p.cq_off.head);
+	r->cqTail = (unsigned *) (cq + p.cq_off.tail);
+	r->cqMask = (unsigned *) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	return true;
+
+  fail:
+	fprintf(stdout, "io_uring mmap error: %s\n", strerror(errno));
+	ringFree(r);
+	return false;
+}
+
+static void
+ringFree(struct ring *r)
+{
+	if (r->sqes && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqesSz);
+	if (r->cq && r->cq != MAP_FAILED && r->cq != r->sq)
+		munmap(r->cq, r->cqSz);
+	if (r->sq && r->sq != MAP_FAILED)
+		munmap(r->sq, r->sqSz);
+	if (r->fd != -1)
+		close(r->fd);
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+}
+
+/*
+ * A zeroed submission queue entry, queued for the next enter
+ */
+static struct io_uring_sqe *
+ringSqe(struct ring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, idx;
+
+	ringReserve(r, 1);
+
+	tail = *r->sqTail;
+	idx = tail & *r->sqMask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sqArray[idx] = idx;
+
+	/* the kernel only looks at the queue when we enter */
+	__atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+	r->toSubmit++;
+	return sqe;
+}
+
+/*
+ * Make room for `n' entries, so that a chain of linked operations
+ * is never split across two submissions
+ */
+static void
+ringReserve(struct ring *r, unsigned n)
+{
+	if (*r->sqTail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) + n > r->sqEntries)
+		ringEnter(r, false);
+}
+
+/*
+ * Submit what is queued and, if `wait', sleep until there is at
+ * least one completion
+ */
+static int
+ringEnter(struct ring *r, bool wait)
+{
+	int n;
+
+	while ((n = syscall(__NR_io_uring_enter, r->fd, r->toSubmit, wait ? 1 : 0,
+	    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) == -1 && errno == EINTR)
+		;
+	if (n > 0)
+		r->toSubmit -= n;
+
+	return n;
+}
+
+/*
+ * A ring plus the buffers it reads into, registered so that the
+ * kernel does not have to map them on every read
+ */
+static bool
+workerSetup(struct uworker *w)
+{
+	struct iovec iov[2];
+	int i;
+
+	w->bufs = MAP_FAILED;
+	w->chunks = MAP_FAILED;
+
+	if (!ringSetup(&w->ring, UR_ENTRIES))
+		return false;
+
+	w->bufs = mmap(NULL, UR_MAX_CONNS * sizeof(struct reqBuff),
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	w->chunks = mmap(NULL, (size_t) UR_MAX_CONNS * UR_CHUNK_SZ,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (w->bufs == MAP_FAILED || w->chunks == MAP_FAILED) {
+		fprintf(stdout, "mmap error: %s\n", strerror(errno));
+		workerFree(w);
+		return false;
+	}
+
+	iov[BUF_REQ].iov_base = w->bufs;
+	iov[BUF_REQ].iov_len = UR_MAX_CONNS * sizeof(struct reqBuff);
+	iov[BUF_CHUNK].iov_base = w->chunks;
+	iov[BUF_CHUNK].iov_len = (size_t) UR_MAX_CONNS * UR_CHUNK_SZ;
+	if (syscall(__NR_io_uring_register, w->ring.fd, IORING_REGISTER_BUFFERS,
+	    iov, 2) == -1) {
+		fprintf(stdout, "io_uring_register error: %s\n", strerror(errno));
+		workerFree(w);
+		return false;
+	}
+
+	for (i = 0; i < UR_MAX_CONNS; i++) {
+		w->conns[i].fd = -1;
+		w->freeSlots[i] = UR_MAX_CONNS - 1 - i;
+	}
+	w->nfree = UR_MAX_CONNS;
+	w->multishot = true;
+	return true;
+}
+
+static void
+workerFree(struct uworker *w)
+{
+	ringFree(&w->ring);
+	if (w->bufs != MAP_FAILED)
+		munmap(w->bufs, UR_MAX_CONNS * sizeof(struct reqBuff));
+	if (w->chunks != MAP_FAILED)
+		munmap(w->chunks, (size_t) UR_MAX_CONNS * UR_CHUNK_SZ);
+	w->bufs = MAP_FAILED;
+	w->chunks = MAP_FAILED;
+}
+
+static void *
+uringLoop(void *data)
+{
+	struct uworker *w = data;
+	struct ring *r = &w->ring;
+	struct io_uring_cqe cqe;
+	unsigned head;
+
+	if (w->cpu != -1)
+		pinCpu(w->cpu);
+
+	armAccept(w);
+
+	while (true) {
+		/* EBUSY: completions are backed up, reap them first */
+		if (ringEnter(r, true) == -1 && errno != EBUSY && errno != EAGAIN) {
+			fprintf(stdout, "io_uring_enter error: %s\n", strerror(errno));
+			break;
+		}
+
+		head = *r->cqHead;
+		while (head != __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+			cqe = r->cqes[head & *r->cqMask];
+			__atomic_store_n(r->cqHead, ++head, __ATOMIC_RELEASE);
+
+			if ((cqe.user_data & 0xff) == OP_ACCEPT)
+				acceptConn(w, cqe.res, cqe.flags);
+			else if ((cqe.user_data & 0xff) == OP_BACKOFF)
+				armAccept(w);
+			else
+				complete(w, cqe.user_data, cqe.res);
+		}
+	}
+
+	return NULL;
+}
+
+static void
+armAccept(struct uworker *w)
+{
+	struct io_uring_sqe *sqe = ringSqe(&w->ring);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = w->ssocket;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	if (w->multishot)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = OP_ACCEPT;
+}
+
+/*
+ * Accept again a while from now: out of descriptors (EMFILE...), the
+ * connection waiting would fail a new accept straight away, so give
+ * the others time to close some, as the pool does
+ */
+static void
+backOff(struct uworker *w)
+{
+	static const struct __kernel_timespec acceptBackoff = {
+		0, 10 * 1000 * 1000
+	};
+	struct io_uring_sqe *sqe = ringSqe(&w->ring);
+
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uintptr_t) &acceptBackoff;
+	sqe->len = 1;
+	sqe->user_data = OP_BACKOFF;
+}
+
+static void
+acceptConn(struct uworker *w, int res, unsigned flags)
+{
+	socklen_t len = sizeof(struct sockaddr_in);
+	struct uconn *c;
+
+	/* a multishot accept stays armed until it says otherwise */
+	if (!(flags & IORING_CQE_F_MORE)) {
+		if (res == -EINVAL && w->multishot) {
+			w->multishot = false; /* older kernel: one accept at a time */
+			armAccept(w);
+		} else if (res < 0 && res != -EINVAL && res != -EINTR &&
+		    res != -ECONNABORTED)
+			backOff(w);
+		else if (res != -EINVAL)
+			armAccept(w);
+	}
+
+	if (res < 0)
+		return;
+
+	if (w->nfree == 0) {
+		close(res);
+		statsRejected();
+		return;
+	}
+
+	c = &w->conns[w->freeSlots[--w->nfree]];
+	memset(c, 0, sizeof(*c));
+	c->fd = res;
+	c->state = UC_READING;
+	c->res.fd = -1;
+	w->bufs[c - w->conns].len = 0;
+
+	/* only the access log wants to know */
+	if (statsLogging())
+		getpeername(c->fd, (struct sockaddr *) &c->peer, &len);
+
+	statsConnOpen();
+	advance(w, c);
+}
+
+/*
+ * Account for a completed operation; once all those of the
+ * connection are back, move it on
+ */
+static void
+complete(struct uworker *w, uint64_t data, int res)
+{
+	struct uconn *c = &w->conns[(data >> 8) & 0xffffff];
+
+	c->pending--;
+
+	switch (data & 0xff) {
+	case OP_READ:
+		/* -ECANCELED: the timeout went off first */
+		if (res <= 0)
+			c->closing = true;
+		else
+			w->bufs[c - w->conns].len += res;
+		break;
+	case OP_SENDMSG:
+		if (res < 0)
+			c->closing = true;
+		else
+			skipSent(&c->res, res);
+		break;
+	case OP_FREAD:
+		/* short means the file shrank: its send got cancelled */
+		if (res != -ECANCELED && (res < 0 || (uint64_t) res < data >> 32))
+			c->closing = true;
+		break;
+	case OP_TIMEOUT:
+		/* went off: whatever it guarded got cancelled */
+		if (res == -ETIME)
+			c->closing = true;
+		break;
+	case OP_SEND:
+		if (res == -ECANCELED)
+			break;
+		if (res < 0)
+			c->closing = true;
+		else {
+			c->res.bodyOff += res;
+			c->res.sent += res;
+		}
+		break;
+	}
+
+	if (c->pending == 0)
+		advance(w, c);
+}
+
+/*
+ * Take a connection with nothing in flight as far as it goes:
+ * answer whatever requests are buffered, until something has to
+ * be waited for
+ */
+static void
+advance(struct uworker *w, struct uconn *c)
+{
+	struct reqBuff *in = &w->bufs[c - w->conns];
+	int status;
+
+	while (!c->closing) {
+		switch (c->state) {
+		case UC_READING:
+			if ((status = parseRequest(in->data, in->len, &c->req)) == 0) {
+				if (in->len == sizeof(in->data))
+					break; /* header too large */
+				if (!submitRead(w, c))
+					break;
+				return;
+			}
+			if (status == -1)
+				break;
+
+			c->since = 0;
+
+			c->nreq++;
+			clock_gettime(CLOCK_MONOTONIC, &c->start);
+			prepareResponse(&c->res, &c->req,
+			    requestKeepAlive(&c->req) && c->nreq < KEEPALIVE_MAX);
+			if (c->res.iovCnt == 0)
+				break;
+			c->state = UC_WRITING;
+			/* FALLTHROUGH */
+		case UC_WRITING:
+			if (sendMore(w, c))
+				return;
+
+			statsRequest(&c->peer, &c->req, c->res.status, c->res.sent,
+			    &c->start);
+			finishResponse(&c->res);
+			if (!c->res.keepAlive)
+				break;
+			consumeRequest(in, &c->req);
+			c->state = UC_READING;
+			continue;
+		}
+		break;
+	}
+
+	endConn(w, c);
+}
+
+/*
+ * Read more of the request, for as long as the deadline allows:
+ * the keep-alive limit while there is none yet; false if the
+ * time is up already
+ */
+static bool
+submitRead(struct uworker *w, struct uconn *c)
+{
+	struct reqBuff *in = &w->bufs[c - w->conns];
+	struct io_uring_sqe *sqe;
+
+	if (in->len == 0)
+		c->wait.tv_sec = KEEPALIVE_TIMEOUT;
+	else {
+		if (c->since == 0)
+			c->since = now();
+		if ((c->wait.tv_sec = w->readTimeout - (now() - c->since)) <= 0)
+			return false;
+	}
+
+	ringReserve(&w->ring, 2);
+
+	sqe = ringSqe(&w->ring);
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->fd = c->fd;
+	sqe->addr = (uintptr_t) (in->data + in->len);
+	sqe->len = sizeof(in->data) - in->len;
+	sqe->buf_index = BUF_REQ;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = tag(w, c, OP_READ);
+
+	c->pending++;
+	linkTimeout(w, c, &c->wait, false);
+	return true;
+}
+
+/*
+ * Bound the operation just queued; `link' carries the chain on
+ * past the timeout, to whatever comes after that operation
+ */
+static void
+linkTimeout(struct uworker *w, struct uconn *c,
+    const struct __kernel_timespec *ts, bool link)
+{
+	struct io_uring_sqe *sqe = ringSqe(&w->ring);
+
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->addr = (uintptr_t) ts;
+	sqe->len = 1;
+	sqe->flags = link ? IOSQE_IO_LINK : 0;
+	sqe->user_data = tag(w, c, OP_TIMEOUT);
+	c->pending++;
+}
+
+/*
+ * Queue the next chain for what is left of the response; false
+ * if nothing is
+ */
+static bool
+sendMore(struct uworker *w, struct uconn *c)
+{
+	struct response *res = &c->res;
+	struct io_uring_sqe *sqe;
+	off_t off;
+	size_t len;
+	char *chunk;
+	bool body;
+	int i;
+
+	/* anything but a regular file ends with the header */
+	body = res->fd != -1 && res->regular && res->bodyOff < res->bodyLen;
+
+	if (res->iovPos == res->iovCnt && !body)
+		return false;
+
+	ringReserve(&w->ring, 2 + 3 * UR_CHAIN_PAIRS);
+
+	if (res->iovPos < res->iovCnt) {
+		c->msg.msg_iov = res->iov + res->iovPos;
+		c->msg.msg_iovlen = res->iovCnt - res->iovPos;
+
+		sqe = ringSqe(&w->ring);
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = c->fd;
+		sqe->addr = (uintptr_t) &c->msg;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = tag(w, c, OP_SENDMSG);
+		c->pending++;
+		linkTimeout(w, c, &w->writeTimeout, body);
+	}
+
+	chunk = w->chunks + (size_t) (c - w->conns) * UR_CHUNK_SZ;
+	off = res->bodyOff;
+
+	for (i = 0; body && i < UR_CHAIN_PAIRS && off < res->bodyLen; i++) {
+		len = res->bodyLen - off < UR_CHUNK_SZ ?
+		    (size_t) (res->bodyLen - off) : UR_CHUNK_SZ;
+
+		sqe = ringSqe(&w->ring);
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->fd = res->fd;
+		sqe->addr = (uintptr_t) chunk;
+		sqe->len = len;
+		sqe->off = off;
+		sqe->buf_index = BUF_CHUNK;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = tag(w, c, OP_FREAD) | (uint64_t) len << 32;
+
+		off += len;
+
+		sqe = ringSqe(&w->ring);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = c->fd;
+		sqe->addr = (uintptr_t) chunk;
+		sqe->len = len;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = tag(w, c, OP_SEND);
+		c->pending += 2;
+		linkTimeout(w, c, &w->writeTimeout,
+		    i + 1 < UR_CHAIN_PAIRS && off < res->bodyLen);
+	}
+
+	return true;
+}
+
+/*
+ * Drop `n' sent bytes from the front of the response's iovecs
+ */
+static void
+skipSent(struct response *res, size_t n)
+{
+	struct iovec *iov = res->iov + res->iovPos;
+
+	res->sent += n;
+
+	for (; res->iovPos < res->iovCnt && n >= iov->iov_len; iov++) {
+		n -= iov->iov_len;
+		res->iovPos++;
+	}
+	if (res->iovPos < res->iovCnt) {
+		iov->iov_base = (char *) iov->iov_base + n;
+		iov->iov_len -= n;
+	}
+}
+
+static void
+endConn(struct uworker *w, struct uconn *c)
+{
+	close(c->fd);
+	statsConnClose();
+	finishResponse(&c->res);
+	c->fd = -1;
+	w->freeSlots[w->nfree++] = c - w->conns;
+}
+
+static uint64_t
+tag(struct uworker *w, struct uconn *c, int op)
+{
+	return (uint64_t) (c - w->conns) << 8 | op;
+}
+
+static time_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE /* CPU_SET, pthread_setaffinity_np */
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -7,22 +9,74 @@
 #include <errno.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
 
 #include "include/uws.h"
+#include "include/http.h"
+#include "include/response.h"
+#include "include/cache.h"
+#include "include/pool.h"
+#include "include/reactor.h"
+#include "include/stats.h"
+#include "include/uring.h"
+#include "include/snapshot.h"
+#include "include/park.h"
+#include "include/app.h"
 #include "util.h"
 
+/*
+ * A connection served by the pool; between the times there is
+ * something to do for it, it waits in the park
+ */
+struct session {
+	int fd;
+	struct sockaddr_in peer;
+	bool writing;       /* false while reading a request */
+	int nreq;           /* requests served so far */
+	time_t since;       /* the request being read started coming */
+	time_t stalled;     /* the response last made progress */
+	struct timespec start;  /* of the response being sent */
+	struct parking park;
+	struct httpRequest req;
+	struct response res;
+	struct reqBuff in;
+};
+
 static void startServer(void);
 static void parseArgs(int argc, char **argv);
 static void doNetworkingStuff(void);
+static int openListener(int *port, bool probe);
+static void *acceptThread(void *data);
+static void acceptLoop(int ssocket);
 static void logSockInfo(int sfd, int inOut);
-static void readRequest(int sfd);
-static void processRequest(int sfd, char *buff, ssize_t sz);
-static void processGETReq(int sfd, char **reqLine);
-static void *threadCallback(void *sfd);
-static void writeHeader(int sfd, const char *header[], int sz);
+static int  readRequest(int sfd, struct reqBuff *in, struct httpRequest *req);
+static bool processRequest(struct session *s);
+static bool processGETReq(struct session *s, bool keepAlive);
+static void serveSession(void *data);
+static void resumeSession(void *data);
+static void dropSession(void *data);
+static time_t now(void);
 static void printHelp(int argc, char **argv);
 
 static bool verbose = false;
+static bool reactor = false;
+static bool uring = false;
+static bool cache = true;
+static bool snapshot = false;
+static int workers = 0;
+static int poolSize = POOL_SZ;
+static struct deadlines deadlines = {READ_TIMEOUT, WRITE_TIMEOUT};
+static int *listeners;
+
+static const char unavailable[] =
+	"HTTP/1.1 503 Service Unavailable\r\n"
+	"Content-Length: 0\r\n"
+	"Retry-After: 1\r\n"
+	"Connection: close\r\n"
+	"\r\n";
 
 int 
 main(int argc, char **argv) 
@@ -43,7 +97,42 @@ parseArgs(int argc, char **argv)
 
     for (i = 1; i < argc; i++)
 	if (strcmp(argv[i], "-verbose") == 0)
-	    verbose = false;
+	    verbose = true;
+
+    for (i = 1; i < argc; i++)
+	if (strcmp(argv[i], "-reactor") == 0)
+	    reactor = true;
+
+    for (i = 1; i < argc; i++)
+	if (strcmp(argv[i], "-uring") == 0)
+	    uring = true;
+
+    for (i = 1; i < argc; i++)
+	if (strcmp(argv[i], "-nocache") == 0)
+	    cache = false;
+
+    for (i = 1; i < argc; i++)
+	if (strcmp(argv[i], "-snapshot") == 0)
+	    snapshot = true;
+
+    for (i = 1; i < argc - 1; i++)
+	if (strcmp(argv[i], "-workers") == 0 && isNumber(argv[i + 1]))
+	    workers = atoi(argv[i + 1]);
+
+    for (i = 1; i < argc - 1; i++)
+	if (strcmp(argv[i], "-readtimeout") == 0 && isNumber(argv[i + 1]) &&
+	    atoi(argv[i + 1]) > 0)
+	    deadlines.read = atoi(argv[i + 1]);
+
+    for (i = 1; i < argc - 1; i++)
+	if (strcmp(argv[i], "-writetimeout") == 0 && isNumber(argv[i + 1]) &&
+	    atoi(argv[i + 1]) > 0)
+	    deadlines.write = atoi(argv[i + 1]);
+
+    for (i = 1; i < argc - 1; i++)
+	if (strcmp(argv[i], "-pool") == 0 && isNumber(argv[i + 1]) &&
+	    atoi(argv[i + 1]) > 0)
+	    poolSize = atoi(argv[i + 1]);
 
     for (i = 1; i < argc; i++)
 	if (strcmp(argv[i], "-start") == 0)
@@ -55,181 +144,356 @@ startServer(void)
 {
     if (chdir(PAGES_DIR) != 0)
 	fprintf(stdout, "chdir error: %s\n", strerror(errno));
+    /* a peer hanging up mid-response must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+    if (snapshot && !snapInit(SNAP_MAX_BYTES)) {
+	fprintf(stdout, "cannot snapshot %s; serving it from disk\n", PAGES_DIR);
+	snapshot = false;
+    }
+    /* with a snapshot, only a tree without a 404 page reads the disk */
+    if (cache && !snapshot && !cacheInit(CACHE_MAX_BYTES))
+	fprintf(stdout, "cannot watch %s for changes; not caching\n", PAGES_DIR);
+    if (!appInit())
+	fprintf(stdout, "cannot load the programs in %s/%s\n", PAGES_DIR, APP_DIR);
+    statsInit(verbose);
     doNetworkingStuff();
 }
 
 static void
 doNetworkingStuff(void)
 {
-    struct sockaddr_storage peerAddr;
+    int port = 8080, n, nthreads, i;
+    pthread_t thread;
+
+    /* one listener per worker, all on the same port */
+    n = workers > 0 ? workers : 1;
+    if (!(listeners = calloc(n, sizeof(int))))
+	return;
+
+    for (i = 0; i < n; i++)
+	if ((listeners[i] = openListener(&port, i == 0)) == -1)
+	    goto cleanup;
+
+    if (verbose)
+	logSockInfo(listeners[0], 0);
+
+    /* the event-driven modes run a thread per worker, or per CPU */
+    nthreads = workers > 0 ? workers : (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (uring) {
+	if (runUring(listeners, n, nthreads, &deadlines))
+	    goto cleanup;
+	fprintf(stdout, "io_uring unavailable; falling back to %s\n",
+	    reactor ? "-reactor" : "the thread pool");
+    }
+
+    if (reactor) {
+	runReactor(listeners, n, nthreads, &deadlines);
+	goto cleanup;
+    }
+
+    if (!parkStart(resumeSession, dropSession) ||
+	!poolStart(poolSize, serveSession)) {
+	fprintf(stdout, "cannot start the worker pool\n");
+	goto cleanup;
+    }
+
+    for (i = 1; i < n; i++)
+	if (pthread_create(&thread, NULL, acceptThread, (void*) (intptr_t) i) != 0)
+	    fprintf(stdout, "pthread_create error\n");
+
+    if (workers > 0)
+	pinCpu(0);
+    acceptLoop(listeners[0]);
+
+  cleanup:
+    /* I'm sorry, Dr. Dijkstra */
+    while (i-- > 0)
+	close(listeners[i]);
+    free(listeners);
+}
+
+/*
+ * Open a listening socket on `*port'.  When `probe' is set, keep
+ * trying the following ports while they are taken, leaving the one
+ * we got in `*port'.  Listeners of a -workers group share their port
+ * with SO_REUSEPORT, which has the kernel spread connections among
+ * them
+ */
+static int
+openListener(int *port, bool probe)
+{
     struct addrinfo hints, *res, *aux;
-    int connections[IN_QUEUE_SZ];
     int bstatus = -1;
     int ssocket = -1;
-    socklen_t addrSize;
-    int port = 8080, i = 0;;
+    int one = 1;
     char portstr[20] = {0};
-    pthread_t thread;    
-    pthread_attr_t attr;
 
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE;
 
-    snprintf(portstr, 20, "%d", port++);
+    while (true) {
+	snprintf(portstr, 20, "%d", *port);
 
-    if (getaddrinfo(NULL, portstr, &hints, &res) != 0) {
-	fprintf(stdout, "getaddrinfo error: %s\n", strerror(errno));
-	goto cleanup;
-    }
+	if (getaddrinfo(NULL, portstr, &hints, &res) != 0) {
+	    fprintf(stdout, "getaddrinfo error: %s\n", strerror(errno));
+	    return -1;
+	}
 
-    aux = res;
-    while (aux) {
-	if ((ssocket = socket(aux->ai_family, aux->ai_socktype, aux->ai_protocol)) == -1)
-	    continue;
-	if ((bstatus = bind(ssocket, aux->ai_addr, aux->ai_addrlen)) == 0) {
-	    aux = aux->ai_next;
-	    break;
-	} else if (bstatus == -1) {
-	    if (errno == EADDRINUSE) {
-		snprintf(portstr, 20, "%d", port++);
-		freeaddrinfo(res);
-		getaddrinfo(NULL, portstr, &hints, &res);
-		aux = res;
-	    }
+	for (aux = res; aux; aux = aux->ai_next) {
+	    if ((ssocket = socket(aux->ai_family, aux->ai_socktype, aux->ai_protocol)) == -1)
+		continue;
+	    if (workers > 0)
+		setsockopt(ssocket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+	    if ((bstatus = bind(ssocket, aux->ai_addr, aux->ai_addrlen)) == 0)
+		break;
+	    close(ssocket);
 	}
-    }
 
-    freeaddrinfo(res);
+	freeaddrinfo(res);
+
+	if (bstatus == 0 || errno != EADDRINUSE || !probe)
+	    break;
+	(*port)++;
+    }
 
     if (bstatus == -1) {
 	fprintf(stdout, "bind error: %s\n", strerror(errno));
-	goto cleanup;
+	return -1;
     }
 
-    if ((listen(ssocket, IN_QUEUE_SZ)) == -1) {
+    if ((listen(ssocket, SOMAXCONN)) == -1) {
 	fprintf(stdout, "listen error: %s\n", strerror(errno));
-	goto cleanup;
+	close(ssocket);
+	return -1;
     }
 
-    addrSize = sizeof(struct sockaddr_storage);
+    return ssocket;
+}
 
-    if (verbose)
-	logSockInfo(ssocket, 0);
-    
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+/*
+ * Extra listeners of a -workers group get an accept loop
+ * each, pinned to a CPU of its own
+ */
+static void
+*acceptThread(void *data)
+{
+    int i = (intptr_t) data;
 
-    while (true) {
-    
-	connections[i] = accept(ssocket, (struct sockaddr*) &peerAddr, &addrSize);
+    pinCpu(i);
+    acceptLoop(listeners[i]);
+    return NULL;
+}
 
-	if (verbose)
-	    logSockInfo(connections[i], 1);
-       
-	if (pthread_create(&thread, &attr, threadCallback, (void*) &connections[i]) !=0)
+/*
+ * Accept connections and queue them for the worker pool; when
+ * the queue is full, turn them down with a 503 right away
+ */
+static void
+acceptLoop(int ssocket)
+{
+    static const struct timespec acceptBackoff = { 0, 10 * 1000 * 1000 };
+    struct sockaddr_in peer;
+    struct session *s;
+    socklen_t addrSize;
+    int sfd;
+
+    while (true) {
+	addrSize = sizeof(peer);
+	if ((sfd = accept4(ssocket, (struct sockaddr*) &peer, &addrSize,
+	    SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+	    /* out of descriptors (EMFILE...): give the pool time to close some */
+	    if (errno != EINTR && errno != ECONNABORTED)
+		nanosleep(&acceptBackoff, NULL);
 	    continue;
+	}
 
-	i = (i + 1) % IN_QUEUE_SZ;
+	if (!(s = calloc(1, sizeof(struct session)))) {
+	    close(sfd);
+	    continue;
+	}
+	s->fd = sfd;
+	s->peer = peer;
+	s->res.fd = -1;
+	s->park.fd = sfd;
+	s->park.data = s;
+	statsConnOpen();
+
+	if (!poolSubmit(s)) {
+	    send(sfd, unavailable, sizeof(unavailable) - 1, MSG_DONTWAIT);
+	    dropSession(s);
+	    statsRejected();
+	}
     }
+}
 
-    close(ssocket);
+/*
+ * Pin the calling thread to CPU `i' (modulo the CPU count)
+ */
+void
+pinCpu(int i)
+{
+    cpu_set_t set;
 
-  cleanup:
-    /* I'm sorry, Dr. Dijkstra */
-    ;
+    CPU_ZERO(&set);
+    CPU_SET(i % sysconf(_SC_NPROCESSORS_ONLN), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
 }
 
+/*
+ * Take a connection as far as it goes on this pool thread: answer
+ * the requests it has sent, until its peer has to be waited for,
+ * and then leave it in the park
+ */
 static void
-*threadCallback(void* data)
+serveSession(void *data)
 {
-	int sfd = *(int*) data;
-	readRequest(sfd);
-	close(sfd);
-	pthread_exit(NULL);
+	struct session *s = data;
+	char chunk[BODY_BUFF_SZ];
+	off_t sent;
+	int secs;
+
+	while (true) {
+		if (!s->writing) {
+			switch (readRequest(s->fd, &s->in, &s->req)) {
+			case -1:
+				dropSession(s);
+				return;
+			case 0:
+				/* idle, or the rest of a request on its way */
+				if (s->in.len == 0)
+					secs = KEEPALIVE_TIMEOUT;
+				else {
+					if (s->since == 0)
+						s->since = now();
+					secs = deadlines.read - (now() - s->since);
+				}
+				if (secs <= 0 || !parkWait(&s->park, false, secs))
+					dropSession(s);
+				return;
+			}
+
+			s->since = 0;
+			if (!processRequest(s)) {
+				dropSession(s);
+				return;
+			}
+			s->writing = true;
+		}
+
+		/* the response in progress is all the output queued */
+		sent = s->res.sent;
+		switch (sendResponse(s->fd, &s->res, chunk, sizeof(chunk))) {
+		case -1:
+			dropSession(s);
+			return;
+		case 0:
+			/* the write deadline runs from the last progress */
+			if (s->res.sent != sent || s->stalled == 0)
+				s->stalled = now();
+			if ((secs = deadlines.write - (now() - s->stalled)) <= 0 ||
+			    !parkWait(&s->park, true, secs))
+				dropSession(s);
+			return;
+		}
+
+		statsRequest(&s->peer, &s->req, s->res.status, s->res.sent, &s->start);
+		finishResponse(&s->res);
+		if (!s->res.keepAlive) {
+			dropSession(s);
+			return;
+		}
+		consumeRequest(&s->in, &s->req);
+		s->writing = false;
+		s->stalled = 0;
+	}
 }
 
-static void
-readRequest(int sfd) 
+/*
+ * Fill the connection buffer until it holds a whole request: 1
+ * once it does, 0 if the rest has yet to come and -1 if the peer
+ * went away or sent garbage
+ */
+static int
+readRequest(int sfd, struct reqBuff *in, struct httpRequest *req)
 {
-	char *buff;
 	ssize_t nread;
+	int status;
+
+	while ((status = parseRequest(in->data, in->len, req)) == 0) {
+		if (in->len == sizeof(in->data))
+			return -1; /* header too large */
 
-	buff = (char *) calloc((long)PACKET_BUFF_SZ, sizeof(char));
+		nread = read(sfd, in->data + in->len, sizeof(in->data) - in->len);
 
-	if (!buff)
-		return;
-	
-	/* read request line */
-	nread = readLine(sfd, buff, (long) PACKET_BUFF_SZ);
+		if (nread == -1 && errno == EINTR)
+			continue;
+		if (nread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (nread <= 0)
+			return -1;
 
-	/* ignore request headers -- we don't need them :) */
-	while(true) {
-		char tmp[PACKET_BUFF_SZ] = {'\0'};
-		readLine(sfd, tmp, (long) PACKET_BUFF_SZ);
-		if (strcmp(tmp, "\r\n") == 0)
-			break;
+		in->len += nread;
 	}
 
-	processRequest(sfd, buff, nread);
-	free(buff);
+	return status;
 }
 
-static void
-processRequest(int sfd, char *buff, ssize_t sz)
+/*
+ * Set up the response to the request just read; false if there
+ * is none to give
+ */
+static bool
+processRequest(struct session *s)
 {
-    char *reqLine[3];
-    char *aux;
-	(void) sz;
-
-    aux = strtok(buff, " ");
-    reqLine[0] = aux;
-    aux = strtok(NULL, " ");
-    reqLine[1] = aux;
-    aux = strtok(NULL, " ");
-    reqLine[2] = aux;
-   
-    if (strcmp(reqLine[0], "GET") == 0)
-	processGETReq(sfd, reqLine);
+    if (!viewEq(s->req.method, "GET"))
+	return false;
+
+    s->nreq++;
+    return processGETReq(s, requestKeepAlive(&s->req) &&
+	s->nreq < KEEPALIVE_MAX);
 }
 
-static void
-processGETReq(int sfd, char **reqLine)
+static bool
+processGETReq(struct session *s, bool keepAlive)
 {
-	FILE *fp = NULL;
-	char ch;
-
-	if (strlen(reqLine[1]) == 1)
-		reqLine[1] = "/index.html";
-
-	if ((fp = fopen(reqLine[1] + 1, "r")) != NULL) {
-		writeHeader(sfd, found_header, sizeof(found_header) / sizeof(char*));
-		while ((ch = fgetc(fp)) != EOF)
-			write(sfd, &ch, 1);
-		fclose(fp);
-    }
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+	prepareResponse(&s->res, &s->req, keepAlive);
 
-    else {
+	return s->res.iovCnt != 0;
+}
 
-	if (!(fp = fopen("errors/404.html", "r")))
-	    return;
+/*
+ * From the park: a connection ready to move on goes back to the
+ * pool, and one stuck for too long is let go
+ */
+static void
+resumeSession(void *data)
+{
+	if (!poolSubmit(data))
+		dropSession(data);
+}
 
-	writeHeader(sfd, not_found_header, sizeof(not_found_header)/sizeof(char*));
-	while ((ch = fgetc(fp)) != EOF)
-	    write(sfd, &ch, 1);
+static void
+dropSession(void *data)
+{
+	struct session *s = data;
 
-	fclose(fp);
-    }
+	close(s->fd);
+	finishResponse(&s->res);
+	statsConnClose();
+	free(s);
 }
 
-
-static void
-writeHeader(int sfd, const char *header[], int sz)
+static time_t
+now(void)
 {
-	int i;
-	for (i = 0; i < sz; i++)
-	writeLine(sfd, header[i], strlen(header[i]));
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
 }
 
 static void
@@ -264,6 +528,21 @@ printHelp(int argc, char **argv)
 	(void) argc;
 	fprintf(stdout, "USAGE: %s <options>\n", argv[0]);
 	fprintf(stdout, "\n<options>\n");
-	fprintf(stdout, "-start: start the webserver\n-verbose: activate"
-		" verbose mode\n");
+	fprintf(stdout, "-start: start the webserver\n-verbose: write an"
+		" access log to stdout\n");
+	fprintf(stdout, "-reactor: serve connections from an epoll event loop"
+		" on a fixed set of threads\n");
+	fprintf(stdout, "-uring: do all socket and file I/O through io_uring,"
+		" from a fixed set of threads; falls back to the other modes\n");
+	fprintf(stdout, "-nocache: always read files from disk\n");
+	fprintf(stdout, "-snapshot: pack %s into memory at startup and serve"
+		" it from there; later changes are not seen\n", PAGES_DIR);
+	fprintf(stdout, "-pool N: serve connections on N threads (default %d);"
+		" not with -reactor\n", POOL_SZ);
+	fprintf(stdout, "-readtimeout S: drop a connection whose request takes"
+		" longer than S seconds to come in (default %d)\n", READ_TIMEOUT);
+	fprintf(stdout, "-writetimeout S: drop a connection whose peer takes"
+		" nothing sent for S seconds (default %d)\n", WRITE_TIMEOUT);
+	fprintf(stdout, "-workers N: accept on N listeners sharing the port"
+		" (SO_REUSEPORT), each on a thread pinned to a CPU\n");
 }
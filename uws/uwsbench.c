@@ -0,0 +1,602 @@
+/*
+ * uwsbench: HTTP load generator for uws.  Keeps N connections
+ * busy with GETs for the files under pages/ (or the paths given),
+ * over persistent connections or a new one per request, and
+ * reports throughput and a latency histogram.
+ *
+ * Each thread runs its own epoll loop over its share of the
+ * connections; per-thread counters are merged at the end.
+ */
+
+#define _GNU_SOURCE /* memmem, strcasestr */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "include/uws.h"
+#include "util.h"
+
+#define BENCH_BUFF_SZ 16384
+#define BENCH_EVENTS 256
+#define MAX_PATHS 4096
+
+/*
+ * Latency histogram, in microseconds: exact below 32us, then 16
+ * buckets per power of two (so within ~6%), up to 2^40us
+ */
+#define HIST_SUB 16
+#define HIST_SZ ((40 - 4) * HIST_SUB + 2 * HIST_SUB)
+
+struct stats {
+	long requests;
+	long errors;
+	long non2xx;
+	long bytes;
+	long hist[HIST_SZ];
+	long max;
+};
+
+enum clientState {
+	CL_CONNECTING,
+	CL_SENDING,
+	CL_RECEIVING
+};
+
+struct client {
+	int fd;
+	enum clientState state;
+	int next;                  /* index of the next path to ask for */
+	char req[PATH_MAX + 128];
+	size_t reqLen;
+	size_t reqOff;
+	char head[BENCH_BUFF_SZ];  /* response header, until complete */
+	size_t headLen;
+	long need;                 /* body bytes still due, -1 if until EOF */
+	bool closing;              /* server said Connection: close */
+	struct timespec start;
+};
+
+struct benchThread {
+	pthread_t thread;
+	int nclients;
+	int first;                 /* spreads the clients over the paths */
+	struct stats st;
+};
+
+static void *benchLoop(void *data);
+static void startClient(int epfd, struct client *cl, struct stats *st);
+static void driveClient(int epfd, struct client *cl, struct stats *st);
+static int  sendRequest(struct client *cl);
+static int  readResponse(struct client *cl, struct stats *st);
+static void nextRequest(struct client *cl);
+static void finishRequest(int epfd, struct client *cl, struct stats *st);
+static void dropClient(int epfd, struct client *cl, struct stats *st);
+static void runBench(bool keepAlive);
+static void findPaths(const char *dir, const char *prefix);
+static void record(struct stats *st, long usecs);
+static int  bucket(long usecs);
+static long bucketLow(int b);
+static long percentile(struct stats *st, double p);
+static void printUsecs(const char *label, long usecs);
+static void printReport(struct stats *st, double secs, bool keepAlive);
+static long usecsSince(struct timespec *start);
+static void showHelp(void);
+
+static struct addrinfo *server;
+static const char *host = "localhost";
+static const char *port = PORT_NUM;
+static int nconns = 64;
+static int nthreads = 4;
+static int duration = 10;
+static bool keepAlive;
+static volatile bool stop;
+
+static char *paths[MAX_PATHS];
+static int npaths;
+
+int
+main(int argc, char **argv)
+{
+	struct addrinfo hints;
+	bool withKA = true, withoutKA = true;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "c:t:d:h:p:kK")) != -1) {
+		switch (opt) {
+		case 'c':
+			nconns = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'h':
+			host = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'k':
+			withoutKA = false;
+			break;
+		case 'K':
+			withKA = false;
+			break;
+		default:
+			showHelp();
+		}
+	}
+
+	if (nconns < 1 || nthreads < 1 || duration < 1)
+		showHelp();
+	if (nthreads > nconns)
+		nthreads = nconns;
+
+	for (i = optind; i < argc && npaths < MAX_PATHS; i++)
+		paths[npaths++] = argv[i];
+	if (npaths == 0)
+		findPaths("pages", "/");
+	if (npaths == 0)
+		fatal("uwsbench: no paths to request\n");
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &server) != 0)
+		fatal("uwsbench: cannot resolve %s:%s\n", host, port);
+
+	if (withKA)
+		runBench(true);
+	if (withoutKA)
+		runBench(false);
+
+	freeaddrinfo(server);
+	return EXIT_SUCCESS;
+}
+
+static void
+runBench(bool ka)
+{
+	struct benchThread *threads;
+	struct timespec start;
+	struct stats total;
+	int i, j;
+
+	if (!(threads = calloc(nthreads, sizeof(struct benchThread))))
+		fatal("uwsbench: out of memory\n");
+
+	keepAlive = ka;
+	stop = false;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < nthreads; i++) {
+		threads[i].nclients = nconns / nthreads + (i < nconns % nthreads);
+		threads[i].first = i * (nconns / nthreads);
+		if (pthread_create(&threads[i].thread, NULL, benchLoop, &threads[i]) != 0)
+			fatal("uwsbench: cannot start threads\n");
+	}
+
+	sleep(duration);
+	stop = true;
+
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		total.requests += threads[i].st.requests;
+		total.errors += threads[i].st.errors;
+		total.non2xx += threads[i].st.non2xx;
+		total.bytes += threads[i].st.bytes;
+		if (threads[i].st.max > total.max)
+			total.max = threads[i].st.max;
+		for (j = 0; j < HIST_SZ; j++)
+			total.hist[j] += threads[i].st.hist[j];
+	}
+
+	printReport(&total, usecsSince(&start) / 1e6, ka);
+	free(threads);
+}
+
+static void *
+benchLoop(void *data)
+{
+	struct benchThread *t = data;
+	struct epoll_event events[BENCH_EVENTS];
+	struct client *clients;
+	int epfd, i, n;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		fatal("uwsbench: epoll_create1: %s\n", strerror(errno));
+	if (!(clients = calloc(t->nclients, sizeof(struct client))))
+		fatal("uwsbench: out of memory\n");
+
+	for (i = 0; i < t->nclients; i++) {
+		clients[i].next = (t->first + i) % npaths;
+		startClient(epfd, &clients[i], &t->st);
+	}
+
+	while (!stop) {
+		if ((n = epoll_wait(epfd, events, BENCH_EVENTS, 100)) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < n && !stop; i++)
+			driveClient(epfd, events[i].data.ptr, &t->st);
+	}
+
+	for (i = 0; i < t->nclients; i++)
+		if (clients[i].fd > 0)
+			close(clients[i].fd);
+
+	close(epfd);
+	free(clients);
+	return NULL;
+}
+
+/*
+ * Open a new connection for `cl' and queue its next request; the
+ * clock starts now, so per-connection runs pay for the handshake
+ */
+static void
+startClient(int epfd, struct client *cl, struct stats *st)
+{
+	struct epoll_event ev;
+	int one = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &cl->start);
+
+	if ((cl->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+		fatal("uwsbench: socket: %s\n", strerror(errno));
+	setsockopt(cl->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (connect(cl->fd, server->ai_addr, server->ai_addrlen) == -1 &&
+	    errno != EINPROGRESS) {
+		st->errors++;
+		close(cl->fd);
+		cl->fd = -1;
+		return;
+	}
+
+	cl->state = CL_CONNECTING;
+	nextRequest(cl);
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = cl;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, cl->fd, &ev) == -1)
+		fatal("uwsbench: epoll_ctl: %s\n", strerror(errno));
+}
+
+static void
+driveClient(int epfd, struct client *cl, struct stats *st)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	while (true) {
+		switch (cl->state) {
+		case CL_CONNECTING:
+			if (getsockopt(cl->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+				dropClient(epfd, cl, st);
+				return;
+			}
+			cl->state = CL_SENDING;
+			/* FALLTHROUGH */
+		case CL_SENDING:
+			switch (sendRequest(cl)) {
+			case -1:
+				dropClient(epfd, cl, st);
+				return;
+			case 0:
+				return;
+			}
+			cl->state = CL_RECEIVING;
+			/* FALLTHROUGH */
+		case CL_RECEIVING:
+			switch (readResponse(cl, st)) {
+			case -1:
+				dropClient(epfd, cl, st);
+				return;
+			case 0:
+				return;
+			}
+			finishRequest(epfd, cl, st);
+			if (cl->state == CL_CONNECTING)
+				return; /* a new connection: wait for it */
+			break;
+		}
+	}
+}
+
+/*
+ * Returns 1 once the whole request is out, 0 if the socket is full
+ */
+static int
+sendRequest(struct client *cl)
+{
+	ssize_t n;
+
+	while (cl->reqOff < cl->reqLen) {
+		if ((n = send(cl->fd, cl->req + cl->reqOff, cl->reqLen - cl->reqOff,
+		    MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN ? 0 : -1;
+		}
+		cl->reqOff += n;
+	}
+
+	return 1;
+}
+
+/*
+ * Read what is there of the response; 1 once complete, 0 if more
+ * is due, -1 on errors.  Bodies are counted, not kept
+ */
+static int
+readResponse(struct client *cl, struct stats *st)
+{
+	char buff[BENCH_BUFF_SZ];
+	char *end, *clen;
+	ssize_t n;
+	size_t extra;
+
+	while (true) {
+		if (cl->need == -2 && cl->headLen == sizeof(cl->head) - 1)
+			return -1; /* header too large */
+
+		if (cl->need == -2)
+			n = read(cl->fd, cl->head + cl->headLen,
+			    sizeof(cl->head) - 1 - cl->headLen);
+		else
+			n = read(cl->fd, buff, sizeof(buff));
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN ? 0 : -1;
+		}
+		if (n == 0) /* EOF ends a body without a length, and nothing else */
+			return cl->need == -1 ? 1 : -1;
+
+		st->bytes += n;
+
+		if (cl->need != -2) {
+			if (cl->need >= 0 && (cl->need -= n) <= 0)
+				return 1;
+			continue;
+		}
+
+		/* still on the header */
+		cl->headLen += n;
+		cl->head[cl->headLen] = '\0';
+		if (!(end = memmem(cl->head, cl->headLen, "\r\n\r\n", 4)))
+			continue;
+
+		*end = '\0';
+		if (strncmp(cl->head, "HTTP/1.1 2", 10) != 0)
+			st->non2xx++;
+		cl->closing = strcasestr(cl->head, "\r\nConnection: close") != NULL;
+		cl->need = (clen = strcasestr(cl->head, "\r\nContent-Length:")) ?
+		    atol(clen + 17) : -1;
+
+		extra = cl->headLen - (end + 4 - cl->head);
+		if (cl->need >= 0 && (cl->need -= extra) <= 0)
+			return 1;
+	}
+}
+
+/*
+ * Set up the request for the next path in line
+ */
+static void
+nextRequest(struct client *cl)
+{
+	cl->reqLen = snprintf(cl->req, sizeof(cl->req),
+	    "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+	    paths[cl->next], host, keepAlive ? "keep-alive" : "close");
+	cl->next = (cl->next + 1) % npaths;
+	cl->reqOff = 0;
+	cl->headLen = 0;
+	cl->need = -2; /* header not seen yet */
+	cl->closing = false;
+}
+
+static void
+finishRequest(int epfd, struct client *cl, struct stats *st)
+{
+	st->requests++;
+	record(st, usecsSince(&cl->start));
+
+	if (keepAlive && !cl->closing) {
+		clock_gettime(CLOCK_MONOTONIC, &cl->start);
+		nextRequest(cl);
+		cl->state = CL_SENDING;
+		return;
+	}
+
+	close(cl->fd);
+	startClient(epfd, cl, st);
+}
+
+static void
+dropClient(int epfd, struct client *cl, struct stats *st)
+{
+	st->errors++;
+	close(cl->fd);
+	if (!stop)
+		startClient(epfd, cl, st);
+}
+
+/*
+ * Collect every file under `dir' as a path to request
+ */
+static void
+findPaths(const char *dir, const char *prefix)
+{
+	char sub[PATH_MAX], subPrefix[PATH_MAX];
+	struct dirent *de;
+	DIR *dp;
+
+	if (!(dp = opendir(dir)))
+		return;
+
+	while ((de = readdir(dp)) && npaths < MAX_PATHS) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(sub, sizeof(sub), "%s/%s", dir, de->d_name);
+		snprintf(subPrefix, sizeof(subPrefix), "%s%s", prefix, de->d_name);
+		if (de->d_type == DT_DIR) {
+			strncat(subPrefix, "/", sizeof(subPrefix) - strlen(subPrefix) - 1);
+			findPaths(sub, subPrefix);
+		} else if (de->d_type == DT_REG)
+			paths[npaths++] = strdup(subPrefix);
+	}
+
+	closedir(dp);
+}
+
+static void
+record(struct stats *st, long usecs)
+{
+	st->hist[bucket(usecs)]++;
+	if (usecs > st->max)
+		st->max = usecs;
+}
+
+static int
+bucket(long usecs)
+{
+	int mag;
+
+	if (usecs < 2 * HIST_SUB)
+		return usecs < 0 ? 0 : usecs;
+
+	/* mag >= 5: keep the top 5 bits */
+	mag = 63 - __builtin_clzl(usecs);
+	if (mag >= 40)
+		return HIST_SZ - 1;
+	return (mag - 4) * HIST_SUB + (usecs >> (mag - 4));
+}
+
+static long
+bucketLow(int b)
+{
+	int shift;
+
+	if (b < 2 * HIST_SUB)
+		return b;
+	shift = b / HIST_SUB - 1;
+	return (long) (b - shift * HIST_SUB) << shift;
+}
+
+static long
+percentile(struct stats *st, double p)
+{
+	long seen = 0, want = st->requests * p;
+	int b;
+
+	for (b = 0; b < HIST_SZ; b++)
+		if ((seen += st->hist[b]) > want)
+			return bucketLow(b);
+
+	return st->max;
+}
+
+static void
+printUsecs(const char *label, long usecs)
+{
+	if (usecs < 1000)
+		printf("  %-6s %7ldus\n", label, usecs);
+	else if (usecs < 1000000)
+		printf("  %-6s %7.2fms\n", label, usecs / 1e3);
+	else
+		printf("  %-6s %7.2fs\n", label, usecs / 1e6);
+}
+
+static void
+printReport(struct stats *st, double secs, bool ka)
+{
+	long rows[41] = {0};
+	long top = 0;
+	int b, r, first = -1, last = 0;
+
+	printf("%s:%s, %d connections on %d threads, %s, %.1fs\n", host, port,
+	    nconns, nthreads, ka ? "keep-alive" : "connection per request", secs);
+	printf("  requests %ld (%.0f req/s), %.2f MB/s, errors %ld, non-2xx %ld\n",
+	    st->requests, st->requests / secs, st->bytes / secs / 1e6, st->errors,
+	    st->non2xx);
+
+	if (st->requests == 0)
+		return;
+
+	printf("latency:\n");
+	printUsecs("p50", percentile(st, 0.50));
+	printUsecs("p99", percentile(st, 0.99));
+	printUsecs("p99.9", percentile(st, 0.999));
+	printUsecs("max", st->max);
+
+	/* one row per power of two */
+	for (b = 0; b < HIST_SZ; b++) {
+		r = b ? 64 - __builtin_clzl(bucketLow(b)) : 0;
+		rows[r] += st->hist[b];
+	}
+	for (r = 0; r < 41; r++) {
+		if (!rows[r])
+			continue;
+		if (first == -1)
+			first = r;
+		last = r;
+		if (rows[r] > top)
+			top = rows[r];
+	}
+
+	printf("histogram:\n");
+	for (r = first; r <= last; r++) {
+		printf("  < %8ldus %10ld |", 1L << r, rows[r]);
+		for (b = 0; b < rows[r] * 50 / top; b++)
+			putchar('#');
+		putchar('\n');
+	}
+}
+
+static long
+usecsSince(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000L +
+	    (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void
+showHelp(void)
+{
+	fprintf(stderr, "usage: uwsbench [-c conns] [-t threads] [-d secs]"
+	    " [-h host] [-p port] [-k | -K] [path...]\n");
+	fprintf(stderr, "\t-c: concurrent connections (default 64)\n");
+	fprintf(stderr, "\t-t: client threads (default 4)\n");
+	fprintf(stderr, "\t-d: seconds per run (default 10)\n");
+	fprintf(stderr, "\t-k: only run with keep-alive\n");
+	fprintf(stderr, "\t-K: only run with a connection per request\n");
+	fprintf(stderr, "\tpaths default to every file under pages/\n");
+	exit(EXIT_FAILURE);
+}